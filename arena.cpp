@@ -0,0 +1,44 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "arena.h"
+#include <assert.h>
+
+Arena::Arena(size_t slabSize)
+{
+	m_slabs = NULL;
+	m_pos = m_end = NULL;
+	m_slabSize = slabSize;
+	m_allocated = 0;
+}
+
+Arena::~Arena()
+{
+	Clear();
+}
+
+void Arena::Clear()
+{
+	while (m_slabs)
+	{
+		char *prev = *reinterpret_cast<char **>(m_slabs);
+		free(m_slabs);
+		m_slabs = prev;
+	}
+
+	m_pos = m_end = NULL;
+	m_allocated = 0;
+}
+
+void Arena::NewSlab(size_t minSize)
+{
+	size_t size = sizeof(char *) + (minSize > m_slabSize ? minSize : m_slabSize);
+	char *slab = static_cast<char *>(malloc(size));
+	assert(slab);
+
+	*reinterpret_cast<char **>(slab) = m_slabs;
+	m_slabs = slab;
+	m_pos = slab + sizeof(char *);
+	m_end = slab + size;
+	m_allocated += size;
+}
@@ -0,0 +1,64 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h>
+
+// hands out memory from big slabs, for the many small objects that all live as long as the data.
+// single objects can't be freed, everything goes at once in Clear() or the destructor.
+// destructors of objects in the arena are never called, so only put objects there that don't own
+// anything else. allocate with new (arena) Foo(...), and never delete the result
+class Arena
+{
+	public:
+		Arena(size_t slabSize = 1024 * 1024);
+		~Arena();
+
+		// the default alignment is enough for everything we put in here, strings can use 1
+		void *Alloc(size_t size, size_t align = sizeof(void *))
+		{
+			size_t pad = (align - reinterpret_cast<size_t>(m_pos) % align) % align;
+
+			if (size + pad > static_cast<size_t>(m_end - m_pos))
+			{
+				NewSlab(size);
+				pad = 0;
+			}
+
+			void *ret = m_pos + pad;
+			m_pos += pad + size;
+
+			return ret;
+		}
+
+		// frees all objects
+		void Clear();
+
+		size_t GetMemoryUsage()
+		{
+			return m_allocated;
+		}
+
+	private:
+		void NewSlab(size_t minSize);
+
+		// slabs start with a pointer to the previous slab
+		char *m_slabs;
+		char *m_pos, *m_end;
+		size_t m_slabSize;
+		size_t m_allocated;
+};
+
+inline void *operator new(size_t size, Arena *arena)
+{
+	return arena->Alloc(size);
+}
+
+// only used when a constructor throws
+inline void operator delete(void *, Arena *)
+{
+}
+
+#endif
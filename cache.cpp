@@ -0,0 +1,892 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "cache.h"
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static char const cacheMagic[8] = { 'O', 'S', 'M', 'B', 'C', 'A', 'C', 'H' };
+#define CACHE_BYTEORDER 0x01020304
+
+WX_DECLARE_HASH_MAP(wxUint64, wxUint32, wxIntegerHash, wxIntegerEqual, TagPairMapper);
+
+// ----------------------------------------------------------------------------
+// writing
+// ----------------------------------------------------------------------------
+
+class SectionWriter
+{
+	public:
+		SectionWriter(FILE *f, CacheHeader *header)
+		{
+			m_file = f;
+			m_header = header;
+			m_pos = 0;
+			m_start = 0;
+			m_cur = CS_NUMSECTIONS;
+		}
+
+		void Begin(CACHESECTION s)
+		{
+			assert(m_cur == CS_NUMSECTIONS);
+
+			static char const zeros[8] = { 0 };
+			if (m_pos % 8)
+			{
+				Write(zeros, 8 - m_pos % 8);
+			}
+
+			m_cur = s;
+			m_start = m_pos;
+			m_header->m_sections[s].m_offset = m_pos;
+		}
+
+		void End()
+		{
+			assert(m_cur != CS_NUMSECTIONS);
+			m_header->m_sections[m_cur].m_size = m_pos - m_start;
+			m_cur = CS_NUMSECTIONS;
+		}
+
+		void Write(void const *data, size_t size)
+		{
+			size_t ret = fwrite(data, 1, size, m_file);
+			assert(ret == size);
+			m_pos += ret;
+		}
+
+		void WriteU32(wxUint32 v)
+		{
+			Write(&v, sizeof(v));
+		}
+
+		void WriteI32(wxInt32 v)
+		{
+			Write(&v, sizeof(v));
+		}
+
+	private:
+		FILE *m_file;
+		CacheHeader *m_header;
+		wxUint64 m_pos, m_start;
+		CACHESECTION m_cur;
+};
+
+// collects the distinct tags (as key/value pairs of the tagstore) of all objects
+class TagPairs
+{
+	public:
+		TagPairs()
+		{
+			m_max = 1024;
+			m_num = 0;
+			m_pairs = new TagIndex[m_max];
+		}
+
+		~TagPairs()
+		{
+			delete [] m_pairs;
+		}
+
+		wxUint32 Add(TagIndex t)
+		{
+			wxUint64 key = (static_cast<wxUint64>(t.m_keyIndex) << 32) | t.m_valueIndex;
+
+			TagPairMapper::iterator f = m_mapper.find(key);
+
+			if (f != m_mapper.end())
+			{
+				return f->second;
+			}
+
+			if (m_num >= m_max)
+			{
+				m_max *= 2;
+				TagIndex *n = new TagIndex[m_max];
+				memcpy(n, m_pairs, sizeof(TagIndex) * m_num);
+				delete [] m_pairs;
+				m_pairs = n;
+			}
+
+			m_pairs[m_num] = t;
+			m_mapper[key] = m_num;
+
+			return m_num++;
+		}
+
+		wxUint32 Find(TagIndex t)
+		{
+			wxUint64 key = (static_cast<wxUint64>(t.m_keyIndex) << 32) | t.m_valueIndex;
+
+			return m_mapper[key];
+		}
+
+		void AddAll(IdObjectStore *store)
+		{
+			unsigned count = store->GetCount();
+			for (unsigned i = 0; i < count; i++)
+			{
+				TagList const &tags = static_cast<IdObjectWithTags *>(store->GetBySlot(i))->m_tags;
+				for (unsigned j = 0; j < tags.GetSize(); j++)
+				{
+					Add(tags.Get(j));
+				}
+			}
+		}
+
+		void AddAll(NodeStore *nodes, unsigned const *tagged, unsigned numTagged)
+		{
+			for (unsigned i = 0; i < numTagged; i++)
+			{
+				TagList const *tags = nodes->GetTags(tagged[i]);
+				for (unsigned j = 0; j < tags->GetSize(); j++)
+				{
+					Add(tags->Get(j));
+				}
+			}
+		}
+
+		TagIndex *m_pairs;
+		wxUint32 m_num;
+
+	private:
+		wxUint32 m_max;
+		TagPairMapper m_mapper;
+};
+
+static unsigned NumTags(IdObjectWithTags *o)
+{
+	return o->m_tags.GetSize();
+}
+
+static void WriteTags(SectionWriter *w, TagPairs *pairs, IdObjectStore *store)
+{
+	unsigned count = store->GetCount();
+
+	for (unsigned i = 0; i < count; i++)
+	{
+		TagList const &tags = static_cast<IdObjectWithTags *>(store->GetBySlot(i))->m_tags;
+		for (unsigned j = 0; j < tags.GetSize(); j++)
+		{
+			w->WriteU32(pairs->Find(tags.Get(j)));
+		}
+	}
+}
+
+static void WriteNodeTags(SectionWriter *w, TagPairs *pairs, NodeStore *nodes, unsigned const *tagged, unsigned numTagged)
+{
+	for (unsigned i = 0; i < numTagged; i++)
+	{
+		TagList const *tags = nodes->GetTags(tagged[i]);
+		for (unsigned j = 0; j < tags->GetSize(); j++)
+		{
+			w->WriteU32(pairs->Find(tags->Get(j)));
+		}
+	}
+}
+
+static void WriteIds(SectionWriter *w, CACHESECTION s, IdObjectStore *store)
+{
+	unsigned count = store->GetCount();
+
+	w->Begin(s);
+	for (unsigned i = 0; i < count; i++)
+	{
+		OsmId id = store->GetBySlot(i)->m_id;
+		w->Write(&id, sizeof(id));
+	}
+	w->End();
+}
+
+// writes count + 1 offsets. tagOffset is the running position in the tags section
+static void WriteTagOffsets(SectionWriter *w, CACHESECTION s, IdObjectStore *store, wxUint32 *tagOffset)
+{
+	unsigned count = store->GetCount();
+
+	w->Begin(s);
+	for (unsigned i = 0; i < count; i++)
+	{
+		w->WriteU32(*tagOffset);
+		*tagOffset += NumTags(static_cast<IdObjectWithTags *>(store->GetBySlot(i)));
+	}
+	w->WriteU32(*tagOffset);
+	w->End();
+}
+
+static void WriteNodeRefs(SectionWriter *w, CACHESECTION offsetSection, CACHESECTION refSection, IdObjectStore *store)
+{
+	unsigned count = store->GetCount();
+	wxUint32 offset = 0;
+
+	w->Begin(offsetSection);
+	for (unsigned i = 0; i < count; i++)
+	{
+		w->WriteU32(offset);
+		offset += static_cast<OsmWay *>(store->GetBySlot(i))->m_numResolvedNodes;
+	}
+	w->WriteU32(offset);
+	w->End();
+
+	w->Begin(refSection);
+	for (unsigned i = 0; i < count; i++)
+	{
+		OsmWay *way = static_cast<OsmWay *>(store->GetBySlot(i));
+
+		// node indices are the positions in the node columns, so they can be written as they are
+		w->Write(way->m_resolvedNodes, sizeof(wxUint32) * way->m_numResolvedNodes);
+	}
+	w->End();
+}
+
+void write_cache(OsmData *d, FILE *f)
+{
+	CacheHeader header;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.m_magic, cacheMagic, sizeof(cacheMagic));
+	header.m_version = CACHE_VERSION;
+	header.m_byteOrder = CACHE_BYTEORDER;
+	header.m_numSections = CS_NUMSECTIONS;
+	header.m_minlat = d->m_minlat;
+	header.m_maxlat = d->m_maxlat;
+	header.m_minlon = d->m_minlon;
+	header.m_maxlon = d->m_maxlon;
+
+	SectionWriter w(f, &header);
+
+	// placeholder, the real header is written when all offsets are known
+	w.Write(&header, sizeof(header));
+
+	printf("writing strings...\n");
+	unsigned numTagged = 0;
+	unsigned *tagged = d->m_nodes.GetTaggedNodes(&numTagged);
+
+	TagPairs pairs;
+	pairs.AddAll(&(d->m_nodes), tagged, numTagged);
+	pairs.AddAll(&(d->m_ways));
+	pairs.AddAll(&(d->m_relations));
+
+	TagStore *tagStore = OsmTag::GetTagStore();
+
+	// one string per key, and one per distinct value
+	unsigned numKeys = tagStore->GetNumKeys();
+	unsigned numValues = tagStore->GetNumValues();
+	wxUint32 *keyStrings = new wxUint32[numKeys];
+	wxUint32 *valueIdStrings = new wxUint32[numValues];
+	wxUint32 *valueStrings = new wxUint32[pairs.m_num];
+	char const **strings = new char const *[numKeys + pairs.m_num];
+	wxUint32 numStrings = 0;
+
+	memset(keyStrings, 0xFF, sizeof(wxUint32) * numKeys);
+	memset(valueIdStrings, 0xFF, sizeof(wxUint32) * numValues);
+
+	for (wxUint32 i = 0; i < pairs.m_num; i++)
+	{
+		TagIndex t = pairs.m_pairs[i];
+		if (keyStrings[t.m_keyIndex] == CACHE_INVALID)
+		{
+			keyStrings[t.m_keyIndex] = numStrings;
+			strings[numStrings++] = tagStore->GetKey(t);
+		}
+
+		if (t.m_valueIndex)
+		{
+			// values are shared between keys
+			wxUint32 &v = valueIdStrings[t.m_valueIndex - 1];
+			if (v == CACHE_INVALID)
+			{
+				v = numStrings;
+				strings[numStrings++] = tagStore->GetValue(t);
+			}
+			valueStrings[i] = v;
+		}
+		else
+		{
+			valueStrings[i] = CACHE_INVALID;
+		}
+	}
+
+	wxUint64 stringOffset = 0;
+	w.Begin(CS_STRINGOFFSETS);
+	for (wxUint32 i = 0; i < numStrings; i++)
+	{
+		w.Write(&stringOffset, sizeof(stringOffset));
+		stringOffset += strlen(strings[i]) + 1;
+	}
+	w.Write(&stringOffset, sizeof(stringOffset));
+	w.End();
+
+	w.Begin(CS_STRINGS);
+	for (wxUint32 i = 0; i < numStrings; i++)
+	{
+		w.Write(strings[i], strlen(strings[i]) + 1);
+	}
+	w.End();
+
+	w.Begin(CS_TAGPAIRS);
+	for (wxUint32 i = 0; i < pairs.m_num; i++)
+	{
+		w.WriteU32(keyStrings[pairs.m_pairs[i].m_keyIndex]);
+		w.WriteU32(valueStrings[i]);
+	}
+	w.End();
+
+	delete [] strings;
+	delete [] keyStrings;
+	delete [] valueIdStrings;
+	delete [] valueStrings;
+
+	w.Begin(CS_TAGS);
+	WriteNodeTags(&w, &pairs, &(d->m_nodes), tagged, numTagged);
+	WriteTags(&w, &pairs, &(d->m_ways));
+	WriteTags(&w, &pairs, &(d->m_relations));
+	w.End();
+
+	printf("writing nodes...\n");
+	unsigned numNodes = d->m_nodes.GetCount();
+
+	// the node columns have the same layout as the sections
+	w.Begin(CS_NODEIDS);
+	w.Write(d->m_nodes.m_ids, sizeof(OsmId) * numNodes);
+	w.End();
+
+	w.Begin(CS_NODELAT);
+	w.Write(d->m_nodes.m_ilat, sizeof(wxInt32) * numNodes);
+	w.End();
+
+	w.Begin(CS_NODELON);
+	w.Write(d->m_nodes.m_ilon, sizeof(wxInt32) * numNodes);
+	w.End();
+
+	wxUint32 tagOffset = 0;
+	w.Begin(CS_NODETAGS);
+	for (unsigned i = 0; i < numTagged; i++)
+	{
+		unsigned num = d->m_nodes.GetTags(tagged[i])->GetSize();
+		w.WriteU32(tagged[i]);
+		w.WriteU32(tagOffset);
+		w.WriteU32(num);
+		tagOffset += num;
+	}
+	w.End();
+
+	delete [] tagged;
+
+	printf("writing ways...\n");
+	unsigned numWays = d->m_ways.GetCount();
+
+	WriteIds(&w, CS_WAYIDS, &(d->m_ways));
+	WriteNodeRefs(&w, CS_WAYNODEOFFSETS, CS_WAYNODES, &(d->m_ways));
+	WriteTagOffsets(&w, CS_WAYTAGOFFSETS, &(d->m_ways), &tagOffset);
+
+	w.Begin(CS_WAYBOUNDS);
+	for (unsigned i = 0; i < numWays; i++)
+	{
+		OsmWay *way = static_cast<OsmWay *>(d->m_ways.GetBySlot(i));
+		wxInt32 minLon = 0x7FFFFFFF, minLat = 0x7FFFFFFF, maxLon = -0x7FFFFFFF, maxLat = -0x7FFFFFFF;
+
+		for (unsigned j = 0; j < way->m_numResolvedNodes; j++)
+		{
+			unsigned n = way->m_resolvedNodes[j];
+			if (n != NODE_INVALID)
+			{
+				wxInt32 ilon = d->m_nodes.m_ilon[n];
+				wxInt32 ilat = d->m_nodes.m_ilat[n];
+				if (ilon < minLon) minLon = ilon;
+				if (ilon > maxLon) maxLon = ilon;
+				if (ilat < minLat) minLat = ilat;
+				if (ilat > maxLat) maxLat = ilat;
+			}
+		}
+
+		w.WriteI32(minLon);
+		w.WriteI32(minLat);
+		w.WriteI32(maxLon);
+		w.WriteI32(maxLat);
+	}
+	w.End();
+
+	// NUMLODBANDS ranges per way, plus the end of the last one
+	wxUint32 lodOffset = 0;
+	w.Begin(CS_WAYLODOFFSETS);
+	for (unsigned i = 0; i < numWays; i++)
+	{
+		OsmWay *way = static_cast<OsmWay *>(d->m_ways.GetBySlot(i));
+
+		for (int b = 0; b < NUMLODBANDS; b++)
+		{
+			w.WriteU32(lodOffset);
+			lodOffset += way->m_numLodNodes[b];
+		}
+	}
+	w.WriteU32(lodOffset);
+	w.End();
+
+	w.Begin(CS_WAYLODNODES);
+	for (unsigned i = 0; i < numWays; i++)
+	{
+		OsmWay *way = static_cast<OsmWay *>(d->m_ways.GetBySlot(i));
+		unsigned const *nodes;
+		unsigned num = way->GetLodNodes(0, &nodes);
+
+		for (int b = 1; b < NUMLODBANDS; b++)
+		{
+			num += way->m_numLodNodes[b];
+		}
+
+		w.Write(nodes, sizeof(wxUint32) * num);
+	}
+	w.End();
+
+	printf("writing relations...\n");
+	unsigned numRelations = d->m_relations.GetCount();
+
+	WriteIds(&w, CS_RELATIONIDS, &(d->m_relations));
+	WriteNodeRefs(&w, CS_RELATIONNODEOFFSETS, CS_RELATIONNODES, &(d->m_relations));
+
+	wxUint32 offset = 0;
+	w.Begin(CS_RELATIONWAYOFFSETS);
+	for (unsigned i = 0; i < numRelations; i++)
+	{
+		w.WriteU32(offset);
+		offset += static_cast<OsmRelation *>(d->m_relations.GetBySlot(i))->m_numResolvedWays;
+	}
+	w.WriteU32(offset);
+	w.End();
+
+	w.Begin(CS_RELATIONWAYS);
+	for (unsigned i = 0; i < numRelations; i++)
+	{
+		OsmRelation *r = static_cast<OsmRelation *>(d->m_relations.GetBySlot(i));
+
+		for (unsigned j = 0; j < r->m_numResolvedWays; j++)
+		{
+			OsmWay *way = r->m_resolvedWays[j];
+			w.WriteU32(way ? d->m_ways.GetSlot(way->m_id) : CACHE_INVALID);
+		}
+	}
+	w.End();
+
+	WriteTagOffsets(&w, CS_RELATIONTAGOFFSETS, &(d->m_relations), &tagOffset);
+
+	fseeko(f, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, f);
+	fseeko(f, 0, SEEK_END);
+
+	printf("done writing\n");
+}
+
+// ----------------------------------------------------------------------------
+// reading
+// ----------------------------------------------------------------------------
+
+MappedCache::MappedCache()
+{
+	m_data = NULL;
+	m_size = 0;
+	m_mapped = false;
+	m_header = NULL;
+}
+
+MappedCache::~MappedCache()
+{
+	if (m_mapped)
+	{
+		munmap(const_cast<unsigned char *>(m_data), m_size);
+	}
+	else
+	{
+		free(const_cast<unsigned char *>(m_data));
+	}
+}
+
+MappedCache *MappedCache::Open(char const *fileName)
+{
+	int fd = open(fileName, O_RDONLY);
+
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(CacheHeader)))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	MappedCache *ret = new MappedCache;
+	ret->m_size = st.st_size;
+
+	void *p = mmap(NULL, ret->m_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	if (p != MAP_FAILED)
+	{
+		ret->m_data = static_cast<unsigned char const *>(p);
+		ret->m_mapped = true;
+	}
+	else
+	{
+		// can't map it, read it instead
+		unsigned char *buffer = static_cast<unsigned char *>(malloc(ret->m_size));
+		size_t done = 0;
+		while (buffer && done < ret->m_size)
+		{
+			ssize_t r = read(fd, buffer + done, ret->m_size - done);
+			if (r <= 0)
+			{
+				free(buffer);
+				buffer = NULL;
+				break;
+			}
+			done += r;
+		}
+
+		ret->m_data = buffer;
+	}
+
+	close(fd);
+
+	if (!ret->m_data)
+	{
+		delete ret;
+		return NULL;
+	}
+
+	ret->m_header = reinterpret_cast<CacheHeader const *>(ret->m_data);
+
+	if (!ret->Validate())
+	{
+		delete ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+bool MappedCache::Validate()
+{
+	if (memcmp(m_header->m_magic, cacheMagic, sizeof(cacheMagic)))
+	{
+		return false;
+	}
+
+	if (m_header->m_version != CACHE_VERSION || m_header->m_byteOrder != CACHE_BYTEORDER || m_header->m_numSections != CS_NUMSECTIONS)
+	{
+		printf("cache file has an unsupported version or byte order\n");
+		return false;
+	}
+
+	for (int i = 0; i < CS_NUMSECTIONS; i++)
+	{
+		CacheSection const &s = m_header->m_sections[i];
+		if ((s.m_offset % 8) || s.m_offset > m_size || s.m_size > m_size - s.m_offset)
+		{
+			printf("cache file is corrupt\n");
+			return false;
+		}
+	}
+
+	unsigned numNodes = Count(CS_NODEIDS, sizeof(OsmId));
+	unsigned numWays = Count(CS_WAYIDS, sizeof(OsmId));
+	unsigned numRelations = Count(CS_RELATIONIDS, sizeof(OsmId));
+
+	if (Count(CS_NODELAT, sizeof(wxInt32)) != numNodes
+		|| Count(CS_NODELON, sizeof(wxInt32)) != numNodes
+		|| Count(CS_WAYNODEOFFSETS, sizeof(wxUint32)) != numWays + 1
+		|| Count(CS_WAYTAGOFFSETS, sizeof(wxUint32)) != numWays + 1
+		|| Count(CS_WAYBOUNDS, 4 * sizeof(wxInt32)) != numWays
+		|| Count(CS_WAYLODOFFSETS, sizeof(wxUint32)) != numWays * NUMLODBANDS + 1
+		|| Count(CS_RELATIONNODEOFFSETS, sizeof(wxUint32)) != numRelations + 1
+		|| Count(CS_RELATIONWAYOFFSETS, sizeof(wxUint32)) != numRelations + 1
+		|| Count(CS_RELATIONTAGOFFSETS, sizeof(wxUint32)) != numRelations + 1
+		|| Count(CS_STRINGOFFSETS, sizeof(wxUint64)) < 1)
+	{
+		printf("cache file is corrupt\n");
+		return false;
+	}
+
+	// the ranges are checked against these when loading, so every offsets array has to be non-decreasing
+	// and end inside the array it indexes
+	if (!CheckOffsets(CS_WAYNODEOFFSETS, CS_WAYNODES)
+		|| !CheckOffsets(CS_WAYTAGOFFSETS, CS_TAGS)
+		|| !CheckOffsets(CS_WAYLODOFFSETS, CS_WAYLODNODES)
+		|| !CheckOffsets(CS_RELATIONNODEOFFSETS, CS_RELATIONNODES)
+		|| !CheckOffsets(CS_RELATIONWAYOFFSETS, CS_RELATIONWAYS)
+		|| !CheckOffsets(CS_RELATIONTAGOFFSETS, CS_TAGS))
+	{
+		printf("cache file is corrupt\n");
+		return false;
+	}
+
+	// every string has to start inside the strings and end in a 0 before the end of the section
+	unsigned numStrings = Count(CS_STRINGOFFSETS, sizeof(wxUint64)) - 1;
+	wxUint64 const *stringOffsets = Get<wxUint64>(CS_STRINGOFFSETS);
+	wxUint64 stringsSize = m_header->m_sections[CS_STRINGS].m_size;
+
+	if (stringOffsets[numStrings] > stringsSize || (numStrings && Get<char>(CS_STRINGS)[stringsSize - 1]))
+	{
+		printf("cache file is corrupt\n");
+		return false;
+	}
+
+	for (unsigned i = 0; i < numStrings; i++)
+	{
+		if (stringOffsets[i] >= stringsSize)
+		{
+			printf("cache file is corrupt\n");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool MappedCache::CheckOffsets(CACHESECTION offsets, CACHESECTION data)
+{
+	unsigned num = Count(offsets, sizeof(wxUint32));
+	wxUint32 const *o = Get<wxUint32>(offsets);
+
+	for (unsigned i = 1; i < num; i++)
+	{
+		if (o[i] < o[i - 1])
+		{
+			return false;
+		}
+	}
+
+	return !num || o[num - 1] <= Count(data, sizeof(wxUint32));
+}
+
+bool MappedCache::GetWayBounds(unsigned slot, DRect *bb)
+{
+	assert(slot < GetNumWays());
+
+	wxInt32 const *b = Get<wxInt32>(CS_WAYBOUNDS) + 4 * slot;
+
+	if (b[0] > b[2])
+	{
+		bb->MakeEmpty();
+		return false;
+	}
+
+	bb->m_x = NodeStore::LonFromFixed(b[0]);
+	bb->m_y = NodeStore::LatFromFixed(b[1]);
+	bb->SetRight(NodeStore::LonFromFixed(b[2]));
+	bb->SetTop(NodeStore::LatFromFixed(b[3]));
+
+	return true;
+}
+
+// collects the tags in [first, first + num) in buf
+static void GetTags(TagBuffer *buf, TagIndex const *pairs, wxUint32 numPairs, wxUint32 const *tags, wxUint32 numTags, wxUint32 first, wxUint32 num)
+{
+	buf->Clear();
+
+	if (first > numTags || num > numTags - first)
+	{
+		return;
+	}
+
+	for (wxUint32 i = 0; i < num; i++)
+	{
+		wxUint32 p = tags[first + i];
+		if (p < numPairs)
+		{
+			buf->Add(pairs[p]);
+		}
+	}
+}
+
+// returns the resolved nodes for the range [offsets[i], offsets[i+1]), or NULL if the range is empty
+static unsigned *ResolveNodes(unsigned numNodes, wxUint32 const *offsets, wxUint32 const *refs, unsigned i, unsigned *num)
+{
+	*num = 0;
+
+	if (offsets[i + 1] <= offsets[i])
+	{
+		return NULL;
+	}
+
+	unsigned n = offsets[i + 1] - offsets[i];
+	unsigned *ret = new unsigned[n];
+
+	for (unsigned j = 0; j < n; j++)
+	{
+		wxUint32 r = refs[offsets[i] + j];
+		ret[j] = r < numNodes ? r : NODE_INVALID;
+	}
+
+	*num = n;
+	return ret;
+}
+
+// the levels of detail of way i. a corrupt range leaves the band empty
+static void LoadLod(OsmWay *w, unsigned numNodes, wxUint32 const *offsets, wxUint32 const *refs, unsigned i)
+{
+	wxUint32 const *o = offsets + i * NUMLODBANDS;
+	wxUint32 end = offsets[i * NUMLODBANDS + NUMLODBANDS];
+	unsigned total = 0;
+
+	for (int b = 0; b < NUMLODBANDS; b++)
+	{
+		w->m_numLodNodes[b] = (o[b + 1] >= o[b] && o[b + 1] <= end) ? o[b + 1] - o[b] : 0;
+		total += w->m_numLodNodes[b];
+	}
+
+	if (!total || o[0] > end || end - o[0] != total)
+	{
+		for (int b = 0; b < NUMLODBANDS; b++)
+		{
+			w->m_numLodNodes[b] = 0;
+		}
+
+		return;
+	}
+
+	w->m_lodNodes = new unsigned[total];
+
+	for (unsigned j = 0; j < total; j++)
+	{
+		wxUint32 r = refs[o[0] + j];
+		w->m_lodNodes[j] = r < numNodes ? r : NODE_INVALID;
+	}
+}
+
+OsmData *MappedCache::Load()
+{
+	unsigned numNodes = Count(CS_NODEIDS, sizeof(OsmId));
+	unsigned numWays = Count(CS_WAYIDS, sizeof(OsmId));
+	unsigned numRelations = Count(CS_RELATIONIDS, sizeof(OsmId));
+
+	OsmData *d = new OsmData;
+	// the node columns are used straight from the file
+	d->Reserve(0, numWays, numRelations);
+	d->m_skipAttribs = true;
+	d->m_minlat = m_header->m_minlat;
+	d->m_maxlat = m_header->m_maxlat;
+	d->m_minlon = m_header->m_minlon;
+	d->m_maxlon = m_header->m_maxlon;
+
+	// intern every distinct tag once
+	printf("reading tags...\n");
+	unsigned numStrings = Count(CS_STRINGOFFSETS, sizeof(wxUint64)) - 1;
+	wxUint64 const *stringOffsets = Get<wxUint64>(CS_STRINGOFFSETS);
+	char const *strings = Get<char>(CS_STRINGS);
+	wxUint32 numPairs = Count(CS_TAGPAIRS, 2 * sizeof(wxUint32));
+	wxUint32 const *pairData = Get<wxUint32>(CS_TAGPAIRS);
+	TagIndex *pairs = new TagIndex[numPairs ? numPairs : 1];
+	TagStore *tagStore = OsmTag::GetTagStore();
+
+	for (wxUint32 i = 0; i < numPairs; i++)
+	{
+		wxUint32 k = pairData[2 * i];
+		wxUint32 v = pairData[2 * i + 1];
+
+		pairs[i] = tagStore->FindOrAdd(k < numStrings ? strings + stringOffsets[k] : "", v < numStrings ? strings + stringOffsets[v] : NULL);
+	}
+
+	wxUint32 const *tags = Get<wxUint32>(CS_TAGS);
+	wxUint32 numTags = Count(CS_TAGS, sizeof(wxUint32));
+
+	printf("reading nodes...\n");
+	OsmId const *ids = Get<OsmId>(CS_NODEIDS);
+	wxInt32 const *lat = Get<wxInt32>(CS_NODELAT);
+	wxInt32 const *lon = Get<wxInt32>(CS_NODELON);
+
+	d->m_nodes.Adopt(numNodes, ids, lat, lon);
+
+	TagBuffer buf;
+	wxUint32 const *nodeTags = Get<wxUint32>(CS_NODETAGS);
+	unsigned numTagged = Count(CS_NODETAGS, 3 * sizeof(wxUint32));
+	for (unsigned i = 0; i < numTagged; i++)
+	{
+		if (nodeTags[3 * i] < numNodes)
+		{
+			GetTags(&buf, pairs, numPairs, tags, numTags, nodeTags[3 * i + 1], nodeTags[3 * i + 2]);
+			d->m_nodes.SetTags(nodeTags[3 * i], buf.m_tags, buf.m_num);
+		}
+	}
+
+	printf("reading ways...\n");
+	ids = Get<OsmId>(CS_WAYIDS);
+	wxUint32 const *nodeOffsets = Get<wxUint32>(CS_WAYNODEOFFSETS);
+	wxUint32 const *nodeRefs = Get<wxUint32>(CS_WAYNODES);
+	wxUint32 const *tagOffsets = Get<wxUint32>(CS_WAYTAGOFFSETS);
+	wxUint32 const *lodOffsets = Get<wxUint32>(CS_WAYLODOFFSETS);
+	wxUint32 const *lodNodes = Get<wxUint32>(CS_WAYLODNODES);
+
+	for (unsigned i = 0; i < numWays; i++)
+	{
+		OsmWay *w = new OsmWay(ids[i]);
+
+		w->m_resolvedNodes = ResolveNodes(numNodes, nodeOffsets, nodeRefs, i, &(w->m_numResolvedNodes));
+		LoadLod(w, numNodes, lodOffsets, lodNodes, i);
+
+		if (tagOffsets[i + 1] > tagOffsets[i])
+		{
+			GetTags(&buf, pairs, numPairs, tags, numTags, tagOffsets[i], tagOffsets[i + 1] - tagOffsets[i]);
+			w->SetTags(&(d->m_arena), buf.m_tags, buf.m_num);
+		}
+
+		d->m_ways.AddObject(w);
+	}
+
+	printf("reading relations...\n");
+	ids = Get<OsmId>(CS_RELATIONIDS);
+	nodeOffsets = Get<wxUint32>(CS_RELATIONNODEOFFSETS);
+	nodeRefs = Get<wxUint32>(CS_RELATIONNODES);
+	wxUint32 const *wayOffsets = Get<wxUint32>(CS_RELATIONWAYOFFSETS);
+	wxUint32 const *wayRefs = Get<wxUint32>(CS_RELATIONWAYS);
+	tagOffsets = Get<wxUint32>(CS_RELATIONTAGOFFSETS);
+
+	for (unsigned i = 0; i < numRelations; i++)
+	{
+		OsmRelation *r = new OsmRelation(ids[i]);
+
+		r->m_resolvedNodes = ResolveNodes(numNodes, nodeOffsets, nodeRefs, i, &(r->m_numResolvedNodes));
+
+		if (wayOffsets[i + 1] > wayOffsets[i])
+		{
+			r->m_numResolvedWays = wayOffsets[i + 1] - wayOffsets[i];
+			r->m_resolvedWays = new OsmWay *[r->m_numResolvedWays];
+
+			for (unsigned j = 0; j < r->m_numResolvedWays; j++)
+			{
+				wxUint32 ref = wayRefs[wayOffsets[i] + j];
+				OsmWay *way = ref < numWays ? static_cast<OsmWay *>(d->m_ways.GetBySlot(ref)) : NULL;
+
+				r->m_resolvedWays[j] = way;
+
+				if (way)
+				{
+					way->m_relations = new (&(d->m_arena)) OsmRelationList(r, way->m_relations);
+				}
+			}
+		}
+
+		if (tagOffsets[i + 1] > tagOffsets[i])
+		{
+			GetTags(&buf, pairs, numPairs, tags, numTags, tagOffsets[i], tagOffsets[i + 1] - tagOffsets[i]);
+			r->SetTags(&(d->m_arena), buf.m_tags, buf.m_num);
+		}
+
+		d->m_relations.AddObject(r);
+	}
+
+	delete [] pairs;
+
+	d->m_elementCount = numNodes + numWays + numRelations;
+
+	// all references are resolved already, this only finalizes the indices
+	d->Resolve();
+
+	return d;
+}
@@ -0,0 +1,126 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "osm.h"
+#include <stdio.h>
+#include <wx/defs.h>
+
+// the .cache file format (version 4)
+//
+// a fixed header followed by a number of 8 byte aligned sections. every section is a plain array
+// so it can be used straight from the memory mapped file:
+//
+//  strings       : a table of zero terminated strings (offsets + character data)
+//  tag pairs     : (key string, value string) per distinct tag
+//  tags          : tag pair indices, for all objects. objects reference a range in here
+//  nodes         : id, lat and lon columns (the NodeStore columns, as they are)
+//  node tags     : (node index, first tag, number of tags) for the few nodes that have tags
+//  ways          : id column, node index ranges, tag ranges and bounding boxes
+//  way lod       : node index ranges per way and level of detail band, and the simplified nodes
+//  relations     : id column, member node / member way index ranges and tag ranges
+//
+// references between objects are stored as indices into the node/way arrays instead of as ids,
+// so loading needs no id lookups. references that couldn't be resolved are stored as CACHE_INVALID.
+// ids are 64 bit, everything that refers to an object is a 32 bit index.
+// all numbers are in native byte order, the header has a marker so foreign files are rejected
+// (and the cache is regenerated)
+
+// version 2 had 32 bit ids, version 3 had no levels of detail
+#define CACHE_VERSION 4
+#define CACHE_INVALID 0xFFFFFFFF
+
+enum CACHESECTION
+{
+	CS_STRINGOFFSETS,
+	CS_STRINGS,
+	CS_TAGPAIRS,
+	CS_TAGS,
+	CS_NODEIDS,
+	CS_NODELAT,
+	CS_NODELON,
+	CS_NODETAGS,
+	CS_WAYIDS,
+	CS_WAYNODEOFFSETS,
+	CS_WAYNODES,
+	CS_WAYTAGOFFSETS,
+	CS_WAYBOUNDS,
+	CS_WAYLODOFFSETS,
+	CS_WAYLODNODES,
+	CS_RELATIONIDS,
+	CS_RELATIONNODEOFFSETS,
+	CS_RELATIONNODES,
+	CS_RELATIONWAYOFFSETS,
+	CS_RELATIONWAYS,
+	CS_RELATIONTAGOFFSETS,
+	CS_NUMSECTIONS
+};
+
+struct CacheSection
+{
+	wxUint64 m_offset;
+	wxUint64 m_size;	// in bytes
+};
+
+struct CacheHeader
+{
+	char m_magic[8];
+	wxUint32 m_version;
+	wxUint32 m_byteOrder;
+	wxUint32 m_numSections;
+	wxUint32 m_reserved;
+	double m_minlat, m_maxlat, m_minlon, m_maxlon;
+	CacheSection m_sections[CS_NUMSECTIONS];
+};
+
+// a read-only, memory mapped cache file. the mapping is shared, so several
+// instances browsing the same file share the pages
+class MappedCache
+{
+	public:
+		// returns NULL if the file doesn't exist or is not a valid cache of the current version
+		static MappedCache *Open(char const *fileName);
+
+		~MappedCache();
+
+		// builds the OsmData from the mapped arrays
+		OsmData *Load();
+
+		unsigned GetNumWays()
+		{
+			return Count(CS_WAYIDS, sizeof(OsmId));
+		}
+
+		// bounding box of the way in the given slot (the order ways were stored in).
+		// returns false for ways without any resolved nodes
+		bool GetWayBounds(unsigned slot, DRect *bb);
+
+	private:
+		MappedCache();
+
+		template <class T> T const *Get(CACHESECTION s)
+		{
+			return reinterpret_cast<T const *>(m_data + m_header->m_sections[s].m_offset);
+		}
+
+		unsigned Count(CACHESECTION s, size_t elementSize)
+		{
+			return static_cast<unsigned>(m_header->m_sections[s].m_size / elementSize);
+		}
+
+		bool Validate();
+		// true if the wxUint32 offsets never decrease and stay within the wxUint32 array data
+		bool CheckOffsets(CACHESECTION offsets, CACHESECTION data);
+
+		unsigned char const *m_data;
+		size_t m_size;
+		bool m_mapped; // false if we had to fall back to reading the file in memory
+		CacheHeader const *m_header;
+};
+
+// writes the data as a version 4 cache. f must be seekable
+void write_cache(OsmData *d, FILE *f);
+
+#endif
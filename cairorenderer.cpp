@@ -2,20 +2,504 @@
 // copyright Martijn Versteegh
 // osmbrowser is licenced under the gpl v3
 #include "cairorenderer.h"
-#include "utils.h"
 #include "wxcairo.h"
 
-void CairoRenderer::Commit()
+// stroke at least this often, so the batch doesn't grow without bounds
+#define MAXBATCHPOINTS 65536
+// paths are clipped to the output with this many pixels to spare, plus what a line join can
+// reach: with cairo's default miter limit of 10 that is 5 line widths
+#define CLIPMARGIN 2
+
+enum
 {
+	CLIP_LEFT = 1,
+	CLIP_RIGHT = 2,
+	CLIP_TOP = 4,
+	CLIP_BOTTOM = 8
+};
 
-	ClearToWhite(m_outputBitmap);
+static inline int OutCode(double x, double y, double x1, double y1, double x2, double y2)
+{
+	return (x < x1 ? CLIP_LEFT : 0) | (x > x2 ? CLIP_RIGHT : 0) | (y < y1 ? CLIP_TOP : 0) | (y > y2 ? CLIP_BOTTOM : 0);
+}
 
-	for (int i = 0; i < m_numLayers; i++)
+// cohen-sutherland. clips the segment a-b to the rect, returns false if none of it is inside
+static bool ClipSegment(double *ax, double *ay, double *bx, double *by, double x1, double y1, double x2, double y2)
+{
+	int ca = OutCode(*ax, *ay, x1, y1, x2, y2);
+	int cb = OutCode(*bx, *by, x1, y1, x2, y2);
+
+	while (ca | cb)
 	{
-		cairo_surface_flush(layerBuffers[i]);
-		OverlayImageSurface(layerBuffers[i], m_outputBitmap);
+		if (ca & cb)
+		{
+			return false;
+		}
+
+		// the end that is outside is moved onto the side it is outside of. the other end is on
+		// the inner side of that, so the segment can't be parallel to it
+		int c = ca ? ca : cb;
+		double x, y;
+
+		if (c & CLIP_LEFT)
+		{
+			x = x1;
+			y = *ay + (*by - *ay) * (x1 - *ax) / (*bx - *ax);
+		}
+		else if (c & CLIP_RIGHT)
+		{
+			x = x2;
+			y = *ay + (*by - *ay) * (x2 - *ax) / (*bx - *ax);
+		}
+		else if (c & CLIP_TOP)
+		{
+			x = *ax + (*bx - *ax) * (y1 - *ay) / (*by - *ay);
+			y = y1;
+		}
+		else
+		{
+			x = *ax + (*bx - *ax) * (y2 - *ay) / (*by - *ay);
+			y = y2;
+		}
+
+		if (c == ca)
+		{
+			*ax = x;
+			*ay = y;
+			ca = OutCode(x, y, x1, y1, x2, y2);
+		}
+		else
+		{
+			*bx = x;
+			*by = y;
+			cb = OutCode(x, y, x1, y1, x2, y2);
+		}
+	}
+
+	return true;
+}
+
+void CairoRenderer::Begin(Renderer::TYPE type, int layer)
+{
+	if (m_numBatch && (layer != m_batchLayer
+		|| m_lineR != m_batchR || m_lineG != m_batchG || m_lineB != m_batchB || m_lineA != m_batchA
+		|| m_lineWidth != m_batchWidth || m_numBatch > MAXBATCHPOINTS))
+	{
+		Flush();
+	}
+
+	m_batchLayer = layer;
+	m_batchR = m_lineR;
+	m_batchG = m_lineG;
+	m_batchB = m_lineB;
+	m_batchA = m_lineA;
+	m_batchWidth = m_lineWidth;
+
+	m_type = type;
+	m_curLayer = layer;
+	m_pathStart = m_numBatch;
+	m_pathX1 = m_pathY1 = 1e30;
+	m_pathX2 = m_pathY2 = -1e30;
+}
+
+void CairoRenderer::End()
+{
+	IncludePath();
+
+	if (m_type == R_POLYGON)
+	{
+		FillRing(m_batch + m_pathStart, m_numBatch - m_pathStart);
+	}
+}
+
+void CairoRenderer::FillRing(BatchPoint const *ring, unsigned num)
+{
+	if (!num)
+	{
+		return;
+	}
+
+	cairo_t *c = layers[m_curLayer];
+
+	cairo_new_path(c);
+	cairo_move_to(c, ring[0].x, ring[0].y);
+
+	for (unsigned i = 1; i < num; i++)
+	{
+		cairo_line_to(c, ring[i].x, ring[i].y);
+	}
+
+	cairo_set_source_rgba(c, m_fillR, m_fillG, m_fillB, m_fillA);
+	cairo_fill(c);
+}
+
+void CairoRenderer::IncludePoints(BatchPoint const *points, unsigned num)
+{
+	for (unsigned i = 0; i < num; i++)
+	{
+		if (points[i].x < m_pathX1) m_pathX1 = points[i].x;
+		if (points[i].x > m_pathX2) m_pathX2 = points[i].x;
+		if (points[i].y < m_pathY1) m_pathY1 = points[i].y;
+		if (points[i].y > m_pathY2) m_pathY2 = points[i].y;
+	}
+}
+
+void CairoRenderer::GrowBatch(unsigned size)
+{
+	unsigned max = m_maxBatch * 2;
+
+	if (max < size)
+	{
+		max = size;
+	}
+
+	BatchPoint *n = new BatchPoint[max];
+
+	memcpy(n, m_batch, m_numBatch * sizeof(BatchPoint));
+	delete [] m_batch;
+	m_batch = n;
+	m_maxBatch = max;
+}
+
+void CairoRenderer::GrowClip(int i, unsigned size)
+{
+	if (size <= m_maxClip[i])
+	{
+		return;
+	}
+
+	delete [] m_clip[i];
+	m_maxClip[i] = size * 2;
+	m_clip[i] = new BatchPoint[m_maxClip[i]];
+}
+
+unsigned CairoRenderer::ClipLine(unsigned first, unsigned num, double x1, double y1, double x2, double y2)
+{
+	// every segment gives at most two points
+	GrowClip(0, 2 * num);
+
+	BatchPoint const *in = m_batch + first;
+	BatchPoint *out = m_clip[0];
+	unsigned n = 0;
+	// the last point put out is the unclipped end of the segment before, so the line goes on from there
+	bool open = false;
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		if (in[i].start)
+		{
+			open = false;
+			continue;
+		}
+
+		double ax = in[i - 1].x, ay = in[i - 1].y;
+		double bx = in[i].x, by = in[i].y;
+
+		if (!ClipSegment(&ax, &ay, &bx, &by, x1, y1, x2, y2))
+		{
+			open = false;
+			continue;
+		}
+
+		if (!open)
+		{
+			out[n].x = ax;
+			out[n].y = ay;
+			out[n].start = true;
+			n++;
+		}
+
+		out[n].x = bx;
+		out[n].y = by;
+		out[n].start = false;
+		n++;
+
+		open = bx == in[i].x && by == in[i].y;
+	}
+
+	if (first + n > m_maxBatch)
+	{
+		GrowBatch(first + n);
+	}
+
+	memcpy(m_batch + first, out, n * sizeof(BatchPoint));
+
+	return n;
+}
+
+unsigned CairoRenderer::ClipRing(BatchPoint const *in, unsigned num, BatchPoint *out, int side, double bound)
+{
+	unsigned n = 0;
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		BatchPoint const &a = in[i ? i - 1 : num - 1];
+		BatchPoint const &b = in[i];
+		bool aIn, bIn;
+
+		switch (side)
+		{
+			case CLIP_LEFT:
+				aIn = a.x >= bound;
+				bIn = b.x >= bound;
+				break;
+			case CLIP_RIGHT:
+				aIn = a.x <= bound;
+				bIn = b.x <= bound;
+				break;
+			case CLIP_TOP:
+				aIn = a.y >= bound;
+				bIn = b.y >= bound;
+				break;
+			default:
+				aIn = a.y <= bound;
+				bIn = b.y <= bound;
+				break;
+		}
+
+		if (aIn != bIn)
+		{
+			if (side == CLIP_LEFT || side == CLIP_RIGHT)
+			{
+				out[n].x = bound;
+				out[n].y = a.y + (b.y - a.y) * (bound - a.x) / (b.x - a.x);
+			}
+			else
+			{
+				out[n].x = a.x + (b.x - a.x) * (bound - a.y) / (b.y - a.y);
+				out[n].y = bound;
+			}
+
+			out[n].start = false;
+			n++;
+		}
+
+		if (bIn)
+		{
+			out[n] = b;
+			out[n].start = false;
+			n++;
+		}
+	}
+
+	return n;
+}
+
+unsigned CairoRenderer::ClipPolygon(unsigned first, unsigned num, int outside, double x1, double y1, double x2, double y2, BatchPoint const **ring)
+{
+	int sides[4] = { CLIP_LEFT, CLIP_RIGHT, CLIP_TOP, CLIP_BOTTOM };
+	double bounds[4] = { x1, x2, y1, y2 };
+
+	BatchPoint const *in = m_batch + first;
+	int cur = 0;
+
+	// only against the sides that points are outside of
+	for (int i = 0; i < 4 && num; i++)
+	{
+		if (outside & sides[i])
+		{
+			// every point gives at most two
+			GrowClip(cur, 2 * num);
+			num = ClipRing(in, num, m_clip[cur], sides[i], bounds[i]);
+			in = m_clip[cur];
+			cur = !cur;
+		}
+	}
+
+	*ring = in;
+
+	return num;
+}
+
+void CairoRenderer::DrawNodes(Renderer::TYPE type, int layer, NodeStore *nodes, unsigned const *indices, unsigned num)
+{
+	Begin(type, layer);
+
+	if (!num || !nodes->GetCount())
+	{
+		End();
+		return;
+	}
+
+	if (m_numBatch + num > m_maxBatch)
+	{
+		GrowBatch(m_numBatch + num);
+	}
+
+	// straight from the fixed point columns to pixels, one multiply and add per coordinate
+	double kx = 180.0 / LONLATRESOLUTION * m_scaleX;
+	double bx = -m_offX * m_scaleX;
+	double ky = -90.0 / LONLATRESOLUTION * m_scaleY;
+	double by = m_outputHeight + m_offY * m_scaleY;
+
+	wxInt32 const *ilon = nodes->m_ilon;
+	wxInt32 const *ilat = nodes->m_ilat;
+	BatchPoint *out = m_batch + m_numBatch;
+
+	// no branches or calls, NODE_INVALID reads node 0 and is dropped below
+	for (unsigned i = 0; i < num; i++)
+	{
+		unsigned n = indices[i] == NODE_INVALID ? 0 : indices[i];
+
+		out[i].x = ilon[n] * kx + bx;
+		out[i].y = ilat[n] * ky + by;
+	}
+
+	// points in the same pixel as the one before add nothing, except the last one of a line.
+	// the points are moved down in place, never past the one that is read
+	unsigned kept = m_numBatch;
+	bool start = true;
+	double lastX = 0, lastY = 0;
+	bool havePending = false;
+	BatchPoint pending;
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		if (indices[i] == NODE_INVALID)
+		{
+			if (type == R_LINE)
+			{
+				if (havePending)
+				{
+					m_batch[kept++] = pending;
+					havePending = false;
+				}
+
+				start = true;
+			}
+
+			continue;
+		}
+
+		BatchPoint p = out[i];
+		double px = floor(p.x);
+		double py = floor(p.y);
+
+		p.start = start;
+
+		if (!start && px == lastX && py == lastY)
+		{
+			pending = p;
+			havePending = true;
+			continue;
+		}
+
+		m_batch[kept++] = p;
+		havePending = false;
+		start = false;
+		lastX = px;
+		lastY = py;
+	}
+
+	if (havePending)
+	{
+		m_batch[kept++] = pending;
+	}
+
+	// cairo would clip it too, but only after it took every segment, and with large coordinates
+	// (zoomed in far on a long way) it can overflow
+	double margin = 5 * m_lineWidth + CLIPMARGIN;
+	double x1 = -margin, y1 = -margin;
+	double x2 = m_outputWidth + margin, y2 = m_outputHeight + margin;
+	int outside = 0, allOutside = CLIP_LEFT | CLIP_RIGHT | CLIP_TOP | CLIP_BOTTOM;
+
+	for (unsigned i = m_numBatch; i < kept; i++)
+	{
+		int c = OutCode(m_batch[i].x, m_batch[i].y, x1, y1, x2, y2);
+
+		outside |= c;
+		allOutside &= c;
+	}
+
+	bool filled = false;
+
+	if (allOutside)
+	{
+		// all on the outer side of one of the sides
+		kept = m_numBatch;
+	}
+	else if (outside)
+	{
+		if (type == R_POLYGON)
+		{
+			// the fill gets the clipped ring. the outline is clipped like a line, so it stays open in
+			// the same place. the ring is in the scratch space, fill it before ClipLine() uses that
+			BatchPoint const *ring;
+			unsigned numRing = ClipPolygon(m_numBatch, kept - m_numBatch, outside, x1, y1, x2, y2, &ring);
+
+			IncludePoints(ring, numRing);
+			FillRing(ring, numRing);
+			filled = true;
+		}
+
+		kept = m_numBatch + ClipLine(m_numBatch, kept - m_numBatch, x1, y1, x2, y2);
 	}
 
+	IncludePoints(m_batch + m_numBatch, kept - m_numBatch);
+	m_numBatch = kept;
+
+	if (filled)
+	{
+		IncludePath();
+	}
+	else
+	{
+		End();
+	}
+}
+
+void CairoRenderer::Flush()
+{
+	if (!m_numBatch)
+	{
+		return;
+	}
+
+	cairo_t *c = layers[m_batchLayer];
+
+	cairo_new_path(c);
+
+	for (unsigned i = 0; i < m_numBatch; i++)
+	{
+		if (m_batch[i].start)
+		{
+			cairo_move_to(c, m_batch[i].x, m_batch[i].y);
+		}
+		else
+		{
+			cairo_line_to(c, m_batch[i].x, m_batch[i].y);
+		}
+	}
+
+	cairo_set_line_width(c, m_batchWidth);
+	cairo_set_source_rgba(c, m_batchR, m_batchG, m_batchB, m_batchA);
+	cairo_stroke(c);
+
+	m_numBatch = m_pathStart = 0;
+}
+
+wxRect CairoRenderer::Commit()
+{
+	Flush();
+
+	wxRect ret = m_damage;
+
+	if (!m_outputBitmap || ret.IsEmpty())
+	{
+		return wxRect();
+	}
+
+	// only what changed since the last time, a moving selection only redoes a few pixels
+	ret.Intersect(wxRect(0, 0, m_outputBitmap->GetWidth(), m_outputBitmap->GetHeight()));
+	m_damage = wxRect();
+
+	if (ret.IsEmpty())
+	{
+		return ret;
+	}
+
+	CompositeLayers(layerBuffers, m_used, m_numLayers, ret, m_outputBitmap);
+
 //	wxBitmap tmpBitmap(tmp);
 
 //	wxMemoryDC to;
@@ -23,6 +507,244 @@ void CairoRenderer::Commit()
 
 //	to.DrawBitmap(tmpBitmap, 0, 0);
 
+	return ret;
+}
+
+void CairoRenderer::IncludeRect(int layer, wxRect r)
+{
+	r.Intersect(wxRect(0, 0, static_cast<int>(m_outputWidth), static_cast<int>(m_outputHeight)));
+
+	if (r.IsEmpty())
+	{
+		return;
+	}
+
+	Damage(r);
+
+	if (m_used[layer].IsEmpty())
+	{
+		m_used[layer] = r;
+	}
+	else
+	{
+		m_used[layer].Union(r);
+	}
+}
+
+void CairoRenderer::IncludePath()
+{
+	if (m_pathX1 > m_pathX2)
+	{
+		return;
+	}
+
+	// half the line on either side, and a pixel for the antialiasing
+	double border = m_lineWidth / 2 + 1;
+
+	double x1 = m_pathX1 - border;
+	double y1 = m_pathY1 - border;
+	double x2 = m_pathX2 + border;
+	double y2 = m_pathY2 + border;
+
+	// paths can be far outside the output, cut them so the casts can't overflow
+	if (x1 < -1) x1 = -1;
+	if (y1 < -1) y1 = -1;
+	if (x2 > m_outputWidth + 1) x2 = m_outputWidth + 1;
+	if (y2 > m_outputHeight + 1) y2 = m_outputHeight + 1;
+
+	if (x1 >= x2 || y1 >= y2)
+	{
+		return;
+	}
+
+	int ix1 = static_cast<int>(floor(x1));
+	int iy1 = static_cast<int>(floor(y1));
+
+	IncludeRect(m_curLayer, wxRect(ix1, iy1, static_cast<int>(ceil(x2)) - ix1, static_cast<int>(ceil(y2)) - iy1));
+}
+
+Renderer *CairoRenderer::CreateOffscreen(int w, int h, int numLayers)
+{
+	return new CairoRenderer(w, h, numLayers);
+}
+
+void CairoRenderer::Paste(Renderer *from, int x, int y)
+{
+	CairoRenderer *b = static_cast<CairoRenderer *>(from);
+
+	// what was drawn before goes under the pasted pixels. bands were flushed by the worker that drew
+	// them, so for those b->Flush() has nothing left to do
+	Flush();
+	b->Flush();
+
+	int numLayers = m_numLayers < b->m_numLayers ? m_numLayers : b->m_numLayers;
+
+	for (int i = 0; i < numLayers; i++)
+	{
+		cairo_surface_flush(b->layerBuffers[i]);
+
+		cairo_set_operator(layers[i], CAIRO_OPERATOR_SOURCE);
+		cairo_set_source_surface(layers[i], b->layerBuffers[i], x, y);
+		cairo_rectangle(layers[i], x, y, b->m_outputWidth, b->m_outputHeight);
+		cairo_fill(layers[i]);
+		cairo_set_operator(layers[i], CAIRO_OPERATOR_OVER);
+
+		// the pasted area is replaced, the part of it that was used before may be empty now.
+		// keeping it is only a bit slower
+		IncludeRect(i, wxRect(b->m_used[i].x + x, b->m_used[i].y + y, b->m_used[i].width, b->m_used[i].height));
+	}
+
+	wxRect pasted(x, y, static_cast<int>(b->m_outputWidth), static_cast<int>(b->m_outputHeight));
+	pasted.Intersect(wxRect(0, 0, static_cast<int>(m_outputWidth), static_cast<int>(m_outputHeight)));
+	Damage(pasted);
+}
+
+// a small header, then the rows of all layers
+#define PIXELSMAGIC 0x4C584950 // "PIXL"
+
+bool CairoRenderer::Write(FILE *f)
+{
+	Flush();
+
+	wxUint32 header[4] = { PIXELSMAGIC, static_cast<wxUint32>(m_outputWidth), static_cast<wxUint32>(m_outputHeight), static_cast<wxUint32>(m_numLayers) };
+
+	if (fwrite(header, sizeof(header), 1, f) != 1)
+	{
+		return false;
+	}
+
+	int w = static_cast<int>(m_outputWidth);
+	int h = static_cast<int>(m_outputHeight);
+
+	for (int i = 0; i < m_numLayers; i++)
+	{
+		cairo_surface_flush(layerBuffers[i]);
+
+		unsigned char const *data = cairo_image_surface_get_data(layerBuffers[i]);
+		int stride = cairo_image_surface_get_stride(layerBuffers[i]);
+
+		for (int y = 0; y < h; y++)
+		{
+			if (fwrite(data + y * stride, 4, w, f) != static_cast<size_t>(w))
+			{
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool CairoRenderer::Read(FILE *f)
+{
+	wxUint32 header[4];
+
+	if (fread(header, sizeof(header), 1, f) != 1
+		|| header[0] != PIXELSMAGIC
+		|| header[1] != static_cast<wxUint32>(m_outputWidth)
+		|| header[2] != static_cast<wxUint32>(m_outputHeight)
+		|| header[3] != static_cast<wxUint32>(m_numLayers))
+	{
+		return false;
+	}
+
+	// it is all replaced
+	m_numBatch = m_pathStart = 0;
+
+	int w = static_cast<int>(m_outputWidth);
+	int h = static_cast<int>(m_outputHeight);
+
+	for (int i = 0; i < m_numLayers; i++)
+	{
+		cairo_surface_flush(layerBuffers[i]);
+
+		unsigned char *data = cairo_image_surface_get_data(layerBuffers[i]);
+		int stride = cairo_image_surface_get_stride(layerBuffers[i]);
+
+		for (int y = 0; y < h; y++)
+		{
+			if (fread(data + y * stride, 4, w, f) != static_cast<size_t>(w))
+			{
+				return false;
+			}
+		}
+
+		cairo_surface_mark_dirty(layerBuffers[i]);
+		m_used[i] = wxRect(0, 0, w, h);
+	}
+
+	DamageAll();
+
+	return true;
+}
+
+Renderer *CairoRenderer::CreateBand(int x, int y, int w, int h)
+{
+	CairoRenderer *ret = new CairoRenderer(w, h, m_numLayers);
+
+	// row y from the top is (m_outputHeight - y) / m_scaleY above m_offY
+	ret->SetupViewport(DRect(m_offX + x / m_scaleX, m_offY + (m_outputHeight - y - h) / m_scaleY, w / m_scaleX, h / m_scaleY));
+	ret->m_scrolledX = m_scrolledX;
+	ret->m_scrolledY = m_scrolledY;
+
+	return ret;
+}
+
+void CairoRenderer::PasteBand(Renderer *band, int x, int y)
+{
+	CairoRenderer *b = static_cast<CairoRenderer *>(band);
+
+	Paste(b, x + m_scrolledX - b->m_scrolledX, y + m_scrolledY - b->m_scrolledY);
+}
+
+bool CairoRenderer::Scroll(int dx, int dy)
+{
+	Flush();
+
+	if (!m_scrollBuffers)
+	{
+		m_scrollBuffers = new cairo_surface_t *[m_numLayers];
+		m_scrollLayers = new cairo_t *[m_numLayers];
+
+		for (int i = 0; i < m_numLayers; i++)
+		{
+			m_scrollBuffers[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, static_cast<int>(m_outputWidth), static_cast<int>(m_outputHeight));
+			m_scrollLayers[i] = cairo_create(m_scrollBuffers[i]);
+			cairo_set_operator(m_scrollLayers[i], CAIRO_OPERATOR_SOURCE);
+		}
+	}
+
+	for (int i = 0; i < m_numLayers; i++)
+	{
+		cairo_surface_flush(layerBuffers[i]);
+
+		// outside the source surface is transparent, so this clears the uncovered parts too
+		cairo_set_source_surface(m_scrollLayers[i], layerBuffers[i], dx, dy);
+		cairo_paint(m_scrollLayers[i]);
+
+		cairo_surface_t *s = layerBuffers[i];
+		layerBuffers[i] = m_scrollBuffers[i];
+		m_scrollBuffers[i] = s;
+
+		cairo_t *c = layers[i];
+		layers[i] = m_scrollLayers[i];
+		m_scrollLayers[i] = c;
+
+		cairo_set_operator(layers[i], CAIRO_OPERATOR_OVER);
+		cairo_set_operator(m_scrollLayers[i], CAIRO_OPERATOR_SOURCE);
+
+		wxRect used = m_used[i];
+		m_used[i] = wxRect();
+		used.Offset(dx, dy);
+		IncludeRect(i, used);
+	}
+
+	DamageAll();
+
+	m_scrolledX += dx;
+	m_scrolledY += dy;
+
+	return true;
 }
 
 void CairoPdfRenderer::Begin(Renderer::TYPE type, int layer)
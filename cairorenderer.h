@@ -62,10 +62,31 @@ class CairoRenderer
 		{
 			layerBuffers = new cairo_surface_t *[m_numLayers];
 			layers = new cairo_t *[m_numLayers];
+			m_used = new wxRect[m_numLayers];
+			InitBatch();
+			m_scrollBuffers = NULL;
+			m_scrollLayers = NULL;
+			m_scrolledX = m_scrolledY = 0;
 
 			Setup(output);
 		}
 
+		// off screen, for bands
+		CairoRenderer(int w, int h, int numLayers)
+			: CairoRendererBase(numLayers)
+		{
+			layerBuffers = new cairo_surface_t *[m_numLayers];
+			layers = new cairo_t *[m_numLayers];
+			m_used = new wxRect[m_numLayers];
+			InitBatch();
+			m_scrollBuffers = NULL;
+			m_scrollLayers = NULL;
+			m_scrolledX = m_scrolledY = 0;
+
+			m_outputBitmap = NULL;
+			Setup(w, h);
+		}
+
 		~CairoRenderer()
 		{
 			for (int i = 0; i < m_numLayers; i++)
@@ -76,41 +97,63 @@ class CairoRenderer
 
 			delete [] layerBuffers;
 			delete [] layers;
-		}
+			delete [] m_used;
+			delete [] m_batch;
+			delete [] m_clip[0];
+			delete [] m_clip[1];
 
-		void Begin(Renderer::TYPE type, int layer)
-		{
-			m_type = type;
-			m_curLayer = layer;
+			if (m_scrollBuffers)
+			{
+				for (int i = 0; i < m_numLayers; i++)
+				{
+					cairo_surface_destroy(m_scrollBuffers[i]);
+					cairo_destroy(m_scrollLayers[i]);
+				}
 
-			cairo_new_path(layers[layer]);
+				delete [] m_scrollBuffers;
+				delete [] m_scrollLayers;
+			}
 		}
 
+		void Begin(Renderer::TYPE type, int layer);
+
 		void AddPoint(double x, double y, double xshift = 0, double yshift = 0)
 		{
-			cairo_line_to(layers[m_curLayer], (x - m_offX) * m_scaleX + xshift, m_outputHeight - (y - m_offY) * m_scaleY + yshift);
-		}
+			double px = (x - m_offX) * m_scaleX + xshift;
+			double py = m_outputHeight - (y - m_offY) * m_scaleY + yshift;
 
-		void End()
-		{
-			switch(m_type)
+			if (px < m_pathX1) m_pathX1 = px;
+			if (px > m_pathX2) m_pathX2 = px;
+			if (py < m_pathY1) m_pathY1 = py;
+			if (py > m_pathY2) m_pathY2 = py;
+
+			if (m_numBatch >= m_maxBatch)
 			{
-				case R_POLYGON:
-					cairo_set_source_rgba(layers[m_curLayer], m_fillR, m_fillG, m_fillB, m_fillA);
-					cairo_fill_preserve(layers[m_curLayer]);
-					// fall through;
-				case R_LINE:
-					cairo_set_line_width(layers[m_curLayer], m_lineWidth);
-					cairo_set_source_rgba(layers[m_curLayer], m_lineR, m_lineG, m_lineB, m_lineA);
-					cairo_stroke(layers[m_curLayer]);
-					break;
+				GrowBatch(m_numBatch + 1);
 			}
+
+			m_batch[m_numBatch].x = px;
+			m_batch[m_numBatch].y = py;
+			m_batch[m_numBatch].start = m_numBatch == m_pathStart;
+			m_numBatch++;
 		}
 
+		void End();
+
+		void DrawNodes(Renderer::TYPE type, int layer, NodeStore *nodes, unsigned const *indices, unsigned num);
+
 		bool SupportsLayers() { return true; }
 
 		void Clear(int layer = -1)
 		{
+			Flush();
+
+			// the output may have been drawn over, or be new
+			if (layer < 0)
+			{
+				DamageAll();
+			}
+
 			for (int i = 0; i < m_numLayers; i++)
 			{
 				if (layer < 0 || layer == i)
@@ -119,11 +162,23 @@ class CairoRenderer
 					cairo_set_source_rgba(layers[i], 0,0,0,0);
 					cairo_paint(layers[i]);
 					cairo_set_operator(layers[i], CAIRO_OPERATOR_OVER);
+					Damage(m_used[i]);
+					m_used[i] = wxRect();
 				}
 			}
 		}
 
-		void Commit();
+		wxRect Commit();
+		// strokes the lines that were collected
+		void Flush();
+
+		Renderer *CreateOffscreen(int w, int h, int numLayers);
+		void Paste(Renderer *from, int x, int y);
+		bool Write(FILE *f);
+		bool Read(FILE *f);
+		Renderer *CreateBand(int x, int y, int w, int h);
+		void PasteBand(Renderer *band, int x, int y);
+		bool Scroll(int dx, int dy);
 
 		virtual void DrawCenteredText(char const *text, double x, double y, double angle, int r, int g, int b, int a, int layer)
 		{
@@ -135,24 +190,103 @@ class CairoRenderer
 		void Setup(wxBitmap *output)
 		{
 			m_outputBitmap = output;
-			
+			Setup(output->GetWidth(), output->GetHeight());
+		}
+
+		void Setup(int w, int h)
+		{
 			for (int i = 0; i < m_numLayers; i++)
 			{
-				layerBuffers[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, output->GetWidth(), output->GetHeight());
+				layerBuffers[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
 				layers[i] = cairo_create(layerBuffers[i]);
 
 			}
 
-			m_outputWidth = output->GetWidth();
-			m_outputHeight = output->GetHeight();
+			m_outputWidth = w;
+			m_outputHeight = h;
+
+			DamageAll();
+		}
+
+		void DamageAll()
+		{
+			Damage(wxRect(0, 0, static_cast<int>(m_outputWidth), static_cast<int>(m_outputHeight)));
+		}
+
+		void InitBatch()
+		{
+			m_maxBatch = 1024;
+			m_batch = new BatchPoint[m_maxBatch];
+			m_numBatch = m_pathStart = 0;
+			m_batchLayer = 0;
+			m_batchR = m_batchG = m_batchB = m_batchA = m_batchWidth = 0;
 
+			for (int i = 0; i < 2; i++)
+			{
+				m_clip[i] = NULL;
+				m_maxClip[i] = 0;
+			}
 		}
 
+		// to at least size points
+		void GrowBatch(unsigned size);
+
+		// clips the num points of a path from m_batch[first] on to the rect, and puts them back.
+		// returns the new number of points
+		unsigned ClipLine(unsigned first, unsigned num, double x1, double y1, double x2, double y2);
+		// scratch space for the clipping, i is 0 or 1
+		void GrowClip(int i, unsigned size);
+
+		// adds r to the used part of layer, as far as it is inside the output. r is damaged too
+		void IncludeRect(int layer, wxRect r);
+		// adds the path that is being drawn, with the line around it
+		void IncludePath();
+
 		Renderer::TYPE  m_type;
 		int m_curLayer;
 		cairo_t **layers;
 		cairo_surface_t **layerBuffers;
 
+		// the layers are copied into these when scrolling, and then swapped
+		cairo_t **m_scrollLayers;
+		cairo_surface_t **m_scrollBuffers;
+		// how far the output has scrolled in total. for a band: how far its parent had scrolled
+		// when the band was created
+		int m_scrolledX, m_scrolledY;
+
+		// per layer the part that can have anything in it. the rest is transparent, and is
+		// skipped when compositing
+		wxRect *m_used;
+		// the lines of consecutive ways with the same style and layer are collected in pixels, and
+		// stroked at once when the style changes or the layers are used. the start of each line is
+		// marked. polygons are filled right away, their outlines go with the lines
+		struct BatchPoint
+		{
+			double x, y;
+			bool start;
+		};
+		BatchPoint *m_batch;
+		unsigned m_numBatch, m_maxBatch;
+		// where the path that is being drawn starts in m_batch
+		unsigned m_pathStart;
+		int m_batchLayer;
+		double m_batchR, m_batchG, m_batchB, m_batchA, m_batchWidth;
+
+		// one sutherland-hodgman pass over a ring, for one side of the clip rect
+		static unsigned ClipRing(BatchPoint const *in, unsigned num, BatchPoint *out, int side, double bound);
+		// clips the ring of num points from m_batch[first] on to the rect, into the scratch space.
+		// outside is the or of the outcodes of the points. returns the new number of points
+		unsigned ClipPolygon(unsigned first, unsigned num, int outside, double x1, double y1, double x2, double y2, BatchPoint const **ring);
+		void FillRing(BatchPoint const *ring, unsigned num);
+		// adds the points to the bounds of the path
+		void IncludePoints(BatchPoint const *points, unsigned num);
+
+		BatchPoint *m_clip[2];
+		unsigned m_maxClip[2];
+
+		// the bounds of the path that is being drawn, in pixels
+		double m_pathX1, m_pathY1, m_pathX2, m_pathY2;
+
 		wxBitmap *m_outputBitmap;
 };
 
@@ -187,7 +321,7 @@ class CairoPdfRenderer
 
 		void Clear(int layer = -1) { /* pdf doesn't support clearing */ }
 
-		void Commit() { /* nop, we don't support layers */ }
+		wxRect Commit() { /* nop, we don't support layers */ return wxRect(); }
 
 
 		
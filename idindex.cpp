@@ -0,0 +1,467 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "idindex.h"
+
+IdIndex *IdIndex::Create(IdIndex::TYPE type, unsigned expectedSize)
+{
+	switch(type)
+	{
+		case IDX_HASH:
+			return new HashIdIndex(expectedSize);
+		case IDX_SORTED:
+			return new SortedIdIndex(expectedSize);
+	}
+
+	abort();
+	return NULL;
+}
+
+// ----------------------------------------------------------------------------
+// HashIdIndex
+// ----------------------------------------------------------------------------
+
+HashIdIndex::HashIdIndex(unsigned expectedSize)
+{
+	m_ids = NULL;
+	m_slots = NULL;
+	m_size = 0;
+	m_mask = 0;
+	m_shift = 64;
+
+	Reserve(expectedSize);
+}
+
+HashIdIndex::~HashIdIndex()
+{
+	delete [] m_ids;
+	delete [] m_slots;
+}
+
+void HashIdIndex::Reserve(unsigned size)
+{
+	// keep the load factor below 1/2, short probe sequences are the whole point
+	unsigned bits = 4;
+	while (bits < 31 && (1U << bits) < 2 * static_cast<unsigned long long>(size))
+	{
+		bits++;
+	}
+
+	if ((1U << bits) > m_size)
+	{
+		Rehash(bits);
+	}
+}
+
+void HashIdIndex::Rehash(unsigned newBits)
+{
+	OsmId *oldIds = m_ids;
+	unsigned *oldSlots = m_slots;
+	unsigned oldSize = m_size;
+
+	m_size = 1U << newBits;
+	m_mask = m_size - 1;
+	m_shift = 64 - newBits;
+	m_ids = new OsmId[m_size];
+	m_slots = new unsigned[m_size];
+	memset(m_slots, 0xFF, sizeof(unsigned) * m_size);
+
+	for (unsigned i = 0; i < oldSize; i++)
+	{
+		if (oldSlots[i] != NotFound())
+		{
+			unsigned h = Hash(oldIds[i]);
+			while (m_slots[h] != NotFound())
+			{
+				h = (h + 1) & m_mask;
+			}
+			m_ids[h] = oldIds[i];
+			m_slots[h] = oldSlots[i];
+		}
+	}
+
+	delete [] oldIds;
+	delete [] oldSlots;
+}
+
+void HashIdIndex::Add(OsmId id, unsigned slot)
+{
+	assert(slot != NotFound());
+
+	if (2 * static_cast<unsigned long long>(m_count + 1) > m_size)
+	{
+		Rehash(64 - m_shift + 1);
+	}
+
+	unsigned h = Hash(id);
+	while (m_slots[h] != NotFound())
+	{
+		h = (h + 1) & m_mask;
+	}
+
+	m_ids[h] = id;
+	m_slots[h] = slot;
+	m_count++;
+}
+
+unsigned HashIdIndex::Find(OsmId id)
+{
+	unsigned h = Hash(id);
+
+	while (m_slots[h] != NotFound())
+	{
+		if (m_ids[h] == id)
+		{
+			return m_slots[h];
+		}
+		h = (h + 1) & m_mask;
+	}
+
+	return NotFound();
+}
+
+size_t HashIdIndex::GetMemoryUsage()
+{
+	return static_cast<size_t>(m_size) * (sizeof(OsmId) + sizeof(unsigned));
+}
+
+void HashIdIndex::GetStatistics(double *avgLen, double *standardDeviation, int *maxLen)
+{
+	unsigned long long s1 = 0, s2 = 0;
+	*maxLen = 0;
+
+	for (unsigned i = 0; i < m_size; i++)
+	{
+		if (m_slots[i] == NotFound())
+		{
+			continue;
+		}
+
+		// distance from the home bucket, wrapping around the end of the table
+		unsigned long long c = ((i - Hash(m_ids[i])) & m_mask) + 1;
+		s1 += c;
+		s2 += c * c;
+		if (static_cast<int>(c) > *maxLen)
+		{
+			*maxLen = static_cast<int>(c);
+		}
+	}
+
+	if (!m_count)
+	{
+		*avgLen = *standardDeviation = 0;
+		return;
+	}
+
+	*avgLen = static_cast<double>(s1) / m_count;
+	double var = static_cast<double>(s2) / m_count - *avgLen * *avgLen;
+	*standardDeviation = var > 0 ? sqrt(var) : 0;
+}
+
+// ----------------------------------------------------------------------------
+// SortedIdIndex
+// ----------------------------------------------------------------------------
+
+SortedIdIndex::SortedIdIndex(unsigned expectedSize)
+{
+	m_ids = NULL;
+	m_slots = NULL;
+	m_size = 0;
+	m_sorted = true;
+
+	Reserve(expectedSize ? expectedSize : 1024);
+}
+
+SortedIdIndex::~SortedIdIndex()
+{
+	delete [] m_ids;
+	delete [] m_slots;
+}
+
+void SortedIdIndex::Reserve(unsigned size)
+{
+	if (size <= m_size)
+	{
+		return;
+	}
+
+	OsmId *ids = new OsmId[size];
+	memcpy(ids, m_ids, sizeof(OsmId) * m_count);
+	delete [] m_ids;
+	m_ids = ids;
+
+	if (m_slots)
+	{
+		unsigned *slots = new unsigned[size];
+		memcpy(slots, m_slots, sizeof(unsigned) * m_count);
+		delete [] m_slots;
+		m_slots = slots;
+	}
+
+	m_size = size;
+}
+
+void SortedIdIndex::Add(OsmId id, unsigned slot)
+{
+	assert(slot != NotFound());
+
+	if (m_count >= m_size)
+	{
+		Reserve(m_size + m_size / 2 + 1024);
+	}
+
+	if (!m_slots && slot != m_count)
+	{
+		m_slots = new unsigned[m_size];
+		for (unsigned i = 0; i < m_count; i++)
+		{
+			m_slots[i] = i;
+		}
+	}
+
+	if (m_count && id < m_ids[m_count - 1])
+	{
+		m_sorted = false;
+	}
+
+	m_ids[m_count] = id;
+	if (m_slots)
+	{
+		m_slots[m_count] = slot;
+	}
+
+	m_count++;
+}
+
+// lsd radix sort, dragging the values along
+void RadixSortIds(OsmId *ids, unsigned *values, size_t count)
+{
+	if (!count)
+	{
+		return;
+	}
+
+	OsmId *tmpIds = new OsmId[count];
+	unsigned *tmpValues = new unsigned[count];
+
+	for (int shift = 0; shift < 64; shift += 8)
+	{
+		size_t offsets[256];
+		memset(offsets, 0, sizeof(offsets));
+
+		for (size_t i = 0; i < count; i++)
+		{
+			offsets[(ids[i] >> shift) & 0xFF]++;
+		}
+
+		// the high bytes of the ids are mostly all the same, those passes can be skipped
+		if (offsets[(ids[0] >> shift) & 0xFF] == count)
+		{
+			continue;
+		}
+
+		size_t total = 0;
+		for (int b = 0; b < 256; b++)
+		{
+			size_t c = offsets[b];
+			offsets[b] = total;
+			total += c;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t pos = offsets[(ids[i] >> shift) & 0xFF]++;
+			tmpIds[pos] = ids[i];
+			tmpValues[pos] = values[i];
+		}
+
+		memcpy(ids, tmpIds, sizeof(OsmId) * count);
+		memcpy(values, tmpValues, sizeof(unsigned) * count);
+	}
+
+	delete [] tmpIds;
+	delete [] tmpValues;
+}
+
+void SortedIdIndex::Sort()
+{
+	if (!m_slots)
+	{
+		m_slots = new unsigned[m_size];
+		for (unsigned i = 0; i < m_count; i++)
+		{
+			m_slots[i] = i;
+		}
+	}
+
+	RadixSortIds(m_ids, m_slots, m_count);
+
+	m_sorted = true;
+}
+
+void SortedIdIndex::Finish()
+{
+	if (!m_sorted)
+	{
+		Sort();
+	}
+
+	// drop the slack left by growing
+	if (m_count < m_size)
+	{
+		OsmId *ids = new OsmId[m_count ? m_count : 1];
+		memcpy(ids, m_ids, sizeof(OsmId) * m_count);
+		delete [] m_ids;
+		m_ids = ids;
+
+		if (m_slots)
+		{
+			unsigned *slots = new unsigned[m_count ? m_count : 1];
+			memcpy(slots, m_slots, sizeof(unsigned) * m_count);
+			delete [] m_slots;
+			m_slots = slots;
+		}
+
+		m_size = m_count ? m_count : 1;
+	}
+}
+
+// interpolation search. osm ids are close to uniformly distributed within an extract,
+// so this typically needs only a few probes. falls back to bisection when the guesses don't
+// converge
+unsigned InterpolationSearch(OsmId const *ids, unsigned count, OsmId id, int *probes)
+{
+	int numProbes = 0;
+
+	if (probes)
+	{
+		*probes = 0;
+	}
+
+	if (!count)
+	{
+		return IdIndex::NotFound();
+	}
+
+	unsigned lo = 0;
+	unsigned hi = count - 1;
+
+	while (lo <= hi)
+	{
+		OsmId loId = ids[lo];
+		OsmId hiId = ids[hi];
+
+		if (id < loId || id > hiId)
+		{
+			break;
+		}
+
+		unsigned pos;
+		if (numProbes < 8 && hiId != loId)
+		{
+			// the product could overflow 64 bits, an estimate is all we need
+			pos = lo + static_cast<unsigned>(static_cast<double>(id - loId) / static_cast<double>(hiId - loId) * (hi - lo));
+			if (pos > hi)
+			{
+				pos = hi;
+			}
+		}
+		else
+		{
+			pos = lo + (hi - lo) / 2;
+		}
+
+		numProbes++;
+
+		if (ids[pos] == id)
+		{
+			if (probes)
+			{
+				*probes = numProbes;
+			}
+			return pos;
+		}
+
+		if (ids[pos] < id)
+		{
+			lo = pos + 1;
+		}
+		else
+		{
+			if (!pos)
+			{
+				break;
+			}
+			hi = pos - 1;
+		}
+	}
+
+	if (probes)
+	{
+		*probes = numProbes;
+	}
+
+	return IdIndex::NotFound();
+}
+
+unsigned SortedIdIndex::Find(OsmId id)
+{
+	if (!m_sorted)
+	{
+		Sort();
+	}
+
+	unsigned pos = InterpolationSearch(m_ids, m_count, id);
+
+	if (pos == NotFound())
+	{
+		return NotFound();
+	}
+
+	return m_slots ? m_slots[pos] : pos;
+}
+
+size_t SortedIdIndex::GetMemoryUsage()
+{
+	return static_cast<size_t>(m_size) * (sizeof(OsmId) + (m_slots ? sizeof(unsigned) : 0));
+}
+
+void SortedIdIndex::GetStatistics(double *avgLen, double *standardDeviation, int *maxLen)
+{
+	unsigned long long s1 = 0, s2 = 0, n = 0;
+	*maxLen = 0;
+
+	if (!m_sorted)
+	{
+		Sort();
+	}
+
+	// probing every id would be as expensive as the lookups themselves, so sample
+	unsigned step = m_count / 4096 + 1;
+	for (unsigned i = 0; i < m_count; i += step)
+	{
+		int c;
+		InterpolationSearch(m_ids, m_count, m_ids[i], &c);
+		s1 += c;
+		s2 += c * c;
+		n++;
+		if (c > *maxLen)
+		{
+			*maxLen = c;
+		}
+	}
+
+	if (!n)
+	{
+		*avgLen = *standardDeviation = 0;
+		return;
+	}
+
+	*avgLen = static_cast<double>(s1) / n;
+	double var = static_cast<double>(s2) / n - *avgLen * *avgLen;
+	*standardDeviation = var > 0 ? sqrt(var) : 0;
+}
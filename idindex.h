@@ -0,0 +1,125 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __IDINDEX_H__
+#define __IDINDEX_H__
+
+#include <stddef.h>
+#include <wx/defs.h>
+
+// osm ids don't fit in 32 bits anymore
+typedef wxUint64 OsmId;
+
+// maps osm ids to dense slot numbers (the position of the object in its store)
+// there are two implementations:
+//  - an open addressing hash with linear probing, which handles ids in any order
+//  - a sorted array of ids, which is the most compact and is searched with interpolation search.
+//    osm files are sorted by id, so normally this is just an append. when ids do arrive out of order
+//    the array is sorted again before the next lookup.
+
+// interpolation search in an ascending array of ids. returns the position of id, or
+// IdIndex::NotFound(). probes (if not NULL) receives the number of probes needed
+unsigned InterpolationSearch(OsmId const *ids, unsigned count, OsmId id, int *probes = NULL);
+
+// sorts ids ascending, applying the same permutation to values
+void RadixSortIds(OsmId *ids, unsigned *values, size_t count);
+
+class IdIndex
+{
+	public:
+		enum TYPE
+		{
+			IDX_HASH,
+			IDX_SORTED
+		};
+
+		static unsigned NotFound() { return 0xFFFFFFFF; }
+
+		// expectedSize is only a hint, the index will grow when needed
+		static IdIndex *Create(IdIndex::TYPE type, unsigned expectedSize);
+
+		virtual ~IdIndex() { }
+
+		virtual void Add(OsmId id, unsigned slot) = 0;
+
+		// returns NotFound() if the id is not in the index
+		virtual unsigned Find(OsmId id) = 0;
+
+		// make room for at least this many ids
+		virtual void Reserve(unsigned size) = 0;
+
+		// called when loading is finished. gives the index a chance to compact itself
+		virtual void Finish() { }
+
+		// number of bytes used by the index itself
+		virtual size_t GetMemoryUsage() = 0;
+
+		// statistics about the number of probes a lookup needs
+		virtual void GetStatistics(double *avgLen, double *standardDeviation, int *maxLen) = 0;
+
+		unsigned GetCount() { return m_count; }
+
+	protected:
+		IdIndex()
+		{
+			m_count = 0;
+		}
+
+		unsigned m_count;
+};
+
+class HashIdIndex
+	: public IdIndex
+{
+	public:
+		HashIdIndex(unsigned expectedSize);
+		~HashIdIndex();
+
+		void Add(OsmId id, unsigned slot);
+		unsigned Find(OsmId id);
+		void Reserve(unsigned size);
+		size_t GetMemoryUsage();
+		void GetStatistics(double *avgLen, double *standardDeviation, int *maxLen);
+
+	private:
+		unsigned Hash(OsmId id)
+		{
+			// fibonacci hashing, spreads the mostly consecutive osm ids over the table
+			return static_cast<unsigned>((id * 11400714819323198485ULL) >> m_shift);
+		}
+
+		void Rehash(unsigned newBits);
+
+		OsmId *m_ids;
+		unsigned *m_slots;	// NotFound() marks an empty bucket
+		unsigned m_size;
+		unsigned m_mask;
+		unsigned m_shift;
+};
+
+class SortedIdIndex
+	: public IdIndex
+{
+	public:
+		SortedIdIndex(unsigned expectedSize);
+		~SortedIdIndex();
+
+		void Add(OsmId id, unsigned slot);
+		unsigned Find(OsmId id);
+		void Reserve(unsigned size);
+		void Finish();
+		size_t GetMemoryUsage();
+		void GetStatistics(double *avgLen, double *standardDeviation, int *maxLen);
+
+	private:
+		void Sort();
+
+		OsmId *m_ids;
+		// as long as the ids were added in order with consecutive slots, the slot equals the position
+		// and this stays NULL
+		unsigned *m_slots;
+		unsigned m_size;
+		bool m_sorted;
+};
+
+#endif
@@ -53,12 +53,13 @@ void InfoTreeCtrl::SetInfo(TileWay *ways)
 void InfoTreeCtrl::AddWay(wxTreeItemId const &root, OsmWay *way)
 {
 	InfoData *data = new InfoData(way);
-	wxTreeItemId w = AppendItem(root, wxString::Format(wxT("%ud"), way->m_id), -1, -1, data);
+	wxTreeItemId w = AppendItem(root, wxString::Format(wxT("%") wxLongLongFmtSpec wxT("u"), way->m_id), -1, -1, data);
 
-	for (OsmTag *t = way->m_tags; t; t = static_cast<OsmTag *>(t->m_next))
+	for (unsigned i = 0; i < way->m_tags.GetSize(); i++)
 	{
-		char const *k = t->GetKey();
-		char const *v = t->GetValue();
+		OsmTag t(way->m_tags.Get(i));
+		char const *k = t.GetKey();
+		char const *v = t.GetValue();
 
 
 		wxString tag(k, wxConvUTF8);
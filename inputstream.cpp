@@ -0,0 +1,316 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "inputstream.h"
+#include <string.h>
+#include <zlib.h>
+#include <bzlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESSEDBUFSIZE (256 * 1024)
+
+// the bytes of the file itself. the first few are read ahead to recognise the format, and handed
+// out again before the rest of the file
+class RawInput
+{
+	public:
+		RawInput(FILE *file)
+		{
+			m_file = file;
+			m_peekLen = m_peekPos = 0;
+		}
+
+		// only valid before the first Read()
+		size_t Peek(unsigned char const **data)
+		{
+			m_peekLen = fread(m_peek, 1, sizeof(m_peek), m_file);
+			*data = m_peek;
+
+			return m_peekLen;
+		}
+
+		size_t Read(void *buf, size_t size)
+		{
+			size_t ret = 0;
+
+			if (m_peekPos < m_peekLen)
+			{
+				ret = m_peekLen - m_peekPos;
+				if (ret > size)
+				{
+					ret = size;
+				}
+
+				memcpy(buf, m_peek + m_peekPos, ret);
+				m_peekPos += ret;
+			}
+
+			if (ret < size)
+			{
+				ret += fread(static_cast<char *>(buf) + ret, 1, size - ret, m_file);
+			}
+
+			return ret;
+		}
+
+	private:
+		FILE *m_file;
+		unsigned char m_peek[4];
+		size_t m_peekLen, m_peekPos;
+};
+
+class PlainInputStream
+	: public InputStream
+{
+	public:
+		PlainInputStream(RawInput const &raw)
+			: m_raw(raw)
+		{
+		}
+
+		size_t Read(char *buf, size_t size)
+		{
+			return m_raw.Read(buf, size);
+		}
+
+	private:
+		RawInput m_raw;
+};
+
+class GzipInputStream
+	: public InputStream
+{
+	public:
+		GzipInputStream(RawInput const &raw)
+			: m_raw(raw)
+		{
+			memset(&m_z, 0, sizeof(m_z));
+			// 32 means detect gzip or zlib headers
+			m_done = inflateInit2(&m_z, 15 + 32) != Z_OK;
+		}
+
+		~GzipInputStream()
+		{
+			inflateEnd(&m_z);
+		}
+
+		size_t Read(char *buf, size_t size)
+		{
+			m_z.next_out = reinterpret_cast<Bytef *>(buf);
+			m_z.avail_out = size;
+
+			while (m_z.avail_out && !m_done)
+			{
+				if (!m_z.avail_in)
+				{
+					m_z.avail_in = m_raw.Read(m_in, COMPRESSEDBUFSIZE);
+					m_z.next_in = m_in;
+
+					if (!m_z.avail_in)
+					{
+						m_done = true;
+						break;
+					}
+				}
+
+				int r = inflate(&m_z, Z_NO_FLUSH);
+
+				if (r == Z_STREAM_END)
+				{
+					// pigz and bgzip write several gzip members after each other
+					inflateReset(&m_z);
+				}
+				else if (r != Z_OK)
+				{
+					printf("gzip error: %s\n", m_z.msg ? m_z.msg : "corrupt data");
+					m_done = true;
+				}
+			}
+
+			return size - m_z.avail_out;
+		}
+
+		unsigned GetExpansion()
+		{
+			return 7;
+		}
+
+	private:
+		RawInput m_raw;
+		z_stream m_z;
+		Bytef m_in[COMPRESSEDBUFSIZE];
+		bool m_done;
+};
+
+class Bzip2InputStream
+	: public InputStream
+{
+	public:
+		Bzip2InputStream(RawInput const &raw)
+			: m_raw(raw)
+		{
+			memset(&m_bz, 0, sizeof(m_bz));
+			m_done = BZ2_bzDecompressInit(&m_bz, 0, 0) != BZ_OK;
+		}
+
+		~Bzip2InputStream()
+		{
+			BZ2_bzDecompressEnd(&m_bz);
+		}
+
+		size_t Read(char *buf, size_t size)
+		{
+			m_bz.next_out = buf;
+			m_bz.avail_out = size;
+
+			while (m_bz.avail_out && !m_done)
+			{
+				if (!m_bz.avail_in)
+				{
+					m_bz.avail_in = m_raw.Read(m_in, COMPRESSEDBUFSIZE);
+					m_bz.next_in = m_in;
+
+					if (!m_bz.avail_in)
+					{
+						m_done = true;
+						break;
+					}
+				}
+
+				int r = BZ2_bzDecompress(&m_bz);
+
+				if (r == BZ_STREAM_END)
+				{
+					// pbzip2 and lbzip2 write several streams after each other. bzlib has no reset,
+					// so start a new decompressor for the rest of the input
+					char *nextIn = m_bz.next_in;
+					unsigned availIn = m_bz.avail_in;
+					char *nextOut = m_bz.next_out;
+					unsigned availOut = m_bz.avail_out;
+
+					BZ2_bzDecompressEnd(&m_bz);
+					memset(&m_bz, 0, sizeof(m_bz));
+					m_done = BZ2_bzDecompressInit(&m_bz, 0, 0) != BZ_OK;
+
+					m_bz.next_in = nextIn;
+					m_bz.avail_in = availIn;
+					m_bz.next_out = nextOut;
+					m_bz.avail_out = availOut;
+				}
+				else if (r != BZ_OK)
+				{
+					printf("bzip2 error %d\n", r);
+					m_done = true;
+				}
+			}
+
+			return size - m_bz.avail_out;
+		}
+
+		unsigned GetExpansion()
+		{
+			return 10;
+		}
+
+	private:
+		RawInput m_raw;
+		bz_stream m_bz;
+		char m_in[COMPRESSEDBUFSIZE];
+		bool m_done;
+};
+
+#ifdef HAVE_ZSTD
+class ZstdInputStream
+	: public InputStream
+{
+	public:
+		ZstdInputStream(RawInput const &raw)
+			: m_raw(raw)
+		{
+			m_z = ZSTD_createDStream();
+			m_done = !m_z || ZSTD_isError(ZSTD_initDStream(m_z));
+			m_inPos = m_inLen = 0;
+		}
+
+		~ZstdInputStream()
+		{
+			ZSTD_freeDStream(m_z);
+		}
+
+		// concatenated frames are handled by zstd itself
+		size_t Read(char *buf, size_t size)
+		{
+			ZSTD_outBuffer out = { buf, size, 0 };
+
+			while (out.pos < size && !m_done)
+			{
+				if (m_inPos == m_inLen)
+				{
+					m_inLen = m_raw.Read(m_in, COMPRESSEDBUFSIZE);
+					m_inPos = 0;
+
+					if (!m_inLen)
+					{
+						m_done = true;
+						break;
+					}
+				}
+
+				ZSTD_inBuffer in = { m_in, m_inLen, m_inPos };
+				size_t r = ZSTD_decompressStream(m_z, &out, &in);
+				m_inPos = in.pos;
+
+				if (ZSTD_isError(r))
+				{
+					printf("zstd error: %s\n", ZSTD_getErrorName(r));
+					m_done = true;
+				}
+			}
+
+			return out.pos;
+		}
+
+		unsigned GetExpansion()
+		{
+			return 9;
+		}
+
+	private:
+		RawInput m_raw;
+		ZSTD_DStream *m_z;
+		char m_in[COMPRESSEDBUFSIZE];
+		size_t m_inPos, m_inLen;
+		bool m_done;
+};
+#endif
+
+InputStream *InputStream::Open(FILE *file)
+{
+	RawInput raw(file);
+	unsigned char const *magic;
+	size_t n = raw.Peek(&magic);
+
+	if (n >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+	{
+		return new GzipInputStream(raw);
+	}
+
+	if (n >= 3 && !memcmp(magic, "BZh", 3))
+	{
+		return new Bzip2InputStream(raw);
+	}
+
+	if (n >= 4 && magic[0] == 0x28 && magic[1] == 0xB5 && magic[2] == 0x2F && magic[3] == 0xFD)
+	{
+#ifdef HAVE_ZSTD
+		return new ZstdInputStream(raw);
+#else
+		printf("this is a zstd compressed file, but osmbrowser was built without zstd support\n");
+		return NULL;
+#endif
+	}
+
+	return new PlainInputStream(raw);
+}
@@ -0,0 +1,31 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __INPUTSTREAM_H__
+#define __INPUTSTREAM_H__
+
+#include <stdio.h>
+
+// the uncompressed contents of a file that may be compressed with gzip, bzip2 or (if compiled in)
+// zstd. the format is recognised from the first bytes, so this works on pipes too
+class InputStream
+{
+	public:
+		virtual ~InputStream()
+		{
+		}
+
+		// returns the number of bytes read, 0 at the end of the data or on errors
+		virtual size_t Read(char *buf, size_t size) = 0;
+
+		// a rough compression ratio for osm data in this format, to estimate the amount of data from the file size
+		virtual unsigned GetExpansion()
+		{
+			return 1;
+		}
+
+		// does not take ownership of file
+		static InputStream *Open(FILE *file);
+};
+
+#endif
@@ -0,0 +1,158 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "interner.h"
+#include <stdlib.h>
+
+StringInterner::StringInterner()
+	: m_arena(64 * 1024)
+{
+	m_count = 0;
+	m_capacity = 1024;
+	m_strings = static_cast<char const **>(malloc(m_capacity * sizeof(char const *)));
+	m_lengths = static_cast<wxUint32 *>(malloc(m_capacity * sizeof(wxUint32)));
+	assert(m_strings && m_lengths);
+
+	// at most half full
+	m_mask = 2 * m_capacity - 1;
+	m_table = new Slot[m_mask + 1];
+	memset(m_table, 0xFF, sizeof(Slot) * (m_mask + 1));
+}
+
+StringInterner::~StringInterner()
+{
+	free(m_strings);
+	free(m_lengths);
+	delete [] m_table;
+}
+
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// in the style of xxhash, 8 bytes at a time
+wxUint64 StringInterner::Hash(char const *s, size_t len)
+{
+	static const wxUint64 P1 = 11400714785074694791ULL;
+	static const wxUint64 P2 = 14029467366897019727ULL;
+	static const wxUint64 P3 = 1609587929392839161ULL;
+
+	wxUint64 h = P3 + len * P1;
+
+	while (len >= 8)
+	{
+		wxUint64 w;
+		memcpy(&w, s, 8);
+		h ^= ROTL64(w * P2, 31) * P1;
+		h = ROTL64(h, 27) * P1 + P3;
+		s += 8;
+		len -= 8;
+	}
+
+	if (len)
+	{
+		wxUint64 w = 0;
+		memcpy(&w, s, len);
+		h ^= ROTL64(w * P2, 31) * P1;
+		h = ROTL64(h, 27) * P1 + P3;
+	}
+
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+unsigned StringInterner::Lookup(char const *s, size_t len, wxUint32 hash)
+{
+	unsigned pos = hash & m_mask;
+
+	for (;;)
+	{
+		Slot const &slot = m_table[pos];
+
+		if (slot.m_id == NotFound())
+		{
+			return pos;
+		}
+
+		if (slot.m_hash == hash && m_lengths[slot.m_id] == len && !memcmp(m_strings[slot.m_id], s, len))
+		{
+			return pos;
+		}
+
+		pos = (pos + 1) & m_mask;
+	}
+}
+
+unsigned StringInterner::Find(char const *s, size_t len)
+{
+	wxUint32 hash = static_cast<wxUint32>(Hash(s, len));
+
+	return m_table[Lookup(s, len, hash)].m_id;
+}
+
+unsigned StringInterner::FindOrAdd(char const *s, size_t len)
+{
+	wxUint32 hash = static_cast<wxUint32>(Hash(s, len));
+	unsigned pos = Lookup(s, len, hash);
+
+	if (m_table[pos].m_id != NotFound())
+	{
+		return m_table[pos].m_id;
+	}
+
+	assert(m_count < NotFound() - 1);
+
+	if (m_count >= m_capacity)
+	{
+		Grow();
+		pos = Lookup(s, len, hash);
+	}
+
+	char *copy = static_cast<char *>(m_arena.Alloc(len + 1, 1));
+	memcpy(copy, s, len);
+	copy[len] = 0;
+
+	m_strings[m_count] = copy;
+	m_lengths[m_count] = len;
+	m_table[pos].m_id = m_count;
+	m_table[pos].m_hash = hash;
+
+	return m_count++;
+}
+
+void StringInterner::Grow()
+{
+	m_capacity *= 2;
+	m_strings = static_cast<char const **>(realloc(m_strings, m_capacity * sizeof(char const *)));
+	m_lengths = static_cast<wxUint32 *>(realloc(m_lengths, m_capacity * sizeof(wxUint32)));
+	assert(m_strings && m_lengths);
+
+	// move the slots to the bigger table, the hashes don't have to be computed again
+	Slot *old = m_table;
+	unsigned oldSize = m_mask + 1;
+
+	m_mask = 2 * m_capacity - 1;
+	m_table = new Slot[m_mask + 1];
+	memset(m_table, 0xFF, sizeof(Slot) * (m_mask + 1));
+
+	for (unsigned i = 0; i < oldSize; i++)
+	{
+		if (old[i].m_id == NotFound())
+		{
+			continue;
+		}
+
+		unsigned pos = old[i].m_hash & m_mask;
+		while (m_table[pos].m_id != NotFound())
+		{
+			pos = (pos + 1) & m_mask;
+		}
+
+		m_table[pos] = old[i];
+	}
+
+	delete [] old;
+}
@@ -0,0 +1,73 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __INTERNER_H__
+#define __INTERNER_H__
+
+#include <wx/defs.h>
+#include <string.h>
+#include <assert.h>
+#include "arena.h"
+
+// gives every distinct string a number, counting from 0. the strings are kept as raw utf8 bytes
+// (zero terminated) in an arena, and found through an open addressing hash table
+class StringInterner
+{
+	public:
+		StringInterner();
+		~StringInterner();
+
+		static unsigned NotFound()
+		{
+			return 0xFFFFFFFF;
+		}
+
+		unsigned Find(char const *s, size_t len);
+		unsigned Find(char const *s)
+		{
+			return Find(s, strlen(s));
+		}
+
+		unsigned FindOrAdd(char const *s, size_t len);
+		unsigned FindOrAdd(char const *s)
+		{
+			return FindOrAdd(s, strlen(s));
+		}
+
+		char const *Get(unsigned id)
+		{
+			assert(id < m_count);
+			return m_strings[id];
+		}
+
+		unsigned GetCount()
+		{
+			return m_count;
+		}
+
+		static wxUint64 Hash(char const *s, size_t len);
+
+	private:
+		// returns the table position of s, or of the empty slot where it should go
+		unsigned Lookup(char const *s, size_t len, wxUint32 hash);
+		void Grow();
+
+		Arena m_arena;
+
+		char const **m_strings;
+		wxUint32 *m_lengths;
+		unsigned m_count, m_capacity;
+
+		// ids, or NotFound() for empty slots. the hashes are kept next to them, so we hardly ever
+		// have to compare strings that don't match
+		struct Slot
+		{
+			wxUint32 m_id;
+			wxUint32 m_hash;
+		};
+
+		Slot *m_table;
+		unsigned m_mask;
+};
+
+#endif
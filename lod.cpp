@@ -0,0 +1,262 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "lod.h"
+#include "workerpool.h"
+
+#define LODJOBSIZE 16384
+
+// douglas-peucker on the nodes from..to (inclusive). keeps the nodes that are needed to stay within
+// tolerance of the line. x is scaled by cosLat, so the tolerance is the same in both directions
+static void Simplify(NodeStore *nodes, unsigned const *src, unsigned from, unsigned to, double tolerance, double cosLat, bool *keep, unsigned *stack)
+{
+	unsigned numStack = 0;
+	double tolSq = tolerance * tolerance;
+
+	keep[from] = keep[to] = true;
+	stack[numStack++] = from;
+	stack[numStack++] = to;
+
+	while (numStack)
+	{
+		unsigned last = stack[--numStack];
+		unsigned first = stack[--numStack];
+
+		if (last <= first + 1)
+		{
+			continue;
+		}
+
+		double x1 = nodes->Lon(src[first]) * cosLat, y1 = nodes->Lat(src[first]);
+		double dx = nodes->Lon(src[last]) * cosLat - x1, dy = nodes->Lat(src[last]) - y1;
+		double lenSq = dx * dx + dy * dy;
+
+		double maxDistSq = -1;
+		unsigned furthest = first;
+
+		for (unsigned i = first + 1; i < last; i++)
+		{
+			double px = nodes->Lon(src[i]) * cosLat - x1, py = nodes->Lat(src[i]) - y1;
+
+			// distance to the segment, or to the point for closed rings
+			double t = lenSq > 0 ? (px * dx + py * dy) / lenSq : 0;
+			if (t < 0)
+			{
+				t = 0;
+			}
+			else if (t > 1)
+			{
+				t = 1;
+			}
+
+			double ex = px - t * dx, ey = py - t * dy;
+			double distSq = ex * ex + ey * ey;
+
+			if (distSq > maxDistSq)
+			{
+				maxDistSq = distSq;
+				furthest = i;
+			}
+		}
+
+		if (maxDistSq > tolSq)
+		{
+			keep[furthest] = true;
+			stack[numStack++] = first;
+			stack[numStack++] = furthest;
+			stack[numStack++] = furthest;
+			stack[numStack++] = last;
+		}
+	}
+}
+
+void OsmWay::BuildLod(NodeStore *nodes)
+{
+	delete [] m_lodNodes;
+	m_lodNodes = NULL;
+
+	for (int i = 0; i < NUMLODBANDS; i++)
+	{
+		m_numLodNodes[i] = 0;
+	}
+
+	DRect bb = GetBB(nodes);
+
+	if (bb.IsEmpty())
+	{
+		return;
+	}
+
+	double cosLat = cos((bb.m_y + bb.m_h / 2) * M_PI / 180);
+	unsigned *bands = new unsigned[m_numResolvedNodes * NUMLODBANDS];
+	bool *keep = new bool[m_numResolvedNodes];
+	unsigned *stack = new unsigned[4 * m_numResolvedNodes];
+
+	// every band is simplified from the one before, which is a lot less work for the coarse ones
+	unsigned const *src = m_resolvedNodes;
+	unsigned numSrc = m_numResolvedNodes;
+	unsigned total = 0;
+
+	for (int b = 0; b < NUMLODBANDS; b++)
+	{
+		double tolerance = GetLodTolerance(b);
+
+		// the tolerances only grow
+		if (IsBelowTolerance(bb, tolerance))
+		{
+			break;
+		}
+
+		unsigned *dst = bands + total;
+		unsigned num = 0;
+
+		for (unsigned i = 0; i < numSrc; i++)
+		{
+			keep[i] = false;
+		}
+
+		// the runs between unresolved nodes are simplified separately
+		unsigned start = 0;
+		while (start < numSrc)
+		{
+			if (src[start] == NODE_INVALID)
+			{
+				dst[num++] = NODE_INVALID;
+				start++;
+				continue;
+			}
+
+			unsigned end = start;
+			while (end + 1 < numSrc && src[end + 1] != NODE_INVALID)
+			{
+				end++;
+			}
+
+			Simplify(nodes, src, start, end, tolerance, cosLat, keep, stack);
+
+			for (unsigned i = start; i <= end; i++)
+			{
+				if (keep[i])
+				{
+					dst[num++] = src[i];
+				}
+			}
+
+			start = end + 1;
+		}
+
+		m_numLodNodes[b] = num;
+		src = dst;
+		numSrc = num;
+		total += num;
+	}
+
+	if (total)
+	{
+		m_lodNodes = new unsigned[total];
+		memcpy(m_lodNodes, bands, total * sizeof(unsigned));
+	}
+
+	delete [] bands;
+	delete [] keep;
+	delete [] stack;
+}
+
+int OsmWay::GetLodBand(double pixelSize)
+{
+	int band = -1;
+
+	while (band + 1 < NUMLODBANDS && GetLodTolerance(band + 1) <= pixelSize)
+	{
+		band++;
+	}
+
+	return band;
+}
+
+bool OsmWay::IsBelowTolerance(DRect const &bb, double tolerance)
+{
+	// measure the width at the latitude closest to the equator, where a degree of longitude is widest
+	double lat = 0;
+
+	if (bb.m_y > 0)
+	{
+		lat = bb.m_y;
+	}
+	else if (bb.Top() < 0)
+	{
+		lat = -bb.Top();
+	}
+
+	return bb.m_h < tolerance && bb.m_w * cos(lat * M_PI / 180) < tolerance;
+}
+
+class LodJob
+	: public WorkerJob
+{
+	public:
+		LodJob(IdObjectStore *ways, NodeStore *nodes, unsigned first, unsigned num)
+		{
+			m_ways = ways;
+			m_nodes = nodes;
+			m_first = first;
+			m_num = num;
+			m_numNodes = 0;
+		}
+
+		void Run()
+		{
+			for (unsigned i = m_first; i < m_first + m_num; i++)
+			{
+				OsmWay *w = static_cast<OsmWay *>(m_ways->GetBySlot(i));
+
+				w->BuildLod(m_nodes);
+
+				for (int b = 0; b < NUMLODBANDS; b++)
+				{
+					m_numNodes += w->m_numLodNodes[b];
+				}
+			}
+		}
+
+		size_t m_numNodes;
+
+	private:
+		IdObjectStore *m_ways;
+		NodeStore *m_nodes;
+		unsigned m_first, m_num;
+};
+
+size_t BuildLevelsOfDetail(IdObjectStore *ways, NodeStore *nodes, WorkerPool *pool)
+{
+	unsigned count = ways->GetCount();
+	unsigned numJobs = (count + LODJOBSIZE - 1) / LODJOBSIZE;
+
+	if (!numJobs)
+	{
+		return 0;
+	}
+
+	LodJob **jobs = new LodJob *[numJobs];
+
+	for (unsigned i = 0; i < numJobs; i++)
+	{
+		unsigned first = i * LODJOBSIZE;
+
+		jobs[i] = new LodJob(ways, nodes, first, count - first < LODJOBSIZE ? count - first : LODJOBSIZE);
+		pool->Add(jobs[i]);
+	}
+
+	size_t ret = 0;
+
+	for (unsigned i = 0; i < numJobs; i++)
+	{
+		pool->Wait(jobs[i]);
+		ret += jobs[i]->m_numNodes;
+		delete jobs[i];
+	}
+
+	delete [] jobs;
+
+	return ret;
+}
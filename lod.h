@@ -0,0 +1,15 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __LOD_H__
+#define __LOD_H__
+
+#include "osm.h"
+
+class WorkerPool;
+
+// builds the simplified geometry of all ways in the store, spread over the threads of pool.
+// returns the number of nodes in all bands together
+size_t BuildLevelsOfDetail(IdObjectStore *ways, NodeStore *nodes, WorkerPool *pool);
+
+#endif
@@ -2,316 +2,60 @@
 // copyright Martijn Versteegh
 // osmbrowser is licenced under the gpl v3
 #include "osm.h"
+#include "resolve.h"
+#include "lod.h"
+#include "workerpool.h"
+#include <wx/stopwatch.h>
 #include <assert.h> // for lazy memory allocation checking
 #include <stdlib.h>
 #include <string.h>
 
 
-TagStore::TagStore()
-{
-	m_keys = NULL;
-	m_numKeys = 0;
-	m_maxNumKeys = 0;
-
-	m_maxNumValues = m_numValues = NULL;
-	m_values = NULL;
-	m_valueMappers	= NULL;
-
-	GrowKeys(1024);
-	
-}
-
-unsigned TagStore::GetNumKeys()
-{
-	return m_numKeys;
-}
-
-char const *TagStore::GetKey(unsigned keyIndex)
-{
-	assert(keyIndex >=0);
-	assert(keyIndex < m_numKeys);
-	return m_keys[keyIndex];
-}
-
-unsigned TagStore::GetNumValues(unsigned keyIndex)
-{
-	assert(keyIndex >=0);
-	assert(keyIndex  < m_numKeys);
-	
-	return m_numValues[keyIndex];
-}
-
-char const *TagStore::GetValue(unsigned keyIndex, unsigned valueIndex)
-{
-	assert(keyIndex >=0);
-	assert(keyIndex  < m_numKeys);
-	assert(valueIndex >=0);
-	assert(valueIndex < m_numValues[keyIndex]);
-
-	return m_values[keyIndex][valueIndex];
-}
-
-void TagStore::GrowKeys(unsigned amount)
-{
-	char **newKeys = new char *[m_maxNumKeys + amount];
-	char ***newValues = new char **[m_maxNumKeys + amount];
-	unsigned *newNumValues =  new unsigned[m_maxNumKeys + amount];
-	unsigned *newMaxNumValues = new unsigned[m_maxNumKeys + amount];
-	StringToIndexMapper **newMappers = new StringToIndexMapper *[m_maxNumKeys + amount];
-
-	for (unsigned i = 0; i < m_maxNumKeys; i++)
-	{
-		newKeys[i] = m_keys[i];
-		newValues[i] = m_values[i];
-		newNumValues[i] = m_numValues[i];
-		newMaxNumValues[i] = m_maxNumValues[i];
-		newMappers[i] = m_valueMappers[i];
-	}
-
-	for (unsigned i = 0; i < amount; i++)
-	{
-		newKeys[i + m_maxNumKeys] = NULL;
-		newValues[i + m_maxNumKeys] = NULL;
-		newMaxNumValues[i + m_maxNumKeys] = 0;
-		newNumValues[i + m_maxNumKeys] = 0;
-		newMappers[i + m_maxNumKeys] = NULL;
-	}
-
-
-	delete [] m_keys;
-	m_keys = newKeys;
-
-	delete [] m_values;
-	m_values = newValues;
-
-	delete [] m_numValues;
-	m_numValues = newNumValues;
-	
-	delete [] m_maxNumValues;
-	m_maxNumValues = newMaxNumValues;
-
-	delete [] m_valueMappers;
-	m_valueMappers = newMappers;
-
-	m_maxNumKeys += amount;
-}
-
-
-void TagStore::GrowValues(unsigned  key)
-{
-	unsigned  amount = m_maxNumValues[key];
-
-	if (!amount)
-		amount = 1;
-
-
-	char **newValues = new char *[m_maxNumValues[key] + amount];
-
-	for (unsigned i = 0; i < m_maxNumValues[key]; i++)
-		newValues[i] = m_values[key][i];
-
-	for (unsigned i = 0; i < amount; i++)
-		newValues[i + m_maxNumValues[key]] = NULL;
-		
-	delete [] m_values[key];
-
-	m_values[key] = newValues;
-	m_maxNumValues[key] += amount;
-	
-
-}
-
-TagStore::~TagStore()
-{
-	for (unsigned i = 0; i < m_numKeys; i++)
-	{
-		free(m_keys[i]);
-		delete m_valueMappers[i];
-		for (unsigned j = 0; j < m_numValues[i]; j++)
-		{
-			free(m_values[i][j]);
-		}
-		delete [] m_values[i];
-	}
-	
-	delete [] m_keys;
-	delete [] m_values;
-	delete [] m_maxNumValues;
-	delete [] m_numValues;
-	delete [] m_valueMappers;
-}
-
 TagIndex TagStore::Find(char const *key, char const *value)
 {
-	unsigned k = 0;
-
+	unsigned k = m_keys.Find(key);
 
-	if (!FindKey(key, &k))
-		return TagIndex::CreateInvalid();
-
-	if (!value)
+	if (k == StringInterner::NotFound())
 	{
-		return TagIndex::Create(k);
-	}
-
-	unsigned v = 0;
-
-	if (!FindValue(k, value, &v))
 		return TagIndex::CreateInvalid();
-
-	return TagIndex::Create(k, v + 1);
-}
-
-char const *TagStore::GetKey(TagIndex index)
-{
-	assert(index.m_keyIndex >=0 && index.m_keyIndex < m_numKeys);
-	
-	return m_keys[index.m_keyIndex];
-}
-
-char const *TagStore::GetValue(TagIndex index)
-{
-	assert(index.m_keyIndex >=0 && index.m_keyIndex < m_numKeys);
-	assert(index.m_valueIndex >= 1 && index.m_valueIndex - 1 < m_numValues[index.m_keyIndex]);
-
-	return m_values[index.m_keyIndex][index.m_valueIndex - 1];
-}
-
-bool TagStore::FindKey(char const *key, unsigned *k)
-{
-	StringToIndexMapper::iterator f = m_keyMapper.find(wxString(key, wxConvUTF8));
-
-	if (f == m_keyMapper.end())
-		return false;
-
-	*k = f->second;
-
-	return true;
-}
-
-
-bool TagStore::FindValue(unsigned key, char const *value, unsigned *v)
-{
-
-	if (m_valueMappers[key])
-	{
-		StringToIndexMapper::iterator f = m_valueMappers[key]->find(wxString(value, wxConvUTF8));
-
-		if (f == m_valueMappers[key]->end())
-			return false;
-	
-		*v = f->second;
-	
-		return true;
-	
 	}
 
-	for (unsigned i = 0; i < m_numValues[key]; i++)
+	if (!value)
 	{
-		if (!strcmp(value, m_values[key][i]))
-		{
-			*v = i;
-			return true;
-		}
+		return TagIndex::Create(k);
 	}
 
-	return false;
-}
-
-unsigned TagStore::AddKey(char const *k)
-{
-	assert(m_numKeys < TagIndex::MaxNumKeys());
-
-	if (m_numKeys >= m_maxNumKeys)
-		GrowKeys(m_maxNumKeys ? m_maxNumKeys : 1024);
-
-	m_keys[m_numKeys] = strdup(k);
-	assert(m_keys[m_numKeys]);
-
-	wxString  s = wxString(m_keys[m_numKeys], wxConvUTF8);
+	unsigned v = m_values.Find(value);
 
-	m_keyMapper.insert(StringToIndexMapper::value_type(s, m_numKeys));
-
-	m_numKeys++;
-
-	return m_numKeys -1;
-}
-
-unsigned TagStore::AddValue(unsigned key, char const *value)
-{
-//        if (m_numValues[key] >= TagIndex::MaxNumValues())
-//        {
-//          printf("key = %d (%s) numv %d (%s)!\n", key, m_keys[key], m_numValues[key], value);
-//        }
-
-	assert(m_numValues[key] < TagIndex::MaxNumValues());
-
-	if (m_numValues[key] >= m_maxNumValues[key])
-		GrowValues(key);
-
-	m_values[key][m_numValues[key]] = strdup(value);
-	assert(m_values[key][m_numValues[key]]);
-
-
-	if (m_numValues[key] > 5)
+	if (v == StringInterner::NotFound())
 	{
-		if (!m_valueMappers[key])
-		{
-			m_valueMappers[key] = new StringToIndexMapper;
-			for (unsigned i = 0; i < m_numValues[key]; i++)
-			{
-				wxString s = wxString(m_values[key][i], wxConvUTF8);
-				m_valueMappers[key]->insert(StringToIndexMapper::value_type(s, i));
-			}
-		}
-
-		wxString s = wxString(m_values[key][m_numValues[key]], wxConvUTF8);
-		m_valueMappers[key]->insert(StringToIndexMapper::value_type(s, m_numValues[key]));
-
+		return TagIndex::CreateInvalid();
 	}
 
-
-	m_numValues[key]++;
-	
-	return m_numValues[key] - 1;
+	return TagIndex::Create(k, v + 1);
 }
 
-TagStore *OsmTag::m_tagStore = 0;
-
 TagIndex TagStore::FindOrAdd(char const *key, char const *value)
 {
-	TagIndex t = Find(key, value);
-
-	if (t.Valid())
-		return t;
-
+	unsigned k = m_keys.FindOrAdd(key);
 
-	unsigned k = 0;
-
-	if (!FindKey(key, &k))
-	{
-		k = AddKey(key);
-	}
+	assert(k < TagIndex::MaxNumKeys());
 
 	if (!value)
 	{
 		return TagIndex::Create(k);
 	}
 
-	unsigned v = 0;
+	unsigned v = m_values.FindOrAdd(value);
 
+	assert(v < TagIndex::MaxNumValues());
 
-	if (!FindValue(k, value, &v));
-	{
-		v = AddValue(k, value);
-	}
-	
 	return TagIndex::Create(k, v + 1);
 }
 
+TagStore *OsmTag::m_tagStore = 0;
 
-OsmTag::OsmTag(char const *k, char const *v, OsmTag *next)
-	: ListObject(next)
+OsmTag::OsmTag(char const *k, char const *v)
 {
 	if (!m_tagStore)
 	{
@@ -321,8 +65,7 @@ OsmTag::OsmTag(char const *k, char const *v, OsmTag *next)
 	m_index = m_tagStore->FindOrAdd(k, v);
 }
 
-OsmTag::OsmTag(bool noCreate, char const *k, char const *v, OsmTag *next)
-	: ListObject(next)
+OsmTag::OsmTag(bool noCreate, char const *k, char const *v)
 {
 	if (!m_tagStore)
 	{
@@ -339,15 +82,32 @@ OsmTag::OsmTag(bool noCreate, char const *k, char const *v, OsmTag *next)
 	}
 }
 
-OsmTag::OsmTag(OsmTag const &other)
-	: ListObject(other.m_next)
+void TagList::Set(Arena *arena, TagIndex const *tags, unsigned num)
 {
-	m_index = other.m_index;
-}
+	m_num = num;
 
+	if (!num)
+	{
+		m_tags = NULL;
+		return;
+	}
 
-OsmTag::~OsmTag()
-{
+	m_tags = static_cast<TagIndex *>(arena->Alloc(num * sizeof(TagIndex)));
+
+	// insertion sort, objects have only a few tags
+	for (unsigned i = 0; i < num; i++)
+	{
+		TagIndex t = tags[i];
+		unsigned j = i;
+
+		while (j > 0 && m_tags[j - 1].m_keyIndex > t.m_keyIndex)
+		{
+			m_tags[j] = m_tags[j - 1];
+			j--;
+		}
+
+		m_tags[j] = t;
+	}
 }
 
 bool OsmTag::KeyExists(char const *key)
@@ -363,22 +123,22 @@ bool OsmTag::KeyExists(char const *key)
 }
 
 
-OsmNode *OsmWay::GetClosestNode(double lon, double lat, double *foundDistSquared)
+unsigned OsmWay::GetClosestNode(NodeStore *nodes, double lon, double lat, double *foundDistSquared)
 {
 	double found = -1;
-	unsigned foundIndex = 0;
+	unsigned foundNode = NODE_INVALID;
 	double distsq;
 	
 	for (unsigned i = 0; i < m_numResolvedNodes; i++)
 	{
-		if (m_resolvedNodes[i])
+		unsigned n = m_resolvedNodes[i];
+		if (n != NODE_INVALID)
 		{
-			distsq = DISTSQUARED(m_resolvedNodes[i]->Lon(), m_resolvedNodes[i]->Lat(), lon, lat);
+			distsq = DISTSQUARED(nodes->Lon(n), nodes->Lat(n), lon, lat);
 
-//			printf("%p:  %f %f  %f %f  %f\n", m_resolvedNodes[i], m_resolvedNodes[i]->m_lon, m_resolvedNodes[i]->m_lat, lon, lat, distsq);
 			if (found < 0 || distsq < found)
 			{
-				foundIndex = i;
+				foundNode = n;
 				found = distsq;
 			}
 		}
@@ -389,157 +149,323 @@ OsmNode *OsmWay::GetClosestNode(double lon, double lat, double *foundDistSquared
 		*foundDistSquared = found;
 	}
 
-	return m_resolvedNodes[foundIndex];
+	return foundNode;
 }
 
 
-void OsmWay::Resolve(IdObjectStore *store)
+void OsmWay::Resolve(unsigned const *resolvedRefs)
 {
-	if (!m_nodeRefs)
+	if (!m_numNodeRefs)
 	{
 		return;
 	}
 
-	unsigned size = m_nodeRefs->GetSize();
+	assert(!m_resolvedNodes);
 
-	assert((!m_numResolvedNodes) || (m_numResolvedNodes == size));
+	m_numResolvedNodes = m_numNodeRefs;
+	m_resolvedNodes = new unsigned[m_numResolvedNodes];
+	memcpy(m_resolvedNodes, resolvedRefs + m_firstNodeRef, m_numResolvedNodes * sizeof(unsigned));
 
-	m_numResolvedNodes = size;
+	m_numNodeRefs = 0;
+}
 
-	if (!m_resolvedNodes)
+unsigned OsmRelation::Resolve(unsigned const *resolvedNodeRefs, IdObjectStore *wayStore, RefPool const *wayRefs, Arena *arena)
+{
+	OsmWay::Resolve(resolvedNodeRefs);
+
+	if (!m_numWayRefs)
 	{
-		m_resolvedNodes = new OsmNode *[size];
+		return 0;
 	}
 
-	IdObject *o = m_nodeRefs;
-	bool resolvedAll = true;
+	assert(!m_resolvedWays);
+
+	unsigned size = m_numWayRefs;
+	OsmId const *refs = wayRefs->m_ids + m_firstWayRef;
+	unsigned missing = 0;
+
+	m_resolvedWays = new OsmWay *[size];
+	m_numResolvedWays = size;
+
 	for (unsigned i = 0; i < size; i++)
 	{
-		m_resolvedNodes[i] = (OsmNode *)store->GetObject(o->m_id);
-		o = (IdObject *)o->m_next;
+		m_resolvedWays[i] = static_cast<OsmWay *>(wayStore->GetObject(refs[i]));
+
+		if (!m_resolvedWays[i])
+		{
+			missing++;
+		}
+		else
+		{
+			// add ourselves to this way's relations
+			m_resolvedWays[i]->m_relations = new (arena) OsmRelationList(this, m_resolvedWays[i]->m_relations);
+		}
+	}
+
+	m_numWayRefs = 0;
+
+	return missing;
+}
+
+NodeStore::NodeStore()
+{
+	m_ids = m_ownIds = NULL;
+	m_ilat = m_ownLat = NULL;
+	m_ilon = m_ownLon = NULL;
+	m_count = 0;
+	m_capacity = 0;
+	m_sorted = true;
+	m_index = NULL;
+}
+
+NodeStore::~NodeStore()
+{
+	FreeColumns();
+	delete m_index;
+}
+
+void NodeStore::FreeColumns()
+{
+	delete [] m_ownIds;
+	delete [] m_ownLat;
+	delete [] m_ownLon;
+
+	m_ids = m_ownIds = NULL;
+	m_ilat = m_ownLat = NULL;
+	m_ilon = m_ownLon = NULL;
+}
+
+void NodeStore::Reserve(unsigned size)
+{
+	if (size > m_capacity)
+	{
+		Resize(size);
+	}
+}
+
+void NodeStore::Resize(unsigned size)
+{
+	// adopted columns can't grow
+	assert(m_ids == m_ownIds);
+	assert(size >= m_count);
+
+	OsmId *ids = new OsmId[size];
+	wxInt32 *ilat = new wxInt32[size];
+	wxInt32 *ilon = new wxInt32[size];
 
-		if (!m_resolvedNodes[i])
-			resolvedAll = false;
+	memcpy(ids, m_ids, sizeof(OsmId) * m_count);
+	memcpy(ilat, m_ilat, sizeof(wxInt32) * m_count);
+	memcpy(ilon, m_ilon, sizeof(wxInt32) * m_count);
+
+	FreeColumns();
+
+	m_ids = m_ownIds = ids;
+	m_ilat = m_ownLat = ilat;
+	m_ilon = m_ownLon = ilon;
+	m_capacity = size;
+}
+
+unsigned NodeStore::AddFixed(OsmId id, wxInt32 ilat, wxInt32 ilon)
+{
+	if (m_count >= m_capacity)
+	{
+		Reserve(m_capacity + m_capacity / 2 + 1024);
+	}
+
+	if (m_count && id < m_ids[m_count - 1])
+	{
+		if (m_sorted)
+		{
+			// from now on we need a real index. add everything we had so far
+			m_sorted = false;
+			m_index = IdIndex::Create(IdIndex::IDX_HASH, m_capacity);
+			for (unsigned i = 0; i < m_count; i++)
+			{
+				m_index->Add(m_ids[i], i);
+			}
+		}
 	}
 
-	if (resolvedAll)
+	if (m_index)
 	{
-		m_nodeRefs->DestroyList();
-	   m_nodeRefs = NULL;
+		m_index->Add(id, m_count);
 	}
 
+	m_ownIds[m_count] = id;
+	m_ownLat[m_count] = ilat;
+	m_ownLon[m_count] = ilon;
+
+	return m_count++;
 }
 
-void OsmRelation::Resolve(IdObjectStore *nodeStore, IdObjectStore *wayStore)
+void NodeStore::Adopt(unsigned count, OsmId const *ids, wxInt32 const *ilat, wxInt32 const *ilon)
 {
-	OsmWay::Resolve(nodeStore);
+	FreeColumns();
+	delete m_index;
+	m_index = NULL;
 
-	if (!m_wayRefs)
+	m_ids = ids;
+	m_ilat = ilat;
+	m_ilon = ilon;
+	m_count = m_capacity = count;
+
+	m_sorted = true;
+	for (unsigned i = 1; i < count; i++)
 	{
-		return;
+		if (ids[i] < ids[i - 1])
+		{
+			m_sorted = false;
+			m_index = IdIndex::Create(IdIndex::IDX_HASH, count);
+			for (unsigned j = 0; j < count; j++)
+			{
+				m_index->Add(ids[j], j);
+			}
+			break;
+		}
 	}
+}
 
-	unsigned size = m_wayRefs->GetSize();
+unsigned NodeStore::Find(OsmId id)
+{
+	unsigned ret = m_sorted ? InterpolationSearch(m_ids, m_count, id) : m_index->Find(id);
 
-	assert((!m_numResolvedWays) || (m_numResolvedWays == size));
+	return ret == IdIndex::NotFound() ? NODE_INVALID : ret;
+}
 
-	m_numResolvedWays = size;
+void NodeStore::Finish()
+{
+	// drop the slack left by growing
+	if (m_ids == m_ownIds && m_count < m_capacity)
+	{
+		Resize(m_count ? m_count : 1);
+	}
 
-	if (!m_resolvedWays)
+	if (m_index)
 	{
-		m_resolvedWays = new OsmWay *[size];
+		m_index->Finish();
 	}
+}
 
-	IdObject *o = m_wayRefs;
-	bool resolvedAll = true;
-	for (unsigned i = 0; i < size; i++)
+void NodeStore::GetStatistics(double *avgLen, double *standardDeviation, int *maxLen)
+{
+	if (m_index)
 	{
-		m_resolvedWays[i] = (OsmWay *)wayStore->GetObject(o->m_id);
-		o = (IdObject *)o->m_next;
+		m_index->GetStatistics(avgLen, standardDeviation, maxLen);
+		return;
+	}
 
-		if (!m_resolvedWays[i])
-		{
-			resolvedAll = false;
-		}
-		else
+	unsigned long long s1 = 0, s2 = 0, n = 0;
+	*maxLen = 0;
+
+	// sample, like SortedIdIndex does
+	unsigned step = m_count / 4096 + 1;
+	for (unsigned i = 0; i < m_count; i += step)
+	{
+		int c;
+		InterpolationSearch(m_ids, m_count, m_ids[i], &c);
+		s1 += c;
+		s2 += c * c;
+		n++;
+		if (c > *maxLen)
 		{
-			// add ourselves to this way's relations
-			m_resolvedWays[i]->m_relations = new OsmRelationList(this, m_resolvedWays[i]->m_relations);
+			*maxLen = c;
 		}
 	}
 
-	if (resolvedAll)
+	if (!n)
 	{
-		m_wayRefs->DestroyList();
-		m_wayRefs = NULL;
+		*avgLen = *standardDeviation = 0;
+		return;
 	}
 
+	*avgLen = static_cast<double>(s1) / n;
+	double var = static_cast<double>(s2) / n - *avgLen * *avgLen;
+	*standardDeviation = var > 0 ? sqrt(var) : 0;
 }
 
-IdObjectStore::IdObjectStore(unsigned bitmaskSize)
+static int CompareUnsigned(void const *a, void const *b)
 {
-	m_size = 1 << bitmaskSize;
-	m_mask = 0;
+	unsigned ua = *static_cast<unsigned const *>(a);
+	unsigned ub = *static_cast<unsigned const *>(b);
+
+	return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
 
-	for (unsigned i = 0; i < bitmaskSize; i++)
-		m_mask |= 1 << i;
+unsigned *NodeStore::GetTaggedNodes(unsigned *num)
+{
+	*num = 0;
+	unsigned *ret = new unsigned[m_tags.size() + 1];
+
+	for (NodeTagMapper::iterator i = m_tags.begin(); i != m_tags.end(); ++i)
+	{
+		ret[(*num)++] = i->first;
+	}
 
+	qsort(ret, *num, sizeof(unsigned), CompareUnsigned);
+
+	return ret;
+}
+
+IdObjectStore::IdObjectStore(IdIndex::TYPE indexType, unsigned expectedSize)
+{
 	m_content = NULL;
-	m_locator = new ObjectList *[m_size];
+	m_count = 0;
+	m_capacity = 0;
+	m_objects = NULL;
+	m_index = IdIndex::Create(indexType, expectedSize);
 
-	memset(m_locator, 0, sizeof(ObjectList *) * m_size);
-	
+	Reserve(expectedSize ? expectedSize : 1024);
 }
 
 
 IdObjectStore::~IdObjectStore()
 {
-	for (int i = 0; i < m_size; i++)
+	for (unsigned i = 0; i < m_count; i++)
 	{
-		if (m_locator[i])
-			delete m_locator[i];
+		delete m_objects[i];
 	}
 
-	delete [] m_locator;
+	delete [] m_objects;
+	delete m_index;
 }
 
-void IdObjectStore::AddObject(IdObject *o)
+void IdObjectStore::Reserve(unsigned size)
 {
-	if (!o)
+	if (size <= m_capacity)
+	{
 		return;
+	}
 
-//    o->m_size = m_content ? m_content->m_size + 1 : 1;
-
-	o->m_next = m_content;
-	m_content = o;
-
-	unsigned key = o->m_id & m_mask;
+	IdObject **objects = new IdObject *[size];
+	memcpy(objects, m_objects, sizeof(IdObject *) * m_count);
+	delete [] m_objects;
+	m_objects = objects;
+	m_capacity = size;
 
-	m_locator[key] = new ObjectList(o, m_locator[key]);
-	
+	m_index->Reserve(size);
 }
 
-IdObject *IdObjectStore::GetObject(unsigned id)
+void IdObjectStore::AddObject(IdObject *o)
 {
-	unsigned key = id & m_mask;
+	if (!o)
+		return;
 
-	ObjectList *o = m_locator[key];
+	o->m_next = m_content;
+	m_content = o;
 
-	while (o)
+	if (m_count >= m_capacity)
 	{
-		if (o->m_object->m_id == id)
-		{
-			return o->m_object;
-		}
-		o = o->m_next;
+		Reserve(m_capacity + m_capacity / 2 + 1024);
 	}
 
-	return NULL;
+	m_objects[m_count] = o;
+	m_index->Add(o->m_id, m_count);
+	m_count++;
 }
 
 
-OsmData::OsmData()
-	: m_nodes(24), m_ways(16), m_relations(16)
+OsmData::OsmData(IdIndex::TYPE wayIndex, IdIndex::TYPE relationIndex)
+	: m_ways(wayIndex), m_relations(relationIndex)
 {
 	m_minlat = m_maxlat = m_minlon = m_maxlon = 0;
 	m_parsingState = PARSE_TOPLEVEL;
@@ -547,16 +473,20 @@ OsmData::OsmData()
 	m_skipAttribs = false;
 }
 
-void OsmData::StartNode(unsigned id, double lat, double lon)
+void OsmData::Reserve(unsigned numNodes, unsigned numWays, unsigned numRelations)
+{
+	m_nodes.Reserve(numNodes);
+	m_ways.Reserve(numWays);
+	m_relations.Reserve(numRelations);
+}
+
+void OsmData::StartNode(OsmId id, double lat, double lon)
 {
 	assert(m_parsingState == PARSE_TOPLEVEL);
 
 	m_parsingState = PARSE_NODE;
 
-	OsmNode *node = new OsmNode(id, lat, lon);
-
-
-	if (!m_nodes.m_content)
+	if (!m_nodes.GetCount())
 	{
 		m_minlat = m_maxlat = lat;
 		m_minlon = m_maxlon = lon;
@@ -574,7 +504,7 @@ void OsmData::StartNode(unsigned id, double lat, double lon)
 			m_maxlon = lon;
 	}
 
-	m_nodes.AddObject(node);
+	m_nodes.Add(id, lat, lon);
 	m_elementCount++;
 }
 
@@ -582,16 +512,20 @@ void OsmData::EndNode()
 {
 	assert(m_parsingState == PARSE_NODE);
 
+	m_nodes.SetTags(m_nodes.GetCount() - 1, m_pendingTags.m_tags, m_pendingTags.m_num);
+	m_pendingTags.Clear();
+
 	m_parsingState = PARSE_TOPLEVEL;
 }
 
-void OsmData::StartWay(unsigned id)
+void OsmData::StartWay(OsmId id)
 {
 	assert(m_parsingState == PARSE_TOPLEVEL);
 
 	m_parsingState = PARSE_WAY;
 
 	OsmWay *way = new OsmWay(id);
+	way->m_firstNodeRef = m_nodeRefs.GetCount();
 
 	m_ways.AddObject(way);
 	m_elementCount++;
@@ -599,20 +533,25 @@ void OsmData::StartWay(unsigned id)
 
 void OsmData::EndWay()
 {
-	static_cast<OsmWay *>(m_ways.m_content)->Resolve(&m_nodes);
+	OsmWay *way = static_cast<OsmWay *>(m_ways.m_content);
 
 	assert(m_parsingState == PARSE_WAY);
 
+	way->SetTags(&m_arena, m_pendingTags.m_tags, m_pendingTags.m_num);
+	m_pendingTags.Clear();
+
 	m_parsingState = PARSE_TOPLEVEL;
 }
 
-void OsmData::StartRelation(unsigned id)
+void OsmData::StartRelation(OsmId id)
 {
 	assert(m_parsingState == PARSE_TOPLEVEL);
 
 	m_parsingState = PARSE_RELATION;
 
 	OsmRelation *rel = new OsmRelation(id);
+	rel->m_firstNodeRef = m_nodeRefs.GetCount();
+	rel->m_firstWayRef = m_wayRefs.GetCount();
 
 	m_relations.AddObject(rel);
 	m_elementCount++;
@@ -620,14 +559,18 @@ void OsmData::StartRelation(unsigned id)
 
 void OsmData::EndRelation()
 {
-	static_cast<OsmRelation *>(m_relations.m_content)->Resolve(&m_nodes, &m_ways);
+	OsmRelation *rel = static_cast<OsmRelation *>(m_relations.m_content);
+
 	assert(m_parsingState == PARSE_RELATION);
 
+	rel->SetTags(&m_arena, m_pendingTags.m_tags, m_pendingTags.m_num);
+	m_pendingTags.Clear();
+
 	m_parsingState = PARSE_TOPLEVEL;
 }
 
 
-void OsmData::AddNodeRef(unsigned id)
+void OsmData::AddNodeRef(OsmId id)
 {
 	switch (m_parsingState)
 	{
@@ -635,38 +578,37 @@ void OsmData::AddNodeRef(unsigned id)
 			abort();
 			break;
 		case PARSE_WAY:
-			((OsmWay *)m_ways.m_content)->AddNodeRef(id);
+			m_nodeRefs.Add(id);
+			((OsmWay *)m_ways.m_content)->m_numNodeRefs++;
 			break;
 		case PARSE_RELATION:
-			((OsmRelation *)m_relations.m_content)->AddNodeRef(id);
+			m_nodeRefs.Add(id);
+			((OsmRelation *)m_relations.m_content)->m_numNodeRefs++;
 			break;
 	}
 }
 
-void OsmData::AddWayRef(unsigned id)
+void OsmData::AddWayRef(OsmId id)
 {
 	assert(m_parsingState == PARSE_RELATION);
 
-	((OsmRelation *)(m_relations.m_content))->AddWayRef(id);
+	m_wayRefs.Add(id);
+	((OsmRelation *)(m_relations.m_content))->m_numWayRefs++;
 }
 
 void OsmData::AddTag(char const *key, char const *value)
 {
-	switch(m_parsingState)
+	AddTag(OsmTag::GetTagStore()->FindOrAdd(key, value));
+}
+
+void OsmData::AddTag(TagIndex tag)
+{
+	if (m_parsingState == PARSE_TOPLEVEL)
 	{
-		default:
-			abort();
-			break;
-		case PARSE_NODE:
-			static_cast<IdObjectWithTags *>(m_nodes.m_content)->AddTag(key, value);
-			break;
-		case PARSE_WAY:
-			static_cast<IdObjectWithTags *>(m_ways.m_content)->AddTag(key, value);
-			break;
-		case PARSE_RELATION:
-			static_cast<IdObjectWithTags *>(m_relations.m_content)->AddTag(key, value);
-			break;
+		abort();
 	}
+
+	m_pendingTags.Add(tag);
 }
 
 void OsmData::AddAttribute(char const *key, char const *value)
@@ -682,33 +624,70 @@ void OsmData::AddAttribute(char const *key, char const *value)
 	strncpy(newkey+1, key, 1022);
 	newkey[1023] = 0;
 	
-	switch(m_parsingState)
-	{
-		default:
-			abort();
-			break;
-		case PARSE_NODE:
-			static_cast<IdObjectWithTags *>(m_nodes.m_content)->AddTag(newkey, value);
-			break;
-		case PARSE_WAY:
-			static_cast<IdObjectWithTags *>(m_ways.m_content)->AddTag(newkey, value);
-			break;
-		case PARSE_RELATION:
-			static_cast<IdObjectWithTags *>(m_relations.m_content)->AddTag(newkey, value);
-			break;
-	}
+	AddTag(newkey, value);
 }
 
 
 void OsmData::Resolve()
 {
+	wxStopWatch timer;
+
+	m_nodes.Finish();
+
+	// all node refs of all ways and relations in one sort-merge pass, instead of a lookup per ref
+	size_t numNodeRefs = m_nodeRefs.GetCount();
+	unsigned *resolvedNodeRefs = new unsigned[numNodeRefs ? numNodeRefs : 1];
+	size_t missingNodeRefs = 0;
+	WorkerPool pool;
+
+	if (numNodeRefs)
+	{
+		missingNodeRefs = ResolveNodeRefs(&m_nodes, m_nodeRefs.m_ids, numNodeRefs, resolvedNodeRefs, &pool);
+	}
+
 	for (OsmWay *w = static_cast<OsmWay *>(m_ways.m_content); w; w = static_cast<OsmWay *>(w->m_next))
 	{
-		w->Resolve(&m_nodes);
+		w->Resolve(resolvedNodeRefs);
 	}
-	
+
+	// the way index has to be complete before the relations can look up their ways
+	m_ways.Finish();
+
+	size_t numWayRefs = m_wayRefs.GetCount();
+	size_t missingWayRefs = 0;
+
 	for (OsmRelation *r = static_cast<OsmRelation *>(m_relations.m_content); r; r = static_cast<OsmRelation *>(r->m_next))
 	{
-		r->Resolve(&m_nodes, &m_ways);
+		missingWayRefs += r->Resolve(resolvedNodeRefs, &m_ways, &m_wayRefs, &m_arena);
+	}
+
+	delete [] resolvedNodeRefs;
+	m_nodeRefs.Free();
+	m_wayRefs.Free();
+
+	m_relations.Finish();
+
+	if (numNodeRefs || numWayRefs)
+	{
+		double seconds = timer.Time() / 1000.0;
+
+		printf("resolved %llu node refs (%llu missing) and %llu way refs (%llu missing) in %.2fs",
+			(unsigned long long)numNodeRefs, (unsigned long long)missingNodeRefs,
+			(unsigned long long)numWayRefs, (unsigned long long)missingWayRefs, seconds);
+
+		if (seconds > 0)
+		{
+			printf(", %.1fM refs/s", (numNodeRefs + numWayRefs) / seconds / 1000000.0);
+		}
+
+		printf("\n");
+	}
+
+	// ways from a cache have no refs, and get their levels of detail from the cache as well
+	if (numNodeRefs)
+	{
+		timer.Start();
+		size_t numLodNodes = BuildLevelsOfDetail(&m_ways, &m_nodes, &pool);
+		printf("simplified the ways to %llu nodes in %d bands in %.2fs\n", (unsigned long long)numLodNodes, NUMLODBANDS, timer.Time() / 1000.0);
 	}
 }
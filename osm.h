@@ -10,8 +10,10 @@
 #include <assert.h>
 //#include <stdio.h>
 #include <wx/hashmap.h>
-#include <wx/hashset.h>
 #include <wx/arrstr.h>
+#include "idindex.h"
+#include "arena.h"
+#include "interner.h"
 
 #define DISTSQUARED(x1, y1, x2, y2)  (((x1) - (x2)) * ((x1) - (x2)) + ((y1) - (y2)) * ((y1) - (y2)))
 
@@ -104,6 +106,17 @@ class DRect
 		double m_x, m_y;
 		double m_w, m_h;
 
+		// with dx more on the left and right, and dy more at the bottom and top
+		DRect Grow(double dx, double dy)
+		{
+			if (m_w < 0)
+			{
+				return *this;
+			}
+
+			return DRect(m_x - dx, m_y - dy, m_w + 2 * dx, m_h + 2 * dy);
+		}
+
 		DRect Add(DRect const &other)
 		{
 			DRect ret = *this;
@@ -275,250 +288,331 @@ class TagIndex
 
 };
 
-WX_DECLARE_STRING_HASH_MAP( unsigned , StringToIndexMapper );
+// interns the keys and values of all tags. keys and values have separate numbering, the values are
+// shared by all keys
+class TagStore
+{
+	public:
+	unsigned GetNumKeys()
+	{
+		return m_keys.GetCount();
+	}
+
+	char const *GetKey(unsigned keyIndex)
+	{
+		return m_keys.Get(keyIndex);
+	}
+
+	unsigned GetNumValues()
+	{
+		return m_values.GetCount();
+	}
 
-class StringStore
+	TagIndex FindOrAdd(char const *key, char const *value);
+	TagIndex Find(char const *key, char const *value);
+
+	char const *GetKey(TagIndex index)
+	{
+		return m_keys.Get(index.m_keyIndex);
+	}
+
+	// returns NULL for a key only tag
+	char const *GetValue(TagIndex index)
+	{
+		return index.m_valueIndex ? m_values.Get(index.m_valueIndex - 1) : NULL;
+	}
+
+	private:
+	StringInterner m_keys;
+	StringInterner m_values;
+};
+
+// a tag, interned in the global tagstore. objects don't store these, they store the TagIndex
+class OsmTag
 {
 	public:
+	OsmTag(char const *key, char const *value = NULL);
+	// doesn't add the tag to the tagstore if it isn't there. it is invalid then
+	OsmTag(bool noCreate, char const *key, char const *value = NULL);
+	// for tags that are already interned in the tagstore
+	OsmTag(TagIndex index)
+	{
+		m_index = index;
+	}
 
-		unsigned GetInvalid()
-		{
-			return 0xFFFFFFFF;
-		}
+	static bool KeyExists(char const *key);
 
-		unsigned Find(char const *s, bool add = true)
+	static TagStore *GetTagStore()
+	{
+		if (!m_tagStore)
 		{
-			wxString st(s, wxConvUTF8);
-			return Find(st, add);
+			m_tagStore = new TagStore;
 		}
 
-		unsigned Find(wxString const &s, bool add = true)
-		{
-			unsigned id = FindNoAdd(s);
+		return m_tagStore;
+	}
 
-			if (!add)
-			{
-				return id;
-			}
+	bool Valid()
+	{
+		return m_index.Valid();
+	}
 
-			if (id == 0xFFFFFFFF)
-			{
-				return Add(s);
-			}
+	TagIndex Index() { return m_index; }
 
-			return id;
-		}
+	char const *GetKey() const
+	{
+		return m_tagStore->GetKey(m_index);
+	}
 
-		wxString const &Get(unsigned id)
-		{
-			if (id < m_strings.GetCount())
-				return m_strings[id];
+	char const *GetValue() const
+	{
+		return m_tagStore->GetValue(m_index);
+	}
 
-			return empty;
+	static TagStore *m_tagStore;
+	TagIndex m_index;
+	
+};
+
+// the tags of one object, as an array sorted by key index. the array itself lives in an arena
+class TagList
+{
+	public:
+		TagList()
+		{
+			m_tags = NULL;
+			m_num = 0;
 		}
 
+		// copies the tags to arena
+		void Set(Arena *arena, TagIndex const *tags, unsigned num);
 
-	private:
-		unsigned FindNoAdd(wxString const &s)
+		unsigned GetSize() const
 		{
-			StringToIndexMapper::iterator f = m_mapper.find(s);
+			return m_num;
+		}
 
-			if (f == m_mapper.end())
-				return 0xFFFFFFFF;
+		TagIndex Get(unsigned i) const
+		{
+			assert(i < m_num);
+			return m_tags[i];
+		}
 
-			return f->second;
+		// the position of the first tag with this key, or of the first tag after it
+		unsigned Find(unsigned keyIndex) const
+		{
+			unsigned lo = 0, hi = m_num;
+			while (lo < hi)
+			{
+				unsigned mid = (lo + hi) / 2;
 
+				if (m_tags[mid].m_keyIndex < keyIndex)
+				{
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid;
+				}
+			}
+
+			return lo;
 		}
 
-		unsigned Add(wxString const &s)
+		// a tag with value index 0 matches any value of that key
+		bool Has(TagIndex tag) const
 		{
-			unsigned id = m_strings.Add(s);
-			m_mapper.insert(StringToIndexMapper::value_type(m_strings[id] , id));
+			// broken data can have the same key more than once
+			for (unsigned lo = Find(tag.m_keyIndex); lo < m_num && m_tags[lo].m_keyIndex == tag.m_keyIndex; lo++)
+			{
+				if (!tag.m_valueIndex || m_tags[lo].m_valueIndex == tag.m_valueIndex)
+				{
+					return true;
+				}
+			}
 
-			return id;
+			return false;
 		}
 
-		StringToIndexMapper m_mapper;
-		wxArrayString m_strings;
+		// whether a tag with this key has one of the values in set, a bitset of value indices
+		bool HasValueIn(unsigned keyIndex, wxUint32 const *set, unsigned numWords) const
+		{
+			for (unsigned lo = Find(keyIndex); lo < m_num && m_tags[lo].m_keyIndex == keyIndex; lo++)
+			{
+				unsigned v = m_tags[lo].m_valueIndex;
 
-		wxString empty;
-};
+				if (v / 32 < numWords && (set[v / 32] & (1u << (v % 32))))
+				{
+					return true;
+				}
+			}
 
+			return false;
+		}
 
+	private:
+		TagIndex *m_tags;
+		unsigned m_num;
+};
 
-class TagStore
+// collects the tags of the object that is being loaded
+class TagBuffer
 {
 	public:
-	TagStore();
-	~TagStore();
-	unsigned GetNumKeys();
-	char const *GetKey(unsigned keyIndex);
-	unsigned GetNumValues(unsigned keyIndex);
-	char const *GetValue(unsigned keyIndex, unsigned valueIndex);
-	void GrowKeys(unsigned amount);
-
-	void GrowValues(unsigned  key);
-
-	TagIndex FindOrAdd(char const *key, char const *value);
-	TagIndex Find(char const *key, char const *value);
-
-	char const *GetKey(TagIndex index);
-	char const *GetValue(TagIndex index);
+		TagBuffer()
+		{
+			m_tags = NULL;
+			m_num = m_max = 0;
+		}
 
-	private:
-	bool FindKey(char const *key, unsigned *k);
-	bool FindValue(unsigned key, char const *value, unsigned *v);
+		~TagBuffer()
+		{
+			free(m_tags);
+		}
 
-	unsigned AddKey(char const *k);
-	unsigned AddValue(unsigned key, char const *value);
+		void Add(TagIndex tag)
+		{
+			if (m_num >= m_max)
+			{
+				m_max = m_max ? m_max * 2 : 64;
+				m_tags = static_cast<TagIndex *>(realloc(m_tags, m_max * sizeof(TagIndex)));
+				assert(m_tags);
+			}
 
+			m_tags[m_num++] = tag;
+		}
 
-	char **m_keys;
-	unsigned m_numKeys;
-	unsigned m_maxNumKeys;
+		void Clear()
+		{
+			m_num = 0;
+		}
 
-	char ***m_values;
-	unsigned *m_numValues;
-	unsigned *m_maxNumValues;
+		TagIndex *m_tags;
+		unsigned m_num;
 
-	StringToIndexMapper **m_valueMappers;
-	StringToIndexMapper m_keyMapper;
+	private:
+		unsigned m_max;
 };
 
-class OsmTag
-	: public ListObject
+// the node or way refs of all objects, one range per object, in document order. they are only
+// needed until the objects are resolved
+class RefPool
 {
 	public:
-	OsmTag(char const *key, char const *value = NULL, OsmTag *next = NULL);
-	OsmTag(bool noCreate, char const *key, char const *value = NULL, OsmTag *next = NULL);
-	OsmTag(OsmTag const &other);
-	~OsmTag();
-
-
-	static bool KeyExists(char const *key);
-
-	bool Valid()
-	{
-		return m_index.Valid();
-	}
+		RefPool()
+		{
+			m_ids = NULL;
+			m_num = m_max = 0;
+		}
 
-	TagIndex Index() { return m_index; }
+		~RefPool()
+		{
+			free(m_ids);
+		}
 
-	char const *GetKey()
-	{
-		return m_tagStore->GetKey(m_index);
-	}
+		void Add(OsmId id)
+		{
+			if (m_num >= m_max)
+			{
+				m_max = m_max + m_max / 2 + 64 * 1024;
+				m_ids = static_cast<OsmId *>(realloc(m_ids, m_max * sizeof(OsmId)));
+				assert(m_ids);
+			}
 
-	char const *GetValue()
-	{
-		return m_tagStore->GetValue(m_index);
-	}
+			m_ids[m_num++] = id;
+		}
 
-	bool HasTag(OsmTag const &other)
-	{
-		if (m_index == other.m_index)
+		size_t GetCount()
 		{
-			return true;
+			return m_num;
 		}
-		if (!m_next)
-			return false;
 
-		return static_cast<OsmTag *>(m_next)->HasTag(other);
+		void Free()
+		{
+			free(m_ids);
+			m_ids = NULL;
+			m_num = m_max = 0;
+		}
 
-	}
+		OsmId *m_ids;
 
-	static TagStore *m_tagStore;
-	TagIndex m_index;
-	
+	private:
+		size_t m_num, m_max;
 };
 
 class IdObject
 	: public ListObject
 {
 	public:
-		IdObject(unsigned id = 0, IdObject *next = NULL)
+		IdObject(OsmId id = 0, IdObject *next = NULL)
 			: ListObject(next)
 		{
 			m_id = id;
 		}
 			
-		unsigned m_id;
+		OsmId m_id;
 };
 
-WX_DECLARE_HASH_SET(unsigned, wxIntegerHash, wxIntegerEqual, WXIdSet);
-
-class IdSet
+class IdObjectStore
 {
 	public:
-		void Add(unsigned id)
+		// the index type can be chosen per store. expectedSize is only a hint to presize the index
+		IdObjectStore(IdIndex::TYPE indexType, unsigned expectedSize = 0);
+		~IdObjectStore();
+
+		void GetStatistics(double *avgLen, double *standardDeviation, int *maxlen)
 		{
-			m_set.insert(id);
+			m_index->GetStatistics(avgLen, standardDeviation, maxlen);
 		}
 
-		bool Has(unsigned id)
+		// make room for this many objects, without having to grow while loading
+		void Reserve(unsigned size);
+
+		// called when all objects are added. lets the index compact itself
+		void Finish()
 		{
-			return m_set.find(id) != m_set.end();
+			m_index->Finish();
 		}
 
-	private:
-		WXIdSet m_set;
-};
+		unsigned GetCount()
+		{
+			return m_count;
+		}
 
-class IdObjectStore
-{
-	private:
-		class ObjectList
+		size_t GetIndexMemoryUsage()
 		{
-			public:
-			ObjectList(IdObject *object, ObjectList *tail)
-			{
-				m_next = tail;
-				m_object = object;
-				m_listSize = tail ? tail->m_listSize + 1 : 1;
-			}
+			return m_index->GetMemoryUsage() + m_capacity * sizeof(IdObject *);
+		}
 
-			~ObjectList()
-			{
-				if (m_next)
-					delete m_next;
-					
-				delete m_object;
-			}
-			unsigned m_listSize;
-			ObjectList *m_next;
-			IdObject *m_object;
-		};
-	public:
-		IdObjectStore(unsigned bitmaskSize);
-		~IdObjectStore();
+		IdObject *m_content;
 
-		void GetStatistics(double *avgLen, double *standardDeviation, int *maxlen)
+		void AddObject(IdObject *object);
+		IdObject *GetObject(OsmId id)
 		{
-			unsigned long long s1 = 0, s2 = 0;
-			*maxlen = 0;
-			int c;
-			for (int i = 0; i < m_size; i++)
-			{
-				c = m_locator[i] ? m_locator[i]->m_listSize : 0;
-				s1 += c;
-				s2 += c * c;
-				if (c > *maxlen)
-				{
-					*maxlen = c;
-				}
-			}
+			unsigned slot = m_index->Find(id);
 
-			*avgLen = static_cast<double>(s1) / m_size;
-			*standardDeviation = sqrt(static_cast<double>(s2 * m_size - s1 * s1))/ m_size;
+			return slot == IdIndex::NotFound() ? NULL : m_objects[slot];
 		}
 
-		ObjectList **m_locator;
-		IdObject *m_content;
-		int m_size;
-		unsigned m_mask;
+		// returns IdIndex::NotFound() if there is no object with this id
+		unsigned GetSlot(OsmId id)
+		{
+			return m_index->Find(id);
+		}
 
-		void AddObject(IdObject *object);
-		IdObject *GetObject(unsigned id);
+		// objects are numbered in the order they were added
+		IdObject *GetBySlot(unsigned slot)
+		{
+			assert(slot < m_count);
+			return m_objects[slot];
+		}
+
+	private:
+		IdIndex *m_index;
+		// all objects in the order they were added. the position is the slot the index points to
+		IdObject **m_objects;
+		unsigned m_count;
+		unsigned m_capacity;
 };
 
 
@@ -526,153 +620,302 @@ class IdObjectWithTags
 	: public IdObject
 {
 	public:
-		IdObjectWithTags(unsigned id = 0, IdObjectWithTags *next = NULL)
+		IdObjectWithTags(OsmId id = 0, IdObjectWithTags *next = NULL)
 			: IdObject(id, next)
 		{
-			m_tags = NULL;
-		}
-		
-		~IdObjectWithTags()
-		{
-			if (m_tags)
-			{
-				m_tags->DestroyList();
-			}
+			m_ruleCache = 0;
 		}
 
-		void AddTag(char const *key, char const *value)
+		// the tags are copied to arena, which should live as long as this object
+		void SetTags(Arena *arena, TagIndex const *tags, unsigned num)
 		{
-			m_tags = new OsmTag(key, value, m_tags);
+			m_tags.Set(arena, tags, num);
 		}
 
 		bool HasTag(OsmTag const &tag)
 		{
-			return m_tags ? m_tags->HasTag(tag) : false;
+			return m_tags.Has(tag.m_index);
 		}
 
 		bool HasTag(char const *key, char const *value = NULL)
 		{
 			OsmTag t(key, value);
-			return m_tags ? m_tags->HasTag(t) : false;
+			return m_tags.Has(t.m_index);
 		}
 
 
-		OsmTag *m_tags;
+		TagList m_tags;
+
+		// what the rules made of this object, as set by RuleSet. 0 if they haven't been evaluated.
+		// only used with atomic loads and stores, several threads use it at once
+		wxUint32 m_ruleCache;
 };
 
 #define LONLATRESOLUTION 0x7FFFFFFF
 
 class OsmRelationList;
 
-class OsmNode
-	: public IdObjectWithTags
+#define NODE_INVALID 0xFFFFFFFF
+
+WX_DECLARE_HASH_MAP(unsigned, TagList, wxIntegerHash, wxIntegerEqual, NodeTagMapper);
+
+// all nodes, stored as columns. nodes are referred to by their index in the store.
+// the id column is normally ascending (osm files are sorted), then it doubles as the index for
+// looking up nodes by id. only when ids arrive out of order a separate index is built.
+// most nodes have no tags, so tags live in a separate table that only holds the tagged nodes
+class NodeStore
 {
 	public:
+		NodeStore();
+		~NodeStore();
 
-	OsmNode(unsigned id, double lat, double lon, OsmNode *next = NULL)
-		: IdObjectWithTags(id, next)
-	{
-		if (lon > 180.0)
-			lon -= 360.0;
-		if (lon < -180.0)
-			lon += 360.0;
+		// returns the index of the new node
+		unsigned Add(OsmId id, double lat, double lon)
+		{
+			return AddFixed(id, LatToFixed(lat), LonToFixed(lon));
+		}
 
-		m_ilat = (wxInt32)((lat/90.0) * LONLATRESOLUTION);
-		m_ilon = (wxInt32)((lon/180.0) * LONLATRESOLUTION);
-	}
+		unsigned AddFixed(OsmId id, wxInt32 ilat, wxInt32 ilon);
 
+		// use external (e.g. memory mapped) columns in place, instead of copying them.
+		// they must stay valid for the lifetime of the store, and no nodes can be added afterwards
+		void Adopt(unsigned count, OsmId const *ids, wxInt32 const *ilat, wxInt32 const *ilon);
 
-	double Lon()
-	{
-		double r = (double)m_ilon/LONLATRESOLUTION;
-		 r *= 180.0;
-		 return r;
-	}
+		// returns NODE_INVALID if there is no node with this id
+		unsigned Find(OsmId id);
 
-	double Lat()
-	{
-		double r = (double)m_ilat/LONLATRESOLUTION;
-		 r *= 90.0;
-		 return r;
-	}
+		void Reserve(unsigned size);
+
+		// called when loading is finished
+		void Finish();
+
+		void GetStatistics(double *avgLen, double *standardDeviation, int *maxLen);
+
+		unsigned GetCount()
+		{
+			return m_count;
+		}
+
+		// true if the id column is ascending, so it can be searched or joined against directly
+		bool IsSorted()
+		{
+			return m_sorted;
+		}
 
+		OsmId GetId(unsigned index)
+		{
+			assert(index < m_count);
+			return m_ids[index];
+		}
+
+		double Lon(unsigned index)
+		{
+			assert(index < m_count);
+			return LonFromFixed(m_ilon[index]);
+		}
+
+		double Lat(unsigned index)
+		{
+			assert(index < m_count);
+			return LatFromFixed(m_ilat[index]);
+		}
+
+		void SetTags(unsigned index, TagIndex const *tags, unsigned num)
+		{
+			if (num)
+			{
+				m_tags[index].Set(&m_tagArena, tags, num);
+			}
+		}
+
+		// returns NULL for nodes without tags
+		TagList const *GetTags(unsigned index)
+		{
+			NodeTagMapper::iterator f = m_tags.find(index);
+
+			return f == m_tags.end() ? NULL : &(f->second);
+		}
+
+		// the indices of all nodes that have tags, in ascending order. delete [] the result when done
+		unsigned *GetTaggedNodes(unsigned *num);
+
+		static double LonFromFixed(wxInt32 ilon)
+		{
+			double r = (double)ilon/LONLATRESOLUTION;
+			 r *= 180.0;
+			 return r;
+		}
+
+		static double LatFromFixed(wxInt32 ilat)
+		{
+			double r = (double)ilat/LONLATRESOLUTION;
+			 r *= 90.0;
+			 return r;
+		}
+
+		static wxInt32 LonToFixed(double lon)
+		{
+			if (lon > 180.0)
+				lon -= 360.0;
+			if (lon < -180.0)
+				lon += 360.0;
+
+			return (wxInt32)((lon/180.0) * LONLATRESOLUTION);
+		}
+
+		static wxInt32 LatToFixed(double lat)
+		{
+			return (wxInt32)((lat/90.0) * LONLATRESOLUTION);
+		}
+
+		// the columns. read only, use Add() to add nodes
+		OsmId const *m_ids;
+		wxInt32 const *m_ilat;
+		wxInt32 const *m_ilon;
+
+	private:
+		void FreeColumns();
+		void Resize(unsigned size);
+
+		// the writable columns, if we own them. same memory as the const pointers above
+		OsmId *m_ownIds;
+		wxInt32 *m_ownLat;
+		wxInt32 *m_ownLon;
 
-	wxInt32 m_ilat;
-	wxInt32 m_ilon;
+		unsigned m_count;
+		unsigned m_capacity;
 
+		bool m_sorted;
+		// only used when the ids were not added in ascending order
+		IdIndex *m_index;
+
+		NodeTagMapper m_tags;
+		Arena m_tagArena;
 };
 
+// ways keep simplified copies of their geometry for drawing zoomed out. band i is simplified with a
+// tolerance of LODTOLERANCE * 4^i degrees (latitude, longitude is scaled to match)
+#define NUMLODBANDS 5
+#define LODTOLERANCE 0.0001
 
 class OsmWay
 	: public IdObjectWithTags
 {
 	public:
 
-	OsmWay(unsigned id, OsmWay *next = NULL)
+	OsmWay(OsmId id, OsmWay *next = NULL)
 		: IdObjectWithTags(id, next)
 	{
-		m_nodeRefs = NULL;
+		m_firstNodeRef = 0;
+		m_numNodeRefs = 0;
 		m_resolvedNodes = NULL;
 		m_numResolvedNodes = 0;
+		m_lodNodes = NULL;
+		for (int i = 0; i < NUMLODBANDS; i++)
+		{
+			m_numLodNodes[i] = 0;
+		}
 		m_relations = NULL;
 	}
 
 	~OsmWay()
 	{
-		if (m_nodeRefs)
-		{
-			m_nodeRefs->DestroyList();
-		}
-
 		if (m_resolvedNodes)
 		{
 			delete [] m_resolvedNodes;
 		}
+
+		delete [] m_lodNodes;
 	}
 
-	DRect GetBB()
+	// computed on the first call, the nodes don't move once they are resolved
+	DRect const &GetBB(NodeStore *nodes)
 	{
-		DRect m_bb;
-		if (m_bb.m_w < 0)
+		if (m_bb.IsEmpty())
 		{
 			for (unsigned i = 0; i < m_numResolvedNodes; i++)
 			{
-				if (m_resolvedNodes[i])
+				if (m_resolvedNodes[i] != NODE_INVALID)
 				{
-					m_bb.Include(m_resolvedNodes[i]->Lon(), m_resolvedNodes[i]->Lat());
+					m_bb.Include(nodes->Lon(m_resolvedNodes[i]), nodes->Lat(m_resolvedNodes[i]));
 				}
 			}
 		}
 		return m_bb;
 	}
 
+	// for when the bounding box is already known (e.g. from the cache file)
+	void SetBB(DRect const &bb)
+	{
+		m_bb = bb;
+	}
 
-	OsmNode *GetClosestNode(double lon, double lat, double *foundDistSquared);
 
+	// returns NODE_INVALID if the way has no nodes
+	unsigned GetClosestNode(NodeStore *nodes, double lon, double lat, double *foundDistSquared);
 
-	bool ContainsNode(OsmNode const *node) const
+
+	bool ContainsNode(unsigned node) const
 	{
 		for (unsigned i = 0; i < m_numResolvedNodes; i++)
 		{
-			if (m_resolvedNodes[i] && (m_resolvedNodes[i]->m_id == node->m_id))
+			if (m_resolvedNodes[i] == node)
 				return true;
 		}
 
 		return false;
 	}
 
-	void AddNodeRef(unsigned id)
+	// the node refs, as a range in the node ref pool of the OsmData. only used until OsmData::Resolve()
+	size_t m_firstNodeRef;
+	unsigned m_numNodeRefs;
+
+	// takes the node indices for our range from the resolved node ref pool
+	void Resolve(unsigned const *resolvedRefs);
+	// these are only valid after calling resolve. indices in the node store, NODE_INVALID for nodes that
+	// couldn't be resolved
+	unsigned *m_resolvedNodes;
+	unsigned m_numResolvedNodes;
+	// see GetBB()
+	DRect m_bb;
+
+	// (re)builds the simplified geometry from the resolved nodes
+	void BuildLod(NodeStore *nodes);
+
+	// the nodes to draw at a level of detail. band -1 is the full geometry
+	unsigned GetLodNodes(int band, unsigned const **nodes)
+	{
+		if (band < 0)
+		{
+			*nodes = m_resolvedNodes;
+			return m_numResolvedNodes;
+		}
+
+		unsigned first = 0;
+		for (int i = 0; i < band; i++)
+		{
+			first += m_numLodNodes[i];
+		}
+
+		*nodes = m_lodNodes + first;
+		return m_numLodNodes[band];
+	}
+
+	// the coarsest band that is still accurate to pixelSize (in degrees latitude), -1 if none is
+	static int GetLodBand(double pixelSize);
+
+	static double GetLodTolerance(int band)
 	{
-		m_nodeRefs = new IdObject(id, m_nodeRefs);
+		return LODTOLERANCE * (1 << (2 * band));
 	}
 
-	IdObject *m_nodeRefs;
+	// true if bb is smaller than tolerance in both directions. such ways are left out of a band
+	static bool IsBelowTolerance(DRect const &bb, double tolerance);
 
-	void Resolve(IdObjectStore *store);
-	// these are only valid after calling resolve
-	OsmNode **m_resolvedNodes;
-	unsigned m_numResolvedNodes;
-//	DRect m_bb;
+	// the bands follow each other, band i has m_numLodNodes[i] nodes. NODE_INVALID splits a
+	// line like in m_resolvedNodes
+	unsigned *m_lodNodes;
+	unsigned m_numLodNodes[NUMLODBANDS];
 
 	// gets filled by OsmRelation::Resolve, so will be empty until the relations are resolved
 	OsmRelationList *m_relations;
@@ -683,23 +926,24 @@ class OsmRelation
 	: public OsmWay
 {
 	public:
-	OsmRelation(unsigned id, OsmRelation *next = NULL)
+	OsmRelation(OsmId id, OsmRelation *next = NULL)
 		: OsmWay(id, next)
 	{
-		m_wayRefs = NULL;
+		m_firstWayRef = 0;
+		m_numWayRefs = 0;
 		m_resolvedWays = NULL;
 		m_numResolvedWays = 0;
 	}
 
 
-	DRect GetBB()
+	DRect GetBB(NodeStore *nodes)
 	{
-		DRect ret = OsmWay::GetBB();
+		DRect ret = OsmWay::GetBB(nodes);
 		for (unsigned i = 0; i < m_numResolvedWays; i++)
 		{
 			if (m_resolvedWays[i])
 			{
-				ret.Add(m_resolvedWays[i]->GetBB());
+				ret.Add(m_resolvedWays[i]->GetBB(nodes));
 			}
 		}
 		return ret;
@@ -707,24 +951,18 @@ class OsmRelation
 	
 	~OsmRelation()
 	{
-		if (m_wayRefs)
-		{
-			m_wayRefs->DestroyList();
-		}
-
 		if (m_resolvedWays)
 		{
 			delete [] m_resolvedWays;
 		}
 	}
 	
-	IdObject *m_wayRefs;
-	void AddWayRef(unsigned id)
-	{
-		m_wayRefs = new IdObject(id, m_wayRefs);
-	}
-	
-	void Resolve(IdObjectStore *nodeStore, IdObjectStore *wayStore);
+	// a range in the way ref pool of the OsmData, like the node refs
+	size_t m_firstWayRef;
+	unsigned m_numWayRefs;
+
+	// the relation lists of the ways are allocated in arena. returns the number of ways that were not found
+	unsigned Resolve(unsigned const *resolvedNodeRefs, IdObjectStore *wayStore, RefPool const *wayRefs, Arena *arena);
 
 	OsmWay **m_resolvedWays;
 	unsigned m_numResolvedWays;
@@ -748,28 +986,42 @@ class OsmRelationList
 class OsmData
 {
 	public:
-	OsmData();
+	// osm files are sorted by id, so the compact sorted index is the default for the big stores
+	OsmData(IdIndex::TYPE wayIndex = IdIndex::IDX_SORTED, IdIndex::TYPE relationIndex = IdIndex::IDX_HASH);
 
-	IdObjectStore m_nodes;
+	// presize the stores when the (approximate) number of objects is known up front
+	void Reserve(unsigned numNodes, unsigned numWays, unsigned numRelations);
+
+	NodeStore m_nodes;
 	IdObjectStore m_ways;
 	IdObjectStore m_relations;
+
+	// the tags and relation lists of the ways and relations
+	Arena m_arena;
+	// the node and way refs, until they are resolved
+	RefPool m_nodeRefs;
+	RefPool m_wayRefs;
+	// the tags of the object being parsed. they are stored when the object ends
+	TagBuffer m_pendingTags;
 	
 
 	// bounding box;
 	double m_minlat, m_maxlat, m_minlon, m_maxlon;
 
 	// parsing stuff
-	void StartNode(unsigned id, double lat, double lon);
+	void StartNode(OsmId id, double lat, double lon);
 	void EndNode();
-	void StartWay(unsigned id);
+	void StartWay(OsmId id);
 	void EndWay();
-	void StartRelation(unsigned id);
+	void StartRelation(OsmId id);
 	void EndRelation();
 
-	void AddNodeRef(unsigned id);
-	void AddWayRef(unsigned id);
+	void AddNodeRef(OsmId id);
+	void AddWayRef(OsmId id);
 
 	void AddTag(char const *k, char const *v);
+	// for tags that are already interned in the tagstore
+	void AddTag(TagIndex tag);
 	void AddAttribute(char const *k, char const *v);
 
 	typedef enum
@@ -782,6 +1034,7 @@ class OsmData
 
 	PARSINGSTATE m_parsingState;
 
+	// looks up all node and way refs at once. call this after the last element has been added
 	void Resolve();
 	unsigned m_elementCount;
 
@@ -3,10 +3,13 @@
 // osmbrowser is licenced under the gpl v3
 #include "osmcanvas.h"
 #include "parse.h"
+#include "cache.h"
 #include "rulecontrol.h"
 #include "tiledrawer.h"
 #include "info.h"
 #include "frame.h"
+#include <wx/config.h>
+#include <sys/stat.h>
 
 BEGIN_EVENT_TABLE(OsmCanvas, Canvas)
 	EVT_MOUSEWHEEL(OsmCanvas::OnMouseWheel)
@@ -20,6 +23,20 @@ BEGIN_EVENT_TABLE(OsmCanvas, Canvas)
 	EVT_TIMER(-1, OsmCanvas::OnTimer)
 END_EVENT_TABLE()
 
+// changes whenever the file is rewritten, 0 if it doesn't exist
+static wxUint32 FileStamp(wxString const &fileName)
+{
+	struct stat st;
+
+	if (stat(fileName.mb_str(wxConvUTF8), &st))
+	{
+		return 0;
+	}
+
+	wxUint64 h = (static_cast<wxUint64>(st.st_size) * 2654435761u) ^ static_cast<wxUint64>(st.st_mtime);
+
+	return static_cast<wxUint32>(h ^ (h >> 32));
+}
 
 OsmCanvas::OsmCanvas(wxApp * app, MainFrame *mainFrame, wxWindow *parent, wxString const &fileName, int numLayers)
 	: Canvas(parent)
@@ -36,7 +53,21 @@ OsmCanvas::OsmCanvas(wxApp * app, MainFrame *mainFrame, wxWindow *parent, wxStri
 	m_firstDragStep = false;
 	wxString binFile = fileName;
 	m_renderer = NULL;
-	m_renderJob = NULL;
+	m_renderJobs = NULL;
+	m_numRenderJobs = m_maxRenderJobs = 0;
+	m_numTilesRequested = 0;
+	m_renderedScaleCorrection = 1;
+	m_style = 0;
+	m_drawRule = NULL;
+	m_colorRules = NULL;
+
+	// name the cache after the data, not after the compression (parse_osm reads those directly) or
+	// the pbf format, so mapfile.osm.pbf gets mapfile.osm.cache
+	if (!binFile.EndsWith(wxT(".gz"), &binFile) && !binFile.EndsWith(wxT(".bz2"), &binFile)
+		&& !binFile.EndsWith(wxT(".zst"), &binFile))
+	{
+		binFile.EndsWith(wxT(".pbf"), &binFile);
+	}
 
 	binFile.Append(wxT(".cache"));
 
@@ -46,12 +77,39 @@ OsmCanvas::OsmCanvas(wxApp * app, MainFrame *mainFrame, wxWindow *parent, wxStri
 		binFile = wxString(wxT("stdin.cache"));
 	}
 
-	infile = fopen(binFile.mb_str(wxConvUTF8), "r");
-	
-	if (infile)
+	m_data = NULL;
+	m_cache = MappedCache::Open(binFile.mb_str(wxConvUTF8));
+	// the file the data is read from, or the cache that was written from it
+	wxString dataFile = binFile;
+
+	if (m_cache)
 	{
 		printf("found preprocessed file %s, opening that instead.\n", (char const *)(binFile.mb_str(wxConvUTF8)) );
+	}
+	else if (fileName.EndsWith(wxT(".cache")))
+	{
+		m_cache = MappedCache::Open(fileName.mb_str(wxConvUTF8));
+		dataFile = fileName;
+	}
+
+	if (m_cache)
+	{
+		m_data = m_cache->Load();
+	}
+	else if (fileName.EndsWith(wxT(".cache")))
+	{
+		// an old style cache
+		infile = fopen(fileName.mb_str(wxConvUTF8), "r");
+
+		if (!infile)
+		{
+			puts("could not open file:");
+			puts(fileName.mb_str(wxConvUTF8));
+			abort();
+		}
+
 		m_data = parse_binary(infile, true);
+		fclose(infile);
 	}
 	else
 	{
@@ -71,38 +129,69 @@ OsmCanvas::OsmCanvas(wxApp * app, MainFrame *mainFrame, wxWindow *parent, wxStri
 			abort();
 		}
 	
-		if (fileName.EndsWith(wxT(".cache")))
+		if (fileName.EndsWith(wxT(".pbf")))
 		{
-			m_data = parse_binary(infile, true);
+			m_data = parse_pbf(infile, true);
 		}
 		else
 		{
 			m_data = parse_osm(infile, true);
-	
-			FILE *outFile = fopen(binFile.mb_str(wxConvUTF8) , "wb");
-	
-			if (outFile)
-			{
-			
-				printf("writing cache\n");
-				write_binary(m_data, outFile);
-				fclose(outFile);
-			}
+		}
+		fclose(infile);
+
+		FILE *outFile = fopen(binFile.mb_str(wxConvUTF8) , "wb");
+		dataFile = fileName;
+
+		if (outFile)
+		{
+			printf("writing cache\n");
+			write_cache(m_data, outFile);
+			fclose(outFile);
+			dataFile = binFile;
 		}
 	}
-	fclose(infile);
 
 	double xscale = 1200.0 / (m_data->m_maxlon - m_data->m_minlon);
 	double yscale = 1200.0 / (m_data->m_maxlon - m_data->m_minlon);
-	m_scale = xscale < yscale ? xscale : yscale;
+	m_zoom = static_cast<int>(floor(log(xscale < yscale ? xscale : yscale) / log(2.0) * ZOOMSTEPS));
+	m_scale = pow(2.0, static_cast<double>(m_zoom) / ZOOMSTEPS);
 	m_xOffset = m_data->m_minlon;
 	m_yOffset = m_data->m_minlat;
 
+	wxConfigBase *config = wxConfig::Get();
+	long cacheMB = config->Read(wxT("tilecache/memoryMB"), static_cast<long>(RASTERCACHEMB));
+	bool onDisk = config->Read(wxT("tilecache/onDisk"), static_cast<long>(RASTERCACHEONDISK));
+	long diskMB = config->Read(wxT("tilecache/diskMB"), static_cast<long>(RASTERCACHEDISKMB));
+	wxString tileDir = binFile;
+
+	tileDir.EndsWith(wxT(".cache"), &tileDir);
+	tileDir.Append(wxT(".tiles"));
+
+	// the tiles only have the map layers, the selection is drawn over them in the view
+	m_rasterCache = new RasterCache(static_cast<size_t>(cacheMB) << 20, NUMLAYERS, onDisk ? tileDir : wxString(wxEmptyString), static_cast<size_t>(diskMB) << 20);
+
+	// tiles on disk outlive the data, so an edit that keeps the counts must change the stamp as well
+	m_dataStamp = (m_data->m_nodes.GetCount() * 2654435761u ^ m_data->m_ways.GetCount()) * 16777619u ^ FileStamp(dataFile);
+
 	m_lastX = m_lastY = 0;
 
-	m_tileDrawer = new TileDrawer(m_data->m_minlon, m_data->m_minlat, m_data->m_maxlon, m_data->m_maxlat, .05, .04);
+	m_tileDrawer = new TileDrawer(&(m_data->m_nodes), m_data->m_minlon, m_data->m_minlat, m_data->m_maxlon, m_data->m_maxlat);
 
-	m_tileDrawer->AddWays(static_cast<OsmWay *>(m_data->m_ways.m_content));
+	if (m_cache)
+	{
+		// the cache has the bounding boxes of the ways, so we don't have to visit the nodes
+		unsigned numWays = m_cache->GetNumWays();
+		for (unsigned i = 0; i < numWays; i++)
+		{
+			DRect bb;
+			m_cache->GetWayBounds(i, &bb);
+			m_tileDrawer->AddWay(static_cast<OsmWay *>(m_data->m_ways.GetBySlot(i)), bb);
+		}
+	}
+	else
+	{
+		m_tileDrawer->AddWays(static_cast<OsmWay *>(m_data->m_ways.m_content));
+	}
 
 	m_tileDrawer->SetSelectionColor(255,100,100);
 
@@ -138,51 +227,254 @@ void OsmCanvas::Render(bool force)
 	if (m_restart)
 	{
 		m_renderer->Clear();
-		delete m_renderJob;
-		m_renderJob = NULL;
+		DeleteRenderJobs();
 		m_restart = false;
+
+		m_renderedScaleCorrection = GetScaleCorrection();
+
+		// all that decides what a tile looks like, apart from its position and zoom level
+		RuleSet rules(m_drawRule, m_colorRules);
+		m_style = (rules.GetHash() ^ m_dataStamp) * 16777619u ^ static_cast<wxUint32>(m_renderedScaleCorrection * 65536);
+
+		RequestTiles(0, 0, m_backBuffer.GetWidth(), m_backBuffer.GetHeight());
 	}
 
-	if (!m_renderJob)
+	int numLeft = 0;
+
+	for (int i = 0; i < m_numRenderJobs; i++)
 	{
-		m_renderJob = new CanvasJob(m_app, m_mainFrame, m_renderer);
+		CanvasJob *job = m_renderJobs[i];
+
+		if (m_tileDrawer->RenderTiles(job, 100))
+		{
+			int x, y;
+			Renderer *tile = job->TakeTile();
+
+			GetTilePosition(job->m_key, &x, &y);
+			m_renderer->Paste(tile, x, y);
+			m_rasterCache->Add(job->m_key, tile);
+
+			delete job;
+		}
+		else
+		{
+			m_renderJobs[numLeft++] = job;
+		}
 	}
 
-	m_done = m_tileDrawer->RenderTiles(m_renderJob, 100);
+	m_numRenderJobs = numLeft;
+	m_done = !m_numRenderJobs;
 
-	m_tileDrawer->DrawOverlay(m_renderer);
+	m_tileDrawer->DrawOverlay(m_renderer, true);
 	
-	m_renderer->Commit();
-	Draw(NULL);
+	wxRect changed = m_renderer->Commit();
+	Draw(NULL, &changed);
 
 	if (m_done)
 	{
+		m_numTilesRequested = 0;
 		m_mainFrame->SetProgress(-1);
 	}
+	else
+	{
+		m_mainFrame->SetProgress(1.0 - static_cast<double>(m_numRenderJobs) / m_numTilesRequested);
+	}
 	
 	return;
 }
 
+void OsmCanvas::DeleteRenderJobs()
+{
+	for (int i = 0; i < m_numRenderJobs; i++)
+	{
+		delete m_renderJobs[i];
+	}
+
+	m_numRenderJobs = 0;
+	m_numTilesRequested = 0;
+}
+
+double OsmCanvas::GetScaleCorrection()
+{
+	return floor(cos(m_yOffset * M_PI / 180) * 1024 + 0.5) / 1024;
+}
+
+void OsmCanvas::GetTilePosition(RasterKey const &key, int *x, int *y)
+{
+	// the view origin is on a pixel, so these are whole numbers
+	double left = m_xOffset * m_scale * GetScaleCorrection();
+	double top = -m_yOffset * m_scale - m_backBuffer.GetHeight();
+
+	*x = static_cast<int>(floor(static_cast<double>(key.m_x) * RASTERTILESIZE - left + 0.5));
+	*y = static_cast<int>(floor(static_cast<double>(key.m_y) * RASTERTILESIZE - top + 0.5));
+}
+
+void OsmCanvas::RequestTiles(int x, int y, int w, int h)
+{
+	double scaleCorrection = GetScaleCorrection();
+	double left = m_xOffset * m_scale * scaleCorrection;
+	double top = -m_yOffset * m_scale - m_backBuffer.GetHeight();
+
+	int tx0 = static_cast<int>(floor((left + x) / RASTERTILESIZE));
+	int tx1 = static_cast<int>(floor((left + x + w - 1) / RASTERTILESIZE));
+	int ty0 = static_cast<int>(floor((top + y) / RASTERTILESIZE));
+	int ty1 = static_cast<int>(floor((top + y + h - 1) / RASTERTILESIZE));
+
+	for (int ty = ty0; ty <= ty1; ty++)
+	{
+		for (int tx = tx0; tx <= tx1; tx++)
+		{
+			RasterKey key(m_zoom, tx, ty, m_style);
+			bool pending = false;
+
+			for (int i = 0; i < m_numRenderJobs && !pending; i++)
+			{
+				pending = m_renderJobs[i]->m_key == key;
+			}
+
+			if (pending)
+			{
+				continue;
+			}
+
+			int px, py;
+			GetTilePosition(key, &px, &py);
+
+			Renderer *tile = m_rasterCache->Get(key, m_renderer);
+
+			if (tile)
+			{
+				m_renderer->Paste(tile, px, py);
+				continue;
+			}
+
+			tile = m_renderer->CreateOffscreen(RASTERTILESIZE, RASTERTILESIZE, NUMLAYERS);
+
+			if (!tile || m_numRenderJobs >= m_maxRenderJobs)
+			{
+				delete tile;
+				continue;
+			}
+
+			double tileW = RASTERTILESIZE / (m_scale * scaleCorrection);
+			double tileH = RASTERTILESIZE / m_scale;
+
+			// tile rows count down from the top, latitudes up from the bottom
+			tile->SetupViewport(DRect(tx * tileW, -(ty + 1) * tileH, tileW, tileH));
+
+			m_renderJobs[m_numRenderJobs++] = new CanvasJob(m_app, m_mainFrame, tile, key);
+			m_numTilesRequested++;
+		}
+	}
+}
+
+bool OsmCanvas::ScrollView(int dx, int dy)
+{
+	int w = m_backBuffer.GetWidth();
+	int h = m_backBuffer.GetHeight();
+
+	if (m_restart || !m_renderer
+		|| dx >= w || -dx >= w || dy >= h || -dy >= h
+		|| GetScaleCorrection() != m_renderedScaleCorrection)
+	{
+		return false;
+	}
+
+	if (!m_renderer->Scroll(dx, dy))
+	{
+		return false;
+	}
+
+	// forget the tiles that went out of view, so there is room for the new ones
+	int numLeft = 0;
+
+	for (int i = 0; i < m_numRenderJobs; i++)
+	{
+		int x, y;
+
+		GetTilePosition(m_renderJobs[i]->m_key, &x, &y);
+
+		if (x >= w || y >= h || x + RASTERTILESIZE <= 0 || y + RASTERTILESIZE <= 0)
+		{
+			delete m_renderJobs[i];
+			m_numTilesRequested--;
+		}
+		else
+		{
+			m_renderJobs[numLeft++] = m_renderJobs[i];
+		}
+	}
+
+	m_numRenderJobs = numLeft;
+
+	// the rows that came into view, then the columns next to the old part
+	if (dy > 0)
+	{
+		RequestTiles(0, 0, w, dy);
+	}
+	else if (dy < 0)
+	{
+		RequestTiles(0, h + dy, w, -dy);
+	}
+
+	int y = dy > 0 ? dy : 0;
+	int rows = dy > 0 ? h - dy : h + dy;
+
+	if (dx > 0)
+	{
+		RequestTiles(0, y, dx, rows);
+	}
+	else if (dx < 0)
+	{
+		RequestTiles(w + dx, y, -dx, rows);
+	}
+
+	// even if all tiles came from the cache, the view has to be shown
+	m_done = false;
+
+	return true;
+}
+
 OsmCanvas::~OsmCanvas()
 {
+	// the jobs may still have bands rendering on the tiledrawer's threads
+	DeleteRenderJobs();
+	delete [] m_renderJobs;
+	delete m_rasterCache;
 	delete m_tileDrawer;
 	delete m_renderer;
 	delete m_data;
+	delete m_cache;
 }
 
 void OsmCanvas::OnMouseWheel(wxMouseEvent &evt)
 {
-	double scaleCorrection = cos(m_yOffset * M_PI / 180);
-	double w = evt.GetWheelRotation() / 1200.0;
+	double scaleCorrection = GetScaleCorrection();
+	int rotation = evt.GetWheelRotation();
+	int delta = evt.GetWheelDelta();
 	int h = m_backBuffer.GetHeight();
 
+	if (!rotation)
+	{
+		return;
+	}
+
+	// whole zoom levels only, so the tiles can be reused
+	int steps = delta ? rotation / delta : 0;
+
+	if (!steps)
+	{
+		steps = rotation > 0 ? 1 : -1;
+	}
+
 	double xm = evt.m_x / (m_scale * scaleCorrection);
 	double ym = (h - evt.m_y) / m_scale;
 
 	m_xOffset += xm;
 	m_yOffset += ym;
 
-	m_scale = m_scale * (1.0 + w);
+	m_zoom += steps;
+	m_scale = pow(2.0, static_cast<double>(m_zoom) / ZOOMSTEPS);
 
 	xm = evt.m_x / (m_scale * scaleCorrection);
 	ym = (h - evt.m_y) / m_scale;
@@ -195,7 +487,7 @@ void OsmCanvas::OnMouseWheel(wxMouseEvent &evt)
 
 void OsmCanvas::OnMouseMove(wxMouseEvent &evt)
 {
-	double scaleCorrection = cos(m_yOffset * M_PI / 180);
+	double scaleCorrection = GetScaleCorrection();
 
 	if (m_dragging)
 	{
@@ -214,7 +506,16 @@ void OsmCanvas::OnMouseMove(wxMouseEvent &evt)
 			m_yOffset += dy;
 
 			SetupRenderer();
-			Redraw();
+
+			// only render what scrolled into view
+			if (ScrollView(idx, idy))
+			{
+				Render();
+			}
+			else
+			{
+				Redraw();
+			}
 		}
 	}
 	else
@@ -227,8 +528,8 @@ void OsmCanvas::OnMouseMove(wxMouseEvent &evt)
 			{
 				SetupRenderer();
 				m_tileDrawer->DrawOverlay(m_renderer, true);
-				m_renderer->Commit();
-				Draw();
+				wxRect changed = m_renderer->Commit();
+				Draw(NULL, &changed);
 	
 				if (m_info)
 				{
@@ -273,7 +574,7 @@ void OsmCanvas::OnLeftUp(wxMouseEvent &evt)
 		if (!m_cursorLocked)
 		{
 			m_tileDrawer->SetSelectionColor(255,100,100);
-			double scaleCorrection = cos(m_yOffset * M_PI / 180);
+			double scaleCorrection = GetScaleCorrection();
 			double lon = m_xOffset + evt.m_x / (m_scale * scaleCorrection);
 			double lat = m_yOffset + (m_backBuffer.GetHeight() - evt.m_y) / m_scale;
 			if (m_tileDrawer->SetSelection(lon, lat))
@@ -295,8 +596,8 @@ void OsmCanvas::OnLeftUp(wxMouseEvent &evt)
 		}
 		SetupRenderer();
 		m_tileDrawer->DrawOverlay(m_renderer, true);
-		m_renderer->Commit();
-		Draw();
+		wxRect changed = m_renderer->Commit();
+		Draw(NULL, &changed);
 	}
 
 }
@@ -309,6 +610,9 @@ void OsmCanvas::SetupRenderer()
 		if (static_cast<int>(m_renderer->GetWidth()) != m_backBuffer.GetWidth()
 			|| static_cast<int>(m_renderer->GetHeight()) != m_backBuffer.GetHeight())
 		{
+			// the jobs paste into the renderer
+			DeleteRenderJobs();
+			m_restart = true;
 			delete m_renderer;
 			m_renderer = NULL;
 		}
@@ -317,9 +621,18 @@ void OsmCanvas::SetupRenderer()
 	if (!m_renderer)
 	{
 		m_renderer = new CairoRenderer(&m_backBuffer, NUMLAYERS + 1);
+
+		// every tile that can be (partly) in view at the same time
+		delete [] m_renderJobs;
+		m_maxRenderJobs = (m_backBuffer.GetWidth() / RASTERTILESIZE + 2) * (m_backBuffer.GetHeight() / RASTERTILESIZE + 2);
+		m_renderJobs = new CanvasJob *[m_maxRenderJobs];
 	}
 
-	double scaleCorrection = cos(m_yOffset * M_PI / 180);
+	double scaleCorrection = GetScaleCorrection();
+
+	// keep the view on the pixel grid of the tiles
+	m_xOffset = floor(m_xOffset * m_scale * scaleCorrection + 0.5) / (m_scale * scaleCorrection);
+	m_yOffset = floor(m_yOffset * m_scale + 0.5) / m_scale;
 
 	int renderW = m_backBuffer.GetWidth();
 	int renderH = m_backBuffer.GetHeight();
@@ -331,6 +644,8 @@ void OsmCanvas::SetupRenderer()
 
 void OsmCanvas::SetRuleControls(RuleControl *rules, ColorRules *colors)
 {
+	m_drawRule = rules;
+	m_colorRules = colors;
 	m_tileDrawer->SetDrawRuleControl(rules);
 	m_tileDrawer->SetColorRules(colors);
 }
@@ -345,8 +660,8 @@ void OsmCanvas::SelectWay(OsmWay *way)
 	if (m_tileDrawer->SetSelectedWay(way))
 	{
 		m_tileDrawer->DrawOverlay(m_renderer, true);
-		m_renderer->Commit();
-		Draw();
+		wxRect changed = m_renderer->Commit();
+		Draw(NULL, &changed);
 	}
 }
 
@@ -355,7 +670,7 @@ void OsmCanvas::SaveView(wxString const &fileName, MainFrame *mainFrame)
 	int w = m_backBuffer.GetWidth();
 	int h = m_backBuffer.GetHeight();
 
-	double xScale = cos(m_yOffset * M_PI / 180) * m_scale;
+	double xScale = GetScaleCorrection() * m_scale;
 
 	Renderer *r = new CairoPdfRenderer(fileName, w*10, h*10);
 
@@ -383,16 +698,31 @@ void OsmCanvas::SaveView(wxString const &fileName, MainFrame *mainFrame)
 }
 
 
-CanvasJob::CanvasJob(wxApp *app, MainFrame *mainFrame, Renderer *r)
-	: RenderJob(r)
+CanvasJob::CanvasJob(wxApp *app, MainFrame *mainFrame, Renderer *tile, RasterKey const &key)
+	: RenderJob(tile), m_key(key)
 {
 	m_app = app;
 	m_mainFrame = mainFrame;
+	m_tile = tile;
+}
+
+CanvasJob::~CanvasJob()
+{
+	// the bands don't draw into the tile itself, so it can go before they are stopped
+	delete m_tile;
+}
+
+Renderer *CanvasJob::TakeTile()
+{
+	Renderer *ret = m_tile;
+
+	m_tile = NULL;
+
+	return ret;
 }
 
 bool CanvasJob::MustCancel(double progress)
 {
-	m_mainFrame->SetProgress(progress);
+	// the canvas shows the progress over all tiles
 	return false; //m_app->Pending();
 }
-
@@ -11,25 +11,44 @@
 #include "renderer.h"
 #include "cairorenderer.h"
 #include "tiledrawer.h"
+#include "rastercache.h"
 
 class RuleControl;
+class MappedCache;
 class ColorRules;
 class InfoTreeCtrl;
 class MainFrame;
 
+// renders one raster tile, into an off screen renderer of its own
 class CanvasJob
 	: public RenderJob
 {
 	public:
-		CanvasJob(wxApp *app, MainFrame *mainFrame, Renderer *r);
+		CanvasJob(wxApp *app, MainFrame *mainFrame, Renderer *tile, RasterKey const &key);
+		~CanvasJob();
 
 		bool MustCancel(double progress);
 
+		// the rendered tile. the caller owns it after this
+		Renderer *TakeTile();
+
+		RasterKey m_key;
+
 	private:
 		wxApp *m_app;
 		MainFrame *m_mainFrame;
+		Renderer *m_tile;
 };
 
+// tile cache defaults, the config keys tilecache/memoryMB, tilecache/onDisk and tilecache/diskMB
+// override them
+#define RASTERCACHEMB 256
+#define RASTERCACHEONDISK 0
+#define RASTERCACHEDISKMB 1024
+
+// zoom levels per doubling of the scale
+#define ZOOMSTEPS 8
+
 class OsmCanvas
 	: public Canvas
 {
@@ -66,9 +85,31 @@ class OsmCanvas
 
 		void SelectWay(OsmWay *way);
 	private:
-		CanvasJob *m_renderJob;
+		// the tiles that are being rendered. at most as many as fit in the view
+		CanvasJob **m_renderJobs;
+		int m_numRenderJobs, m_maxRenderJobs;
+		int m_numTilesRequested;
+		void DeleteRenderJobs();
+		// moves what is rendered already by dx, dy pixels, and fills the uncovered parts
+		bool ScrollView(int dx, int dy);
+		// pastes the cached tiles that cover the pixels x to x + w, y to y + h, and starts jobs for
+		// the others
+		void RequestTiles(int x, int y, int w, int h);
+		// where the tile is in the view, in pixels
+		void GetTilePosition(RasterKey const &key, int *x, int *y);
+		// the horizontal scale, rounded so it doesn't change with every pixel of vertical panning
+		double GetScaleCorrection();
 		void SetupRenderer();
+		RasterCache *m_rasterCache;
+		// the style part of the keys of the visible tiles
+		wxUint32 m_style;
+		// identifies the data, so tiles on disk from other data are not used
+		wxUint32 m_dataStamp;
+		RuleControl *m_drawRule;
+		ColorRules *m_colorRules;
 		OsmData *m_data;
+		// the cache file we loaded from, if any. kept mapped because parts of it are used in place
+		MappedCache *m_cache;
 		InfoTreeCtrl *m_info;
 		DECLARE_EVENT_TABLE();
 
@@ -78,19 +119,23 @@ class OsmCanvas
 		void OnMouseMove(wxMouseEvent &evt);
 		void OnTimer(wxTimerEvent &evt)
 		{
+			// Render() shows what it changed, so when done there is nothing to draw
 			if (m_restart || !m_done)
 			{
 				Render();
 			}
 
-			if (m_done)
-				Draw(NULL);
-
 			m_timer.Start(100, true);
 		}
 
+		// the scale is 2^(m_zoom / ZOOMSTEPS), so the tiles of a zoom level can be reused
+		int m_zoom;
 		double m_scale;
+		// the bottom left of the view. always on a pixel boundary of the tile grid
 		double m_xOffset, m_yOffset;
+		// the horizontal scale depends on the latitude, so panning up or down slowly distorts
+		// what was rendered. this is the correction the view was last fully rendered with
+		double m_renderedScaleCorrection;
 
 		int m_lastX, m_lastY;
 		bool m_dragging;
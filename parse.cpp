@@ -3,8 +3,11 @@
 // osmbrowser is licenced under the gpl v3
 #include "parse.h"
 #include "osm.h"
+#include "records.h"
+#include "inputstream.h"
 #include <expat.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
 
 // op windows heeft expat dit nodig. als het niet gedefinieerd is definieer het als niks
@@ -29,8 +32,13 @@ static XML_Char const *get_attribute(const XML_Char *name, const XML_Char **attr
 	return NULL;
 }
 
-static void ReadAttribs(OsmData *o, XML_Char const **attrs)
+static void ReadAttribs(ParsedRecords *o, XML_Char const **attrs)
 {
+	if (o->m_skipAttribs)
+	{
+		return;
+	}
+
 	XML_Char const *keys[] =
 	{
 		"user",
@@ -48,28 +56,17 @@ static void ReadAttribs(OsmData *o, XML_Char const **attrs)
 		char const *v = get_attribute(keys[i], attrs);
 
 		if (v)
-			o->AddAttribute(keys[i], v);
+		{
+			o->PutType(ParsedRecords::REC_ATTRIBUTE);
+			o->PutString(keys[i]);
+			o->PutString(v);
+		}
 	}
 }
 
 void XMLCALL start_element_handler(void *user_data, const XML_Char *name, const XML_Char **attrs)
 {
-	OsmData *o = (OsmData *)user_data;
-
-	if (!(o->m_elementCount % 1000000))
-	{
-		printf("parsed %uM elements\n", o->m_elementCount/1000000);
-
-		double a,s;
-		int m;
-		o->m_nodes.GetStatistics(&a, &s, &m);
-		printf(" statistics: a %g s %g max %d | ", a, s, m);
-		o->m_ways.GetStatistics(&a, &s, &m);
-		printf("a %g s %g max %d | ", a, s, m);
-		o->m_relations.GetStatistics(&a, &s, &m);
-		printf("a %g s %g max %d \n", a, s, m);
-		
-	}
+	ParsedRecords *o = (ParsedRecords *)user_data;
 
 	if (!strcmp(name, "node"))
 	{
@@ -78,29 +75,34 @@ void XMLCALL start_element_handler(void *user_data, const XML_Char *name, const
 		XML_Char const *idS = get_attribute("id", attrs);
 		double lat = strtod(latS, NULL);
 		double lon = strtod(lonS, NULL);
-		unsigned id = strtoul(idS, NULL, 0);
+		OsmId id = strtoull(idS, NULL, 0);
 
 		assert(latS && lonS && idS); // in case it didn't crash on the strto* functions
 
-		o->StartNode(id, lat, lon);
+		o->PutType(ParsedRecords::REC_NODE);
+		o->PutId(id);
+		o->PutDouble(lat);
+		o->PutDouble(lon);
 
 		ReadAttribs(o, attrs);
 	}
 	else if (!strcmp(name, "way"))
 	{
 		XML_Char const *idS = get_attribute("id", attrs);
-		unsigned id = strtoul(idS, NULL, 0);
+		OsmId id = strtoull(idS, NULL, 0);
 		assert(idS);
-		o->StartWay(id);
+		o->PutType(ParsedRecords::REC_WAY);
+		o->PutId(id);
 		ReadAttribs(o, attrs);
 	}
 	else if (!strcmp(name, "relation"))
 	{
 		XML_Char const *idS = get_attribute("id", attrs);
-		unsigned id = strtoul(idS, NULL, 0);
+		OsmId id = strtoull(idS, NULL, 0);
 
 		assert(idS);
-		o->StartRelation(id);
+		o->PutType(ParsedRecords::REC_RELATION);
+		o->PutId(id);
 		ReadAttribs(o, attrs);
 	}
 	else if (!strcmp(name, "tag"))
@@ -109,59 +111,217 @@ void XMLCALL start_element_handler(void *user_data, const XML_Char *name, const
 		XML_Char const *value = get_attribute("v", attrs);
 		assert(key && value);
 
-		o->AddTag(key, value);
+		o->PutType(ParsedRecords::REC_TAG);
+		o->PutString(key);
+		o->PutString(value);
 	}
 	else if (!strcmp(name, "nd"))
 	{
 		XML_Char const *idS = get_attribute("ref", attrs);
-		unsigned id = strtoul(idS, NULL, 0);
+		OsmId id = strtoull(idS, NULL, 0);
 		assert(idS);
 
-		o->AddNodeRef(id);
+		o->PutType(ParsedRecords::REC_NODEREF);
+		o->PutId(id);
 	}
 	else if (!strcmp(name, "member"))
 	{
 		XML_Char const *type = get_attribute("type", attrs);
 		XML_Char const *idS = get_attribute("ref", attrs);
-		unsigned id = strtoul(idS, NULL, 0);
+		OsmId id = strtoull(idS, NULL, 0);
 		assert(idS && type);
 
 		if (!strcmp(type, "node"))
 		{
-			o->AddNodeRef(id);
+			o->PutType(ParsedRecords::REC_NODEREF);
+			o->PutId(id);
 		}
 		else if (!strcmp(type, "way"))
 		{
-			o->AddWayRef(id);
+			o->PutType(ParsedRecords::REC_WAYREF);
+			o->PutId(id);
 		}
 	}
 }
 
 void XMLCALL end_element_handler(void *user_data, const XML_Char *name)
 {
-	OsmData *o = (OsmData *)user_data;
+	ParsedRecords *o = (ParsedRecords *)user_data;
 
 	if (!strcmp(name, "node"))
 	{
-		o->EndNode();
+		o->PutType(ParsedRecords::REC_ENDNODE);
 	}
 	else if (!strcmp(name, "way"))
 	{
-		o->EndWay();
+		o->PutType(ParsedRecords::REC_ENDWAY);
 	}
 	else if (!strcmp(name, "relation"))
 	{
-		o->EndRelation();
+		o->PutType(ParsedRecords::REC_ENDRELATION);
 	}
 }
 
+// parses one chunk of the input. every chunk except the first gets an <osm> opening tag and every
+// chunk except the last a closing tag, so each of them is a complete document for expat
+class XmlChunkJob
+	: public RecordsJob
+{
+	public:
+		// takes ownership of xml, which should be malloced
+		XmlChunkJob(char *xml, size_t len, bool first, bool last, bool skipAttribs)
+			: RecordsJob(skipAttribs)
+		{
+			m_xml = xml;
+			m_len = len;
+			m_first = first;
+			m_last = last;
+			m_error = NULL;
+			m_errorLine = 0;
+		}
 
+		~XmlChunkJob()
+		{
+			free(m_xml);
+		}
 
-OsmData *parse_osm(FILE *file, bool skipAttribs)
+		void Run()
+		{
+			static char const open[] = "<osm>";
+			static char const close[] = "</osm>";
+
+			XML_Parser xml = XML_ParserCreate(NULL);
+
+			XML_SetStartElementHandler(xml, start_element_handler);
+			XML_SetEndElementHandler(xml, end_element_handler);
+			XML_SetUserData(xml, &m_records);
+
+			bool ok = true;
+			if (!m_first)
+			{
+				ok = XML_Parse(xml, open, sizeof(open) - 1, 0) != XML_STATUS_ERROR;
+			}
+
+			if (ok)
+			{
+				ok = XML_Parse(xml, m_xml, m_len, m_last) != XML_STATUS_ERROR;
+			}
+
+			if (ok && !m_last)
+			{
+				ok = XML_Parse(xml, close, sizeof(close) - 1, 1) != XML_STATUS_ERROR;
+			}
+
+			if (!ok)
+			{
+				m_error = XML_ErrorString(XML_GetErrorCode(xml));
+				m_errorLine = XML_GetCurrentLineNumber(xml);
+			}
+
+			XML_ParserFree(xml);
+
+			// we don't need the text anymore, only the records
+			free(m_xml);
+			m_xml = NULL;
+		}
+
+		void ReportErrors()
+		{
+			if (m_error)
+			{
+				printf("xml error in chunk: %s (line %lu of the chunk)\n", m_error, m_errorLine);
+			}
+		}
+
+	private:
+		XML_LChar const *m_error;
+		unsigned long m_errorLine;
+
+		char *m_xml;
+		size_t m_len;
+		bool m_first, m_last;
+};
+
+#define BLOCKSIZE (4 * 1024 * 1024)
+
+struct InputBlock
+{
+	char m_data[BLOCKSIZE];
+	size_t m_len;
+};
+
+// reads (and decompresses) the input in big blocks, so the main thread never waits for the disk
+// or the decompressor
+class BlockReader
+	: public wxThread
 {
-	char buffer[1024];
-	int len;
+	public:
+		BlockReader(InputStream *input, BoundedQueue<InputBlock *> *queue)
+			: wxThread(wxTHREAD_JOINABLE)
+		{
+			m_input = input;
+			m_queue = queue;
+		}
+
+	protected:
+		ExitCode Entry()
+		{
+			for (;;)
+			{
+				InputBlock *b = new InputBlock;
+				b->m_len = m_input->Read(b->m_data, BLOCKSIZE);
+
+				if (!b->m_len)
+				{
+					delete b;
+					break;
+				}
+
+				m_queue->Push(b);
+			}
+
+			m_queue->Close();
+			return 0;
+		}
+
+	private:
+		InputStream *m_input;
+		BoundedQueue<InputBlock *> *m_queue;
+};
+
+static bool IsElementStart(char const *s, size_t len, char const *name)
+{
+	size_t n = strlen(name);
+
+	return len > n && !memcmp(s, name, n) && (isspace(static_cast<unsigned char>(s[n])) || s[n] == '>' || s[n] == '/');
+}
+
+// returns the position of the last <node, <way or <relation in data, or 0 if there is none.
+// these only appear at the top level, and a < can't appear unescaped in attribute values, so
+// everything before that position is a sequence of complete elements
+static size_t FindLastElementStart(char const *data, size_t len)
+{
+	for (size_t i = len; i-- > 0;)
+	{
+		if (data[i] == '<')
+		{
+			char const *s = data + i + 1;
+			size_t left = len - i - 1;
 
+			if (IsElementStart(s, left, "node") || IsElementStart(s, left, "way") || IsElementStart(s, left, "relation"))
+			{
+				return i;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// the input is read in big blocks on a separate thread, split into chunks at element boundaries,
+// and the chunks are parsed on a pool of worker threads. the main thread merges the results in order
+OsmData *parse_osm(FILE *file, bool skipAttribs)
+{
 	// cannot handle 16bit character sets
 	// so if expat is configured wrong bail out
 	assert(sizeof(XML_Char) == sizeof(char));
@@ -170,24 +330,75 @@ OsmData *parse_osm(FILE *file, bool skipAttribs)
 
 	ret->m_skipAttribs = skipAttribs;
 
-	XML_Parser xml = XML_ParserCreate(NULL);
+	InputStream *input = InputStream::Open(file);
+
+	if (!input)
+	{
+		abort();
+	}
 
-	XML_SetStartElementHandler(xml, start_element_handler);
-	XML_SetEndElementHandler(xml, end_element_handler);
+	ReserveForInput(ret, file, 200 / input->GetExpansion());
 
-	XML_SetUserData(xml, ret);
-	
+	// the main thread is busy merging. the reader mostly waits for the disk, unless it has to decompress
+	int numWorkers = wxThread::GetCPUCount() - (input->GetExpansion() > 1 ? 2 : 1);
+	WorkerPool pool(numWorkers > 1 ? numWorkers : 1);
+	OrderedMerge pending(&pool, ret, 2 * pool.GetNumThreads() + 2);
 
-	unsigned count = 0;
-	while (0 != (len = fread(buffer, 1, 1024, file)))
+	BoundedQueue<InputBlock *> blocks(4);
+	BlockReader reader(input, &blocks);
+	if (reader.Create() != wxTHREAD_NO_ERROR || reader.Run() != wxTHREAD_NO_ERROR)
 	{
-		XML_Parse(xml, buffer, len, feof(file));
-		count++;
-		if (!(count % 10240))
-			printf("parsed %uMB\n", count / 1024);
+		printf("could not start the reader thread\n");
+		abort();
 	}
 
-	XML_ParserFree(xml);
+	// the part of the input that hasn't been handed to a worker yet
+	char *rest = NULL;
+	size_t restLen = 0;
+	bool first = true;
+
+	unsigned long long bytesRead = 0, nextReport = 0;
+	InputBlock *b;
+	while (blocks.Pop(&b))
+	{
+		rest = static_cast<char *>(realloc(rest, restLen + b->m_len));
+		assert(rest);
+		memcpy(rest + restLen, b->m_data, b->m_len);
+		restLen += b->m_len;
+
+		bytesRead += b->m_len;
+		delete b;
+
+		if (bytesRead >= nextReport)
+		{
+			printf("read %lluMB\n", bytesRead / (1024 * 1024));
+			nextReport += 16 * BLOCKSIZE;
+		}
+
+		size_t split = FindLastElementStart(rest, restLen);
+
+		if (!split)
+		{
+			// no complete element yet, wait for more
+			continue;
+		}
+
+		char *next = static_cast<char *>(malloc(restLen - split));
+		assert(next);
+		memcpy(next, rest + split, restLen - split);
+
+		pending.Add(new XmlChunkJob(rest, split, first, false, skipAttribs));
+
+		rest = next;
+		restLen -= split;
+		first = false;
+	}
+
+	reader.Wait();
+	delete input;
+
+	pending.Add(new XmlChunkJob(rest, restLen, first, true, skipAttribs));
+	pending.MergeAll();
 
 	ret->Resolve();
 
@@ -329,6 +540,9 @@ OsmData *parse_binary(FILE *f, bool skipAttribs)
 
 
 	ret->m_skipAttribs = skipAttribs;
+
+	ReserveForInput(ret, f, 40);
+
 	unsigned count = 0;
 	while (!feof(f))
 	{
@@ -369,140 +583,3 @@ OsmData *parse_binary(FILE *f, bool skipAttribs)
 
 	return ret;
 }
-
-static void WriteTags(OsmTag *tags, FILE *f)
-{
-	unsigned zero = 0;
-
-	if (!tags)
-	{
-		fwrite(&zero, sizeof(zero), 1, f);
-		return;
-	}
-
-	unsigned size = tags->GetSize();
-
-	fwrite(&(size), sizeof(size), 1, f);
-
-	for (OsmTag *t = tags; t; t = static_cast<OsmTag *>(t->m_next))
-	{
-		fwrite(t->GetKey(), sizeof(char), strlen(t->GetKey()) + 1, f);
-		fwrite(t->GetValue(), sizeof(char), strlen(t->GetValue()) + 1, f);
-	}
-	
-}
-
-void write_binary(OsmData *d, FILE *f)
-{
-	unsigned zero = 0;
-	printf("writing nodes...\n" );
-	for (OsmNode *n = static_cast<OsmNode *>(d->m_nodes.m_content); n ; n = static_cast<OsmNode *>(n->m_next))
-	{
-		fputc('N', f);
-		double lat = n->Lat();
-		double lon = n->Lon();
-		fwrite(&(n->m_id), sizeof(n->m_id), 1, f);
-		fwrite(&(lat), sizeof(double), 1, f);
-		fwrite(&(lon), sizeof(double), 1, f);
-
-		WriteTags(n->m_tags, f);
-	}
-
-	printf("writing ways...\n" );
-	for (OsmWay *w = static_cast<OsmWay *>(d->m_ways.m_content); w; w = static_cast<OsmWay *>(w->m_next))
-	{
-		fputc('W', f);
-		fwrite(&(w->m_id), sizeof(w->m_id), 1, f);
-
-		if (w->m_nodeRefs) // if the noderefs still exists, this means the way is not fully resolved, so use the refs
-		{
-			unsigned size = w->m_nodeRefs->GetSize();
-			fwrite(&(size), sizeof(size), 1, f);
-
-			for (IdObject *i = w->m_nodeRefs; i; i = static_cast<IdObject *>(i->m_next))
-			{
-				fwrite(&(i->m_id), sizeof(i->m_id), 1, f);
-			}
-			
-		}
-		else if (w->m_resolvedNodes) // the refs don't exists, so the way must be fully resolved
-		{
-			fwrite(&(w->m_numResolvedNodes), sizeof(w->m_numResolvedNodes), 1, f);
-
-			for (unsigned  i = 0; i < w->m_numResolvedNodes; i++)
-			{
-				unsigned id = w->m_resolvedNodes[i]->m_id;
-				fwrite(&(id), sizeof(id), 1, f);
-			}
-		}
-		else
-		{
-			fwrite(&zero, sizeof(zero), 1, f);
-		}
-
-		WriteTags(w->m_tags, f);
-	}
-
-
-	printf("writing relations...\n" );
-	for (OsmRelation *r = static_cast<OsmRelation *>(d->m_relations.m_content); r; r = static_cast<OsmRelation *>(r->m_next))
-	{
-		fputc('R', f);
-		fwrite(&(r->m_id), sizeof(r->m_id), 1, f);
-
-		if (r->m_nodeRefs)
-		{
-			unsigned size = r->m_nodeRefs->GetSize();
-			fwrite(&(size), sizeof(size), 1, f);
-
-			for (IdObject *i = r->m_nodeRefs; i; i = static_cast<IdObject *>(i->m_next))
-			{
-				fwrite(&(i->m_id), sizeof(i->m_id), 1, f);
-			}
-			
-		}
-		else if (r->m_resolvedNodes) // the refs don't exists, so the way must be fully resolved
-		{
-			fwrite(&(r->m_numResolvedNodes), sizeof(r->m_numResolvedNodes), 1, f);
-
-			for (unsigned  i = 0; i < r->m_numResolvedNodes; i++)
-			{
-				unsigned id = r->m_resolvedNodes[i]->m_id;
-				fwrite(&(id), sizeof(id), 1, f);
-			}
-		}
-		else
-		{
-			fwrite(&zero, sizeof(zero), 1, f);
-		}
-
-		if (r->m_wayRefs)
-		{
-			unsigned size = r->m_wayRefs->GetSize();
-			fwrite(&(size), sizeof(size), 1, f);
-
-			for (IdObject *i = r->m_wayRefs; i; i = static_cast<IdObject *>(i->m_next))
-			{
-				fwrite(&(i->m_id), sizeof(i->m_id), 1, f);
-			}
-			
-		}
-		else if (r->m_resolvedWays) // the refs don't exists, so the way must be fully resolved
-		{
-			fwrite(&(r->m_numResolvedWays), sizeof(r->m_numResolvedWays), 1, f);
-
-			for (unsigned  i = 0; i < r->m_numResolvedWays; i++)
-			{
-				unsigned id = r->m_resolvedWays[i]->m_id;
-				fwrite(&(id), sizeof(id), 1, f);
-			}
-		}
-		else
-		{
-			fwrite(&zero, sizeof(zero), 1, f);
-		}
-
-		WriteTags(r->m_tags, f);
-	}
-	printf("done writing\n");
-}
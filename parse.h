@@ -7,10 +7,14 @@
 #include "osm.h"
 #include <stdio.h>
 
+// the file may be compressed with gzip, bzip2 or zstd
 OsmData *parse_osm(FILE *file, bool skipAttribs = false);
 
-OsmData *parse_binary(FILE *file, bool skipAttribs = false);
+// reads .osm.pbf files. only zlib compressed and uncompressed blobs are supported
+OsmData *parse_pbf(FILE *file, bool skipAttribs = false);
 
-void write_binary(OsmData *d, FILE *f);
+// reads the old (version 1) record based cache files, which only have 32 bit ids. new caches are
+// written by write_cache in cache.h
+OsmData *parse_binary(FILE *file, bool skipAttribs = false);
 
 #endif
@@ -0,0 +1,996 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "parse.h"
+#include "records.h"
+#include <zlib.h>
+#include <time.h>
+
+// reader for the .osm.pbf format. the file is a sequence of blobs (mostly zlib compressed), each
+// holding a block of a few thousand objects. the blobs are decoded on a pool of worker threads and
+// merged in file order, just like the xml chunks
+
+// the spec limits the sizes, so anything bigger means a corrupt file
+#define MAXBLOBHEADERSIZE (64 * 1024)
+#define MAXBLOBSIZE (32 * 1024 * 1024)
+
+// just enough of the protocol buffers wire format to read pbf files
+class ProtoBuffer
+{
+	public:
+		enum WIRETYPE
+		{
+			WT_VARINT = 0,
+			WT_64BIT = 1,
+			WT_BYTES = 2,
+			WT_32BIT = 5
+		};
+
+		ProtoBuffer(unsigned char const *data = NULL, size_t size = 0)
+		{
+			m_pos = data;
+			m_end = data + size;
+			m_error = false;
+		}
+
+		bool AtEnd()
+		{
+			return m_pos >= m_end;
+		}
+
+		wxUint64 Varint()
+		{
+			wxUint64 ret = 0;
+
+			for (int shift = 0; shift < 64 && m_pos < m_end; shift += 7)
+			{
+				unsigned char b = *m_pos++;
+				ret |= static_cast<wxUint64>(b & 0x7F) << shift;
+
+				if (!(b & 0x80))
+				{
+					return ret;
+				}
+			}
+
+			SetError();
+			return 0;
+		}
+
+		// zigzag encoded
+		wxInt64 SVarint()
+		{
+			wxUint64 v = Varint();
+			return static_cast<wxInt64>((v >> 1) ^ (~(v & 1) + 1));
+		}
+
+		// reads the key of the next field. returns false at the end of the message
+		bool Next(unsigned *field, unsigned *wireType)
+		{
+			if (AtEnd())
+			{
+				return false;
+			}
+
+			wxUint64 key = Varint();
+			*field = static_cast<unsigned>(key >> 3);
+			*wireType = static_cast<unsigned>(key & 7);
+
+			return !m_error;
+		}
+
+		// strings, bytes, sub messages and packed arrays
+		ProtoBuffer Bytes()
+		{
+			wxUint64 len = Varint();
+
+			if (len > static_cast<wxUint64>(m_end - m_pos))
+			{
+				SetError();
+				return ProtoBuffer();
+			}
+
+			ProtoBuffer ret(m_pos, static_cast<size_t>(len));
+			m_pos += len;
+
+			return ret;
+		}
+
+		void Skip(unsigned wireType)
+		{
+			switch(wireType)
+			{
+				case WT_VARINT:
+					Varint();
+				break;
+				case WT_64BIT:
+					Advance(8);
+				break;
+				case WT_BYTES:
+					Bytes();
+				break;
+				case WT_32BIT:
+					Advance(4);
+				break;
+				default:
+					SetError();
+				break;
+			}
+		}
+
+		unsigned char const *m_pos, *m_end;
+		bool m_error;
+
+	private:
+		void Advance(size_t n)
+		{
+			if (static_cast<size_t>(m_end - m_pos) < n)
+			{
+				SetError();
+			}
+			else
+			{
+				m_pos += n;
+			}
+		}
+
+		void SetError()
+		{
+			m_error = true;
+			m_pos = m_end;
+		}
+};
+
+// decompresses a Blob message. returns a malloced buffer, or NULL and sets error
+static unsigned char *DecompressBlob(unsigned char const *blob, size_t blobSize, size_t *size, char const **error)
+{
+	ProtoBuffer b(blob, blobSize);
+	ProtoBuffer raw, zlibData;
+	bool haveRaw = false, haveZlib = false;
+	wxUint64 rawSize = 0;
+	unsigned field, wireType;
+
+	*error = NULL;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			raw = b.Bytes();
+			haveRaw = true;
+		}
+		else if (field == 2 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			rawSize = b.Varint();
+		}
+		else if (field == 3 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			zlibData = b.Bytes();
+			haveZlib = true;
+		}
+		else if (field >= 4 && field <= 7)
+		{
+			*error = "unsupported blob compression (only zlib and uncompressed are supported)";
+			return NULL;
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	if (b.m_error)
+	{
+		*error = "corrupt blob";
+		return NULL;
+	}
+
+	if (haveRaw)
+	{
+		*size = raw.m_end - raw.m_pos;
+		unsigned char *ret = static_cast<unsigned char *>(malloc(*size ? *size : 1));
+		memcpy(ret, raw.m_pos, *size);
+		return ret;
+	}
+
+	if (!haveZlib || rawSize > MAXBLOBSIZE)
+	{
+		*error = "corrupt blob";
+		return NULL;
+	}
+
+	uLongf destLen = static_cast<uLongf>(rawSize);
+	unsigned char *ret = static_cast<unsigned char *>(malloc(rawSize ? rawSize : 1));
+
+	if (uncompress(ret, &destLen, zlibData.m_pos, zlibData.m_end - zlibData.m_pos) != Z_OK || destLen != rawSize)
+	{
+		free(ret);
+		*error = "zlib error";
+		return NULL;
+	}
+
+	*size = destLen;
+	return ret;
+}
+
+// the metadata of an object, only used when the attributes are wanted
+struct PbfInfo
+{
+	PbfInfo()
+	{
+		m_present = false;
+		m_version = m_timestamp = m_changeset = m_uid = 0;
+		m_userSid = 0;
+		m_visible = -1;
+	}
+
+	bool m_present;
+	wxInt64 m_version, m_timestamp, m_changeset, m_uid;
+	wxUint32 m_userSid;
+	int m_visible;	// -1 if not in the file
+};
+
+// decodes one OSMData blob into records
+class PbfBlockJob
+	: public RecordsJob
+{
+	public:
+		// takes ownership of blob, which should be malloced
+		PbfBlockJob(unsigned char *blob, size_t size, bool skipAttribs)
+			: RecordsJob(skipAttribs)
+		{
+			m_blob = blob;
+			m_blobSize = size;
+			m_error = NULL;
+			m_strings = NULL;
+			m_stringData = NULL;
+			m_numStrings = 0;
+			m_granularity = 100;
+			m_dateGranularity = 1000;
+			m_latOffset = m_lonOffset = 0;
+		}
+
+		~PbfBlockJob()
+		{
+			free(m_blob);
+			delete [] m_strings;
+			delete [] m_stringData;
+		}
+
+		void Run()
+		{
+			size_t size = 0;
+			unsigned char *data = DecompressBlob(m_blob, m_blobSize, &size, &m_error);
+
+			free(m_blob);
+			m_blob = NULL;
+
+			if (data)
+			{
+				DecodeBlock(ProtoBuffer(data, size));
+				free(data);
+			}
+		}
+
+		void ReportErrors()
+		{
+			if (m_error)
+			{
+				printf("pbf error: %s\n", m_error);
+			}
+		}
+
+	private:
+		void DecodeBlock(ProtoBuffer block);
+		void ReadStringTable(ProtoBuffer b);
+		void DecodeGroup(ProtoBuffer b);
+		void DecodeNode(ProtoBuffer b);
+		void DecodeDenseNodes(ProtoBuffer b);
+		void DecodeWay(ProtoBuffer b);
+		void DecodeRelation(ProtoBuffer b);
+		PbfInfo DecodeInfo(ProtoBuffer b);
+
+		// keys and vals are the packed string indices of a Node, Way or Relation
+		void PutTags(ProtoBuffer keys, ProtoBuffer vals)
+		{
+			while (!keys.AtEnd() && !vals.AtEnd())
+			{
+				m_records.PutType(ParsedRecords::REC_TAGPAIR);
+				m_records.PutIndex(static_cast<wxUint32>(keys.Varint()));
+				m_records.PutIndex(static_cast<wxUint32>(vals.Varint()));
+			}
+		}
+
+		void PutAttribute(char const *key, char const *value)
+		{
+			m_records.PutType(ParsedRecords::REC_ATTRIBUTE);
+			m_records.PutString(key);
+			m_records.PutString(value);
+		}
+
+		void PutAttribute(char const *key, wxInt64 value)
+		{
+			char buf[32];
+			snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(value));
+			PutAttribute(key, buf);
+		}
+
+		// in the same order as the xml parser reads them
+		void PutAttributes(PbfInfo const &info);
+
+		double Lat(wxInt64 lat)
+		{
+			return 1e-9 * (m_latOffset + m_granularity * lat);
+		}
+
+		double Lon(wxInt64 lon)
+		{
+			return 1e-9 * (m_lonOffset + m_granularity * lon);
+		}
+
+		unsigned char *m_blob;
+		size_t m_blobSize;
+		char const *m_error;
+
+		char const **m_strings;
+		char *m_stringData;
+		unsigned m_numStrings;
+
+		wxInt64 m_granularity, m_dateGranularity, m_latOffset, m_lonOffset;
+};
+
+void PbfBlockJob::DecodeBlock(ProtoBuffer block)
+{
+	unsigned field, wireType;
+
+	// the block parameters could in theory come after the groups, so read them first
+	ProtoBuffer b = block;
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			ReadStringTable(b.Bytes());
+		}
+		else if (field == 17 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			m_granularity = static_cast<wxInt64>(b.Varint());
+		}
+		else if (field == 18 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			m_dateGranularity = static_cast<wxInt64>(b.Varint());
+		}
+		else if (field == 19 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			m_latOffset = static_cast<wxInt64>(b.Varint());
+		}
+		else if (field == 20 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			m_lonOffset = static_cast<wxInt64>(b.Varint());
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	m_records.SetStringTable(m_strings, m_numStrings);
+
+	b = block;
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 2 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			DecodeGroup(b.Bytes());
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	if (b.m_error)
+	{
+		m_error = "corrupt block";
+	}
+}
+
+// the strings are copied with terminating zeros, so they can be handed to the tagstore as they are
+void PbfBlockJob::ReadStringTable(ProtoBuffer b)
+{
+	unsigned field, wireType;
+	unsigned num = 0;
+	size_t total = 0;
+
+	ProtoBuffer c = b;
+	while (c.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			ProtoBuffer s = c.Bytes();
+			total += s.m_end - s.m_pos + 1;
+			num++;
+		}
+		else
+		{
+			c.Skip(wireType);
+		}
+	}
+
+	delete [] m_strings;
+	delete [] m_stringData;
+	m_strings = new char const *[num + 1];
+	m_stringData = new char[total + 1];
+	m_numStrings = 0;
+
+	char *p = m_stringData;
+	while (b.Next(&field, &wireType) && m_numStrings < num)
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			ProtoBuffer s = b.Bytes();
+			size_t len = s.m_end - s.m_pos;
+			memcpy(p, s.m_pos, len);
+			p[len] = 0;
+			m_strings[m_numStrings++] = p;
+			p += len + 1;
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+}
+
+void PbfBlockJob::DecodeGroup(ProtoBuffer b)
+{
+	unsigned field, wireType;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (wireType != ProtoBuffer::WT_BYTES)
+		{
+			b.Skip(wireType);
+			continue;
+		}
+
+		switch(field)
+		{
+			case 1:
+				DecodeNode(b.Bytes());
+			break;
+			case 2:
+				DecodeDenseNodes(b.Bytes());
+			break;
+			case 3:
+				DecodeWay(b.Bytes());
+			break;
+			case 4:
+				DecodeRelation(b.Bytes());
+			break;
+			default:
+				b.Skip(wireType);
+			break;
+		}
+	}
+}
+
+PbfInfo PbfBlockJob::DecodeInfo(ProtoBuffer b)
+{
+	PbfInfo ret;
+	unsigned field, wireType;
+
+	ret.m_present = true;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (wireType != ProtoBuffer::WT_VARINT)
+		{
+			b.Skip(wireType);
+			continue;
+		}
+
+		wxUint64 v = b.Varint();
+
+		switch(field)
+		{
+			case 1:
+				ret.m_version = static_cast<wxInt64>(v);
+			break;
+			case 2:
+				ret.m_timestamp = static_cast<wxInt64>(v);
+			break;
+			case 3:
+				ret.m_changeset = static_cast<wxInt64>(v);
+			break;
+			case 4:
+				ret.m_uid = static_cast<wxInt32>(v);
+			break;
+			case 5:
+				ret.m_userSid = static_cast<wxUint32>(v);
+			break;
+			case 6:
+				ret.m_visible = v ? 1 : 0;
+			break;
+		}
+	}
+
+	return ret;
+}
+
+void PbfBlockJob::PutAttributes(PbfInfo const &info)
+{
+	if (m_records.m_skipAttribs || !info.m_present)
+	{
+		return;
+	}
+
+	if (info.m_userSid && info.m_userSid < m_numStrings)
+	{
+		PutAttribute("user", m_strings[info.m_userSid]);
+	}
+
+	PutAttribute("uid", info.m_uid);
+
+	if (info.m_visible >= 0)
+	{
+		PutAttribute("visible", info.m_visible ? "true" : "false");
+	}
+
+	PutAttribute("version", info.m_version);
+	PutAttribute("changeset", info.m_changeset);
+
+	time_t t = static_cast<time_t>(info.m_timestamp * m_dateGranularity / 1000);
+	struct tm tm;
+	char buf[32];
+	gmtime_r(&t, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	PutAttribute("timestamp", buf);
+}
+
+void PbfBlockJob::DecodeNode(ProtoBuffer b)
+{
+	unsigned field, wireType;
+	wxInt64 id = 0, lat = 0, lon = 0;
+	ProtoBuffer keys, vals;
+	PbfInfo info;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			id = b.SVarint();
+		}
+		else if (field == 2 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			keys = b.Bytes();
+		}
+		else if (field == 3 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			vals = b.Bytes();
+		}
+		else if (field == 4 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			info = DecodeInfo(b.Bytes());
+		}
+		else if (field == 8 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			lat = b.SVarint();
+		}
+		else if (field == 9 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			lon = b.SVarint();
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	m_records.PutType(ParsedRecords::REC_NODE);
+	m_records.PutId(static_cast<OsmId>(id));
+	m_records.PutDouble(Lat(lat));
+	m_records.PutDouble(Lon(lon));
+	PutAttributes(info);
+	PutTags(keys, vals);
+	m_records.PutType(ParsedRecords::REC_ENDNODE);
+}
+
+// dense nodes store every field as a separate packed (and mostly delta coded) array. all arrays
+// are walked in step, without unpacking them first
+void PbfBlockJob::DecodeDenseNodes(ProtoBuffer b)
+{
+	unsigned field, wireType;
+	ProtoBuffer ids, lats, lons, keysVals, info;
+	bool haveInfo = false;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (wireType != ProtoBuffer::WT_BYTES)
+		{
+			b.Skip(wireType);
+			continue;
+		}
+
+		switch(field)
+		{
+			case 1:
+				ids = b.Bytes();
+			break;
+			case 5:
+				info = b.Bytes();
+				haveInfo = true;
+			break;
+			case 8:
+				lats = b.Bytes();
+			break;
+			case 9:
+				lons = b.Bytes();
+			break;
+			case 10:
+				keysVals = b.Bytes();
+			break;
+			default:
+				b.Skip(wireType);
+			break;
+		}
+	}
+
+	// the DenseInfo arrays
+	ProtoBuffer versions, timestamps, changesets, uids, userSids, visibles;
+	bool wantInfo = haveInfo && !m_records.m_skipAttribs;
+
+	if (wantInfo)
+	{
+		while (info.Next(&field, &wireType))
+		{
+			if (wireType != ProtoBuffer::WT_BYTES)
+			{
+				info.Skip(wireType);
+				continue;
+			}
+
+			switch(field)
+			{
+				case 1:
+					versions = info.Bytes();
+				break;
+				case 2:
+					timestamps = info.Bytes();
+				break;
+				case 3:
+					changesets = info.Bytes();
+				break;
+				case 4:
+					uids = info.Bytes();
+				break;
+				case 5:
+					userSids = info.Bytes();
+				break;
+				case 6:
+					visibles = info.Bytes();
+				break;
+				default:
+					info.Skip(wireType);
+				break;
+			}
+		}
+	}
+
+	wxInt64 id = 0, lat = 0, lon = 0;
+	PbfInfo nodeInfo;
+	wxInt64 userSid = 0;
+
+	while (!ids.AtEnd() && !lats.AtEnd() && !lons.AtEnd())
+	{
+		id += ids.SVarint();
+		lat += lats.SVarint();
+		lon += lons.SVarint();
+
+		m_records.PutType(ParsedRecords::REC_NODE);
+		m_records.PutId(static_cast<OsmId>(id));
+		m_records.PutDouble(Lat(lat));
+		m_records.PutDouble(Lon(lon));
+
+		if (wantInfo)
+		{
+			nodeInfo.m_present = true;
+			nodeInfo.m_version = versions.AtEnd() ? 0 : static_cast<wxInt32>(versions.Varint());
+			nodeInfo.m_timestamp += timestamps.AtEnd() ? 0 : timestamps.SVarint();
+			nodeInfo.m_changeset += changesets.AtEnd() ? 0 : changesets.SVarint();
+			nodeInfo.m_uid += uids.AtEnd() ? 0 : uids.SVarint();
+			userSid += userSids.AtEnd() ? 0 : userSids.SVarint();
+			nodeInfo.m_userSid = static_cast<wxUint32>(userSid);
+			nodeInfo.m_visible = visibles.AtEnd() ? -1 : (visibles.Varint() ? 1 : 0);
+
+			PutAttributes(nodeInfo);
+		}
+
+		// the tags of all nodes in one array, each node's list ends with a 0
+		while (!keysVals.AtEnd())
+		{
+			wxUint32 k = static_cast<wxUint32>(keysVals.Varint());
+
+			if (!k)
+			{
+				break;
+			}
+
+			wxUint32 v = static_cast<wxUint32>(keysVals.Varint());
+			m_records.PutType(ParsedRecords::REC_TAGPAIR);
+			m_records.PutIndex(k);
+			m_records.PutIndex(v);
+		}
+
+		m_records.PutType(ParsedRecords::REC_ENDNODE);
+	}
+
+	if (ids.m_error || lats.m_error || lons.m_error || keysVals.m_error)
+	{
+		m_error = "corrupt dense nodes";
+	}
+}
+
+void PbfBlockJob::DecodeWay(ProtoBuffer b)
+{
+	unsigned field, wireType;
+	wxInt64 id = 0;
+	ProtoBuffer keys, vals, refs;
+	PbfInfo info;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			id = static_cast<wxInt64>(b.Varint());
+		}
+		else if (field == 2 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			keys = b.Bytes();
+		}
+		else if (field == 3 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			vals = b.Bytes();
+		}
+		else if (field == 4 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			info = DecodeInfo(b.Bytes());
+		}
+		else if (field == 8 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			refs = b.Bytes();
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	m_records.PutType(ParsedRecords::REC_WAY);
+	m_records.PutId(static_cast<OsmId>(id));
+	PutAttributes(info);
+
+	wxInt64 ref = 0;
+	while (!refs.AtEnd())
+	{
+		ref += refs.SVarint();
+		m_records.PutType(ParsedRecords::REC_NODEREF);
+		m_records.PutId(static_cast<OsmId>(ref));
+	}
+
+	PutTags(keys, vals);
+	m_records.PutType(ParsedRecords::REC_ENDWAY);
+}
+
+void PbfBlockJob::DecodeRelation(ProtoBuffer b)
+{
+	unsigned field, wireType;
+	wxInt64 id = 0;
+	ProtoBuffer keys, vals, memberIds, types;
+	PbfInfo info;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 1 && wireType == ProtoBuffer::WT_VARINT)
+		{
+			id = static_cast<wxInt64>(b.Varint());
+		}
+		else if (field == 2 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			keys = b.Bytes();
+		}
+		else if (field == 3 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			vals = b.Bytes();
+		}
+		else if (field == 4 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			info = DecodeInfo(b.Bytes());
+		}
+		else if (field == 9 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			memberIds = b.Bytes();
+		}
+		else if (field == 10 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			types = b.Bytes();
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	m_records.PutType(ParsedRecords::REC_RELATION);
+	m_records.PutId(static_cast<OsmId>(id));
+	PutAttributes(info);
+
+	// member types: 0 node, 1 way, 2 relation. relation members are ignored, like in the xml parser
+	wxInt64 memberId = 0;
+	while (!memberIds.AtEnd() && !types.AtEnd())
+	{
+		memberId += memberIds.SVarint();
+		wxUint64 type = types.Varint();
+
+		if (type == 0)
+		{
+			m_records.PutType(ParsedRecords::REC_NODEREF);
+			m_records.PutId(static_cast<OsmId>(memberId));
+		}
+		else if (type == 1)
+		{
+			m_records.PutType(ParsedRecords::REC_WAYREF);
+			m_records.PutId(static_cast<OsmId>(memberId));
+		}
+	}
+
+	PutTags(keys, vals);
+	m_records.PutType(ParsedRecords::REC_ENDRELATION);
+}
+
+// the header block lists the features a reader needs to understand
+static void CheckHeader(unsigned char const *blob, size_t size)
+{
+	char const *error;
+	size_t headerSize = 0;
+	unsigned char *header = DecompressBlob(blob, size, &headerSize, &error);
+
+	if (!header)
+	{
+		printf("pbf error in header: %s\n", error);
+		return;
+	}
+
+	ProtoBuffer b(header, headerSize);
+	unsigned field, wireType;
+
+	while (b.Next(&field, &wireType))
+	{
+		if (field == 4 && wireType == ProtoBuffer::WT_BYTES)
+		{
+			ProtoBuffer s = b.Bytes();
+			size_t len = s.m_end - s.m_pos;
+			char const *f = reinterpret_cast<char const *>(s.m_pos);
+
+			if (!(len == 14 && !memcmp(f, "OsmSchema-V0.6", 14)) && !(len == 10 && !memcmp(f, "DenseNodes", 10)))
+			{
+				printf("pbf file needs unsupported feature %.*s, the result may be incomplete\n", static_cast<int>(len), f);
+			}
+		}
+		else
+		{
+			b.Skip(wireType);
+		}
+	}
+
+	free(header);
+}
+
+static bool ReadBytes(FILE *file, void *buf, size_t size)
+{
+	return fread(buf, 1, size, file) == size;
+}
+
+OsmData *parse_pbf(FILE *file, bool skipAttribs)
+{
+	OsmData *ret = new OsmData;
+
+	ret->m_skipAttribs = skipAttribs;
+
+	ReserveForInput(ret, file, 12);
+
+	// the main thread is busy merging
+	int numWorkers = wxThread::GetCPUCount() - 1;
+	WorkerPool pool(numWorkers > 1 ? numWorkers : 1);
+	OrderedMerge pending(&pool, ret, 2 * pool.GetNumThreads() + 2);
+
+	unsigned char *header = new unsigned char[MAXBLOBHEADERSIZE];
+	unsigned long long bytesRead = 0, nextReport = 0;
+
+	for (;;)
+	{
+		// a big endian length, a BlobHeader and the Blob
+		unsigned char lenBuf[4];
+
+		if (!ReadBytes(file, lenBuf, 4))
+		{
+			break;
+		}
+
+		wxUint32 headerSize = (lenBuf[0] << 24) | (lenBuf[1] << 16) | (lenBuf[2] << 8) | lenBuf[3];
+
+		if (headerSize > MAXBLOBHEADERSIZE || !ReadBytes(file, header, headerSize))
+		{
+			printf("pbf error: corrupt blob header\n");
+			break;
+		}
+
+		ProtoBuffer h(header, headerSize);
+		ProtoBuffer type;
+		wxUint64 dataSize = 0;
+		unsigned field, wireType;
+
+		while (h.Next(&field, &wireType))
+		{
+			if (field == 1 && wireType == ProtoBuffer::WT_BYTES)
+			{
+				type = h.Bytes();
+			}
+			else if (field == 3 && wireType == ProtoBuffer::WT_VARINT)
+			{
+				dataSize = h.Varint();
+			}
+			else
+			{
+				h.Skip(wireType);
+			}
+		}
+
+		if (h.m_error || dataSize > MAXBLOBSIZE)
+		{
+			printf("pbf error: corrupt blob header\n");
+			break;
+		}
+
+		unsigned char *blob = static_cast<unsigned char *>(malloc(dataSize ? dataSize : 1));
+
+		if (!ReadBytes(file, blob, dataSize))
+		{
+			printf("pbf error: truncated file\n");
+			free(blob);
+			break;
+		}
+
+		bytesRead += 4 + headerSize + dataSize;
+		if (bytesRead >= nextReport)
+		{
+			printf("read %lluMB\n", bytesRead / (1024 * 1024));
+			nextReport += 64 * 1024 * 1024;
+		}
+
+		size_t typeLen = type.m_end - type.m_pos;
+		char const *typeName = reinterpret_cast<char const *>(type.m_pos);
+
+		if (typeLen == 7 && !memcmp(typeName, "OSMData", 7))
+		{
+			pending.Add(new PbfBlockJob(blob, dataSize, skipAttribs));
+		}
+		else
+		{
+			if (typeLen == 9 && !memcmp(typeName, "OSMHeader", 9))
+			{
+				CheckHeader(blob, dataSize);
+			}
+
+			// unknown blob types are skipped, as the spec says
+			free(blob);
+		}
+	}
+
+	delete [] header;
+
+	pending.MergeAll();
+
+	ret->Resolve();
+
+	return ret;
+}
@@ -0,0 +1,526 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "rastercache.h"
+#include "renderer.h"
+#include <wx/filename.h>
+#include <wx/dir.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+class RasterTile
+{
+	public:
+		RasterTile(RasterKey const &key, Renderer *tile)
+			: m_key(key)
+		{
+			m_tile = tile;
+			m_prev = m_next = NULL;
+			m_bytes = static_cast<size_t>(tile->GetWidth()) * static_cast<size_t>(tile->GetHeight()) * 4 * tile->GetNumLayers();
+		}
+
+		~RasterTile()
+		{
+			delete m_tile;
+		}
+
+		RasterKey m_key;
+		Renderer *m_tile;
+		RasterTile *m_prev, *m_next;
+		size_t m_bytes;
+};
+
+class DiskTile
+{
+	public:
+		DiskTile(wxString const &name, size_t bytes)
+			: m_name(name)
+		{
+			m_bytes = bytes;
+			m_prev = m_next = NULL;
+		}
+
+		wxString m_name;
+		size_t m_bytes;
+		DiskTile *m_prev, *m_next;
+};
+
+// wxStrings can't be shared between threads, the jobs get plain copies of the names
+static char *CopyName(wxString const &name)
+{
+	wxCharBuffer b = name.mb_str(wxConvUTF8);
+	char *ret = new char[strlen(b) + 1];
+
+	strcpy(ret, b);
+
+	return ret;
+}
+
+// writes a tile, or deletes the file if there is no tile
+class TileWriteJob
+	: public WorkerJob
+{
+	public:
+		// takes ownership of tile
+		TileWriteJob(Renderer *tile, wxString const &name, size_t bytes = 0)
+		{
+			m_tile = tile;
+			m_name = CopyName(name);
+			m_bytes = bytes;
+			m_next = NULL;
+		}
+
+		~TileWriteJob()
+		{
+			delete m_tile;
+			delete [] m_name;
+		}
+
+		void Run()
+		{
+			if (!m_tile)
+			{
+				remove(m_name);
+				return;
+			}
+
+			// written under another name first, so a half written tile is never read
+			char *tmp = new char[strlen(m_name) + 5];
+			sprintf(tmp, "%s.tmp", m_name);
+
+			FILE *f = fopen(tmp, "wb");
+
+			if (f)
+			{
+				bool ok = m_tile->Write(f);
+
+				if (fclose(f))
+				{
+					ok = false;
+				}
+
+				if (!ok || rename(tmp, m_name))
+				{
+					remove(tmp);
+				}
+			}
+
+			delete [] tmp;
+		}
+
+		Renderer *m_tile;
+		char *m_name;
+		size_t m_bytes;
+		TileWriteJob *m_next;
+};
+
+struct FileAge
+{
+	time_t m_time;
+	size_t m_bytes;
+	unsigned m_index;
+};
+
+static int CompareFileAges(void const *a, void const *b)
+{
+	FileAge const *fa = static_cast<FileAge const *>(a);
+	FileAge const *fb = static_cast<FileAge const *>(b);
+
+	if (fa->m_time != fb->m_time)
+	{
+		return fa->m_time < fb->m_time ? -1 : 1;
+	}
+
+	return fa->m_index < fb->m_index ? -1 : (fa->m_index > fb->m_index ? 1 : 0);
+}
+
+wxUint64 RasterKey::GetHash() const
+{
+	// splitmix64 finaliser over the packed fields
+	wxUint64 h = (static_cast<wxUint64>(static_cast<wxUint32>(m_x)) << 32) ^ static_cast<wxUint32>(m_y);
+	h ^= (static_cast<wxUint64>(m_style) << 16) ^ static_cast<wxUint64>(static_cast<wxUint32>(m_zoom)) * 0x9E3779B97F4A7C15ULL;
+
+	h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+
+	return h ^ (h >> 31);
+}
+
+RasterCache::RasterCache(size_t maxBytes, int numLayers, wxString const &dir, size_t maxDiskBytes)
+{
+	m_first = m_last = NULL;
+	m_bytes = 0;
+	m_maxBytes = maxBytes;
+	m_numLayers = numLayers;
+	m_dir = dir;
+	m_firstFile = m_lastFile = NULL;
+	m_diskBytes = 0;
+	m_maxDiskBytes = maxDiskBytes;
+	m_writer = NULL;
+	m_writes = NULL;
+	m_writeBytes = 0;
+
+	if (!m_dir.IsEmpty() && !wxFileName::DirExists(m_dir) && !wxFileName::Mkdir(m_dir, 0777, wxPATH_MKDIR_FULL))
+	{
+		printf("could not create tile directory %s, not storing tiles\n", (char const *)(m_dir.mb_str(wxConvUTF8)));
+		m_dir = wxEmptyString;
+	}
+
+	if (!m_dir.IsEmpty())
+	{
+		m_writer = new WorkerPool(1);
+		ScanDir();
+	}
+}
+
+RasterCache::~RasterCache()
+{
+	Clear();
+
+	if (m_writer)
+	{
+		ReapWrites(true);
+		delete m_writer;
+	}
+
+	while (m_firstFile)
+	{
+		DiskTile *next = m_firstFile->m_next;
+
+		delete m_firstFile;
+		m_firstFile = next;
+	}
+}
+
+void RasterCache::ScanDir()
+{
+	// left behind by a write that didn't finish
+	wxArrayString files;
+	wxDir::GetAllFiles(m_dir, &files, wxT("*.tmp"), wxDIR_FILES);
+
+	for (unsigned i = 0; i < files.GetCount(); i++)
+	{
+		wxRemoveFile(files[i]);
+	}
+
+	files.Clear();
+	wxDir::GetAllFiles(m_dir, &files, wxT("*.tile"), wxDIR_FILES);
+
+	unsigned num = 0;
+	FileAge *ages = new FileAge[files.GetCount() + 1];
+
+	for (unsigned i = 0; i < files.GetCount(); i++)
+	{
+		struct stat st;
+
+		if (!stat(files[i].mb_str(wxConvUTF8), &st))
+		{
+			ages[num].m_time = st.st_mtime;
+			ages[num].m_bytes = static_cast<size_t>(st.st_size);
+			ages[num].m_index = i;
+			num++;
+		}
+	}
+
+	qsort(ages, num, sizeof(FileAge), CompareFileAges);
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		DiskTile *d = new DiskTile(files[ages[i].m_index], ages[i].m_bytes);
+
+		m_files[d->m_name] = d;
+		LinkFileBack(d);
+		m_diskBytes += d->m_bytes;
+	}
+
+	delete [] ages;
+
+	TrimFiles();
+}
+
+void RasterCache::Queue(TileWriteJob *job)
+{
+	job->m_next = m_writes;
+	m_writes = job;
+	m_writer->Add(job);
+}
+
+void RasterCache::ReapWrites(bool wait)
+{
+	if (wait)
+	{
+		m_writer->WaitAll();
+	}
+
+	TileWriteJob **link = &m_writes;
+
+	while (*link)
+	{
+		TileWriteJob *job = *link;
+
+		if (m_writer->IsDone(job))
+		{
+			*link = job->m_next;
+			m_writeBytes -= job->m_bytes;
+			delete job;
+		}
+		else
+		{
+			link = &(job->m_next);
+		}
+	}
+}
+
+void RasterCache::TrimFiles()
+{
+	while (m_diskBytes > m_maxDiskBytes && m_firstFile != m_lastFile)
+	{
+		DiskTile *d = m_firstFile;
+
+		UnlinkFile(d);
+		m_files.erase(d->m_name);
+		m_diskBytes -= d->m_bytes;
+
+		// behind the writes that were queued before, one of which may be this file
+		Queue(new TileWriteJob(NULL, d->m_name));
+		delete d;
+	}
+}
+
+void RasterCache::Write(RasterKey const &key, Renderer *tile)
+{
+	ReapWrites(false);
+
+	size_t bytes = static_cast<size_t>(tile->GetWidth()) * static_cast<size_t>(tile->GetHeight()) * 4 * tile->GetNumLayers();
+
+	// rendering is faster than the disk, skip the tile rather than queueing copies without end
+	if (m_writeBytes && m_writeBytes + bytes > m_maxBytes / 4)
+	{
+		return;
+	}
+
+	// the cache may delete tile before the writer gets to it, so it writes a copy
+	Renderer *copy = tile->CreateOffscreen(tile->GetWidth(), tile->GetHeight(), tile->GetNumLayers());
+
+	if (!copy)
+	{
+		return;
+	}
+
+	copy->Paste(tile, 0, 0);
+
+	wxString name = GetFileName(key);
+	Queue(new TileWriteJob(copy, name, bytes));
+	m_writeBytes += bytes;
+
+	DiskTileMap::iterator i = m_files.find(name);
+	DiskTile *d;
+
+	if (i != m_files.end())
+	{
+		// written again, it replaces the old file
+		d = i->second;
+		UnlinkFile(d);
+		m_diskBytes -= d->m_bytes;
+		d->m_bytes = bytes;
+	}
+	else
+	{
+		d = new DiskTile(name, bytes);
+		m_files[name] = d;
+	}
+
+	LinkFileBack(d);
+	m_diskBytes += d->m_bytes;
+
+	TrimFiles();
+}
+
+void RasterCache::Clear()
+{
+	while (m_first)
+	{
+		Remove(m_first);
+	}
+}
+
+Renderer *RasterCache::Get(RasterKey const &key, Renderer *proto)
+{
+	RasterTileMap::iterator i = m_tiles.find(key.GetHash());
+
+	if (i != m_tiles.end() && i->second->m_key == key)
+	{
+		RasterTile *t = i->second;
+
+		Unlink(t);
+		LinkFront(t);
+
+		return t->m_tile;
+	}
+
+	if (m_dir.IsEmpty())
+	{
+		return NULL;
+	}
+
+	wxString name = GetFileName(key);
+	FILE *f = fopen(name.mb_str(wxConvUTF8), "rb");
+
+	if (!f)
+	{
+		return NULL;
+	}
+
+	Renderer *tile = proto->CreateOffscreen(RASTERTILESIZE, RASTERTILESIZE, m_numLayers);
+	bool ok = tile && tile->Read(f);
+
+	fclose(f);
+
+	if (!ok)
+	{
+		delete tile;
+		return NULL;
+	}
+
+	// used again, so it is the last to be deleted
+	DiskTileMap::iterator d = m_files.find(name);
+
+	if (d != m_files.end())
+	{
+		UnlinkFile(d->second);
+		LinkFileBack(d->second);
+	}
+
+	Insert(key, tile);
+
+	return tile;
+}
+
+void RasterCache::Add(RasterKey const &key, Renderer *tile)
+{
+	if (m_writer)
+	{
+		Write(key, tile);
+	}
+
+	Insert(key, tile);
+}
+
+void RasterCache::Insert(RasterKey const &key, Renderer *tile)
+{
+	wxUint64 hash = key.GetHash();
+	RasterTileMap::iterator i = m_tiles.find(hash);
+
+	if (i != m_tiles.end())
+	{
+		// the same tile rendered twice, or a hash collision. the newest wins
+		Remove(i->second);
+	}
+
+	RasterTile *t = new RasterTile(key, tile);
+
+	m_tiles[hash] = t;
+	LinkFront(t);
+	m_bytes += t->m_bytes;
+
+	// always keep the newest one, even if it's over the limit by itself
+	while (m_bytes > m_maxBytes && m_last != t)
+	{
+		Remove(m_last);
+	}
+}
+
+void RasterCache::Remove(RasterTile *t)
+{
+	Unlink(t);
+	m_tiles.erase(t->m_key.GetHash());
+	m_bytes -= t->m_bytes;
+	delete t;
+}
+
+void RasterCache::Unlink(RasterTile *t)
+{
+	if (t->m_prev)
+	{
+		t->m_prev->m_next = t->m_next;
+	}
+	else
+	{
+		m_first = t->m_next;
+	}
+
+	if (t->m_next)
+	{
+		t->m_next->m_prev = t->m_prev;
+	}
+	else
+	{
+		m_last = t->m_prev;
+	}
+
+	t->m_prev = t->m_next = NULL;
+}
+
+void RasterCache::LinkFront(RasterTile *t)
+{
+	t->m_next = m_first;
+	t->m_prev = NULL;
+
+	if (m_first)
+	{
+		m_first->m_prev = t;
+	}
+	else
+	{
+		m_last = t;
+	}
+
+	m_first = t;
+}
+
+void RasterCache::UnlinkFile(DiskTile *d)
+{
+	if (d->m_prev)
+	{
+		d->m_prev->m_next = d->m_next;
+	}
+	else
+	{
+		m_firstFile = d->m_next;
+	}
+
+	if (d->m_next)
+	{
+		d->m_next->m_prev = d->m_prev;
+	}
+	else
+	{
+		m_lastFile = d->m_prev;
+	}
+
+	d->m_prev = d->m_next = NULL;
+}
+
+void RasterCache::LinkFileBack(DiskTile *d)
+{
+	d->m_prev = m_lastFile;
+	d->m_next = NULL;
+
+	if (m_lastFile)
+	{
+		m_lastFile->m_next = d;
+	}
+	else
+	{
+		m_firstFile = d;
+	}
+
+	m_lastFile = d;
+}
+
+wxString RasterCache::GetFileName(RasterKey const &key)
+{
+	return wxString::Format(wxT("%s/%08x_%d_%d_%d.tile"), m_dir.c_str(), key.m_style, key.m_zoom, key.m_x, key.m_y);
+}
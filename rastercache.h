@@ -0,0 +1,109 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __RASTERCACHE_H__
+#define __RASTERCACHE_H__
+
+#include <wx/defs.h>
+#include <wx/string.h>
+#include <wx/hashmap.h>
+#include "workerpool.h"
+
+class Renderer;
+
+// the view is cut into square raster tiles of RASTERTILESIZE pixels. the tile grid is fixed in
+// projected pixel space (x = lon * xscale, y = -lat * scale), so a tile looks the same whenever its
+// zoom level, its position and the style are the same
+#define RASTERTILESIZE 256
+
+class RasterKey
+{
+	public:
+		RasterKey(int zoom = 0, int x = 0, int y = 0, wxUint32 style = 0)
+		{
+			m_zoom = zoom;
+			m_x = x;
+			m_y = y;
+			m_style = style;
+		}
+
+		bool operator==(RasterKey const &other) const
+		{
+			return m_zoom == other.m_zoom && m_x == other.m_x && m_y == other.m_y && m_style == other.m_style;
+		}
+
+		wxUint64 GetHash() const;
+
+		int m_zoom;
+		int m_x, m_y;
+		// the rules and everything else that changes the pixels
+		wxUint32 m_style;
+};
+
+class RasterTile;
+class DiskTile;
+class TileWriteJob;
+
+WX_DECLARE_HASH_MAP(wxUint64, RasterTile *, wxIntegerHash, wxIntegerEqual, RasterTileMap);
+WX_DECLARE_STRING_HASH_MAP(DiskTile *, DiskTileMap);
+
+// least recently used cache of rendered tiles, with numLayers layers each. when a directory is
+// given, tiles are also written there and read back when they are not in memory anymore. the
+// files are written on a thread of their own, and the least recently used ones are deleted when
+// they take more than maxDiskBytes. the copies waiting to be written take at most a quarter of
+// maxBytes on top of it, when the disk can't keep up tiles are not written
+class RasterCache
+{
+	public:
+		RasterCache(size_t maxBytes, int numLayers, wxString const &dir = wxEmptyString, size_t maxDiskBytes = 0);
+		~RasterCache();
+
+		// returns NULL if the tile isn't cached. the tile stays owned by the cache, and is valid
+		// until the next Add(). proto creates the renderer for tiles read from disk
+		Renderer *Get(RasterKey const &key, Renderer *proto);
+
+		// takes ownership of tile
+		void Add(RasterKey const &key, Renderer *tile);
+
+		void Clear();
+
+	private:
+		void Insert(RasterKey const &key, Renderer *tile);
+		void Unlink(RasterTile *t);
+		void LinkFront(RasterTile *t);
+		void Remove(RasterTile *t);
+		wxString GetFileName(RasterKey const &key);
+
+		// finds the files of an earlier run, oldest first, and deletes what is over the budget
+		void ScanDir();
+		// queues a write of tile, and the deletes that keep the files within budget
+		void Write(RasterKey const &key, Renderer *tile);
+		// deletes the write jobs that have finished. with wait, waits for all of them first
+		void ReapWrites(bool wait);
+		// queues deletes of the oldest files until the rest fits in the budget. the newest one stays
+		void TrimFiles();
+		void Queue(TileWriteJob *job);
+		void UnlinkFile(DiskTile *d);
+		void LinkFileBack(DiskTile *d);
+
+		RasterTileMap m_tiles;
+		// most recently used first
+		RasterTile *m_first, *m_last;
+
+		size_t m_bytes, m_maxBytes;
+		int m_numLayers;
+		wxString m_dir;
+
+		// the files in m_dir, least recently written or read first
+		DiskTile *m_firstFile, *m_lastFile;
+		DiskTileMap m_files;
+		size_t m_diskBytes, m_maxDiskBytes;
+
+		// one thread, so the deletes and writes happen in the order they were queued
+		WorkerPool *m_writer;
+		TileWriteJob *m_writes;
+		// the size of the tile copies in m_writes
+		size_t m_writeBytes;
+};
+
+#endif
@@ -0,0 +1,176 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "records.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+
+WX_DECLARE_HASH_MAP(wxUint64, TagIndex, wxIntegerHash, wxIntegerEqual, TagPairCache);
+
+void ParsedRecords::Replay(OsmData *o)
+{
+	size_t pos = 0;
+
+	// every tag in the string table is interned only once
+	TagPairCache pairs;
+	TagStore *tagStore = OsmTag::GetTagStore();
+
+	while (pos < m_size)
+	{
+		TYPE t = static_cast<TYPE>(m_data[pos++]);
+
+		switch(t)
+		{
+			case REC_NODE:
+			case REC_WAY:
+			case REC_RELATION:
+			{
+				if (!(o->m_elementCount % 1000000))
+				{
+					printf("parsed %uM elements\n", o->m_elementCount/1000000);
+				}
+
+				OsmId id = GetId(&pos);
+
+				if (t == REC_NODE)
+				{
+					double lat = GetDouble(&pos);
+					double lon = GetDouble(&pos);
+					o->StartNode(id, lat, lon);
+				}
+				else if (t == REC_WAY)
+				{
+					o->StartWay(id);
+				}
+				else
+				{
+					o->StartRelation(id);
+				}
+			}
+			break;
+			case REC_NODEREF:
+				o->AddNodeRef(GetId(&pos));
+			break;
+			case REC_WAYREF:
+				o->AddWayRef(GetId(&pos));
+			break;
+			case REC_TAGPAIR:
+			{
+				wxUint32 k = GetIndex(&pos);
+				wxUint32 v = GetIndex(&pos);
+				wxUint64 key = (static_cast<wxUint64>(k) << 32) | v;
+
+				TagPairCache::iterator f = pairs.find(key);
+
+				if (f != pairs.end())
+				{
+					o->AddTag(f->second);
+				}
+				else if (k < m_numStrings && v < m_numStrings)
+				{
+					TagIndex tag = tagStore->FindOrAdd(m_strings[k], m_strings[v]);
+					pairs[key] = tag;
+					o->AddTag(tag);
+				}
+			}
+			break;
+			case REC_TAG:
+			case REC_ATTRIBUTE:
+			{
+				char const *k = GetString(&pos);
+				char const *v = GetString(&pos);
+
+				if (t == REC_TAG)
+				{
+					o->AddTag(k, v);
+				}
+				else
+				{
+					o->AddAttribute(k, v);
+				}
+			}
+			break;
+			case REC_ENDNODE:
+				o->EndNode();
+			break;
+			case REC_ENDWAY:
+				o->EndWay();
+			break;
+			case REC_ENDRELATION:
+				o->EndRelation();
+			break;
+			default:
+				abort();
+			break;
+		}
+	}
+}
+
+OrderedMerge::OrderedMerge(WorkerPool *pool, OsmData *data, unsigned max)
+{
+	m_pool = pool;
+	m_data = data;
+	m_max = max;
+	m_jobs = new RecordsJob *[max];
+	m_first = m_count = 0;
+}
+
+OrderedMerge::~OrderedMerge()
+{
+	MergeAll();
+	delete [] m_jobs;
+}
+
+void OrderedMerge::Add(RecordsJob *job)
+{
+	// don't run too far ahead of the merging, the records take memory too
+	if (m_count == m_max)
+	{
+		MergeFirst();
+	}
+
+	m_pool->Add(job);
+	m_jobs[(m_first + m_count) % m_max] = job;
+	m_count++;
+}
+
+void OrderedMerge::MergeAll()
+{
+	while (m_count)
+	{
+		MergeFirst();
+	}
+}
+
+void OrderedMerge::MergeFirst()
+{
+	RecordsJob *job = m_jobs[m_first];
+	m_first = (m_first + 1) % m_max;
+	m_count--;
+
+	m_pool->Wait(job);
+
+	job->ReportErrors();
+	job->m_records.Replay(m_data);
+	delete job;
+}
+
+void ReserveForInput(OsmData *d, FILE *file, unsigned bytesPerNode)
+{
+	struct stat st;
+
+	if (fstat(fileno(file), &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+	{
+		return;
+	}
+
+	unsigned long long numNodes = st.st_size / bytesPerNode;
+
+	if (numNodes > 0xFFFFFFF0ULL)
+	{
+		numNodes = 0xFFFFFFF0ULL;
+	}
+
+	// typical extracts have about 1 way per 9 nodes and 1 relation per 700 nodes
+	d->Reserve(static_cast<unsigned>(numNodes), static_cast<unsigned>(numNodes / 8), static_cast<unsigned>(numNodes / 500));
+}
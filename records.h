@@ -0,0 +1,188 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __RECORDS_H__
+#define __RECORDS_H__
+
+#include "osm.h"
+#include "workerpool.h"
+#include <stdio.h>
+
+// shared by the parallel loaders (xml and pbf)
+
+// the parsed contents of a piece of input, as a flat list of records. the parsing threads fill
+// these, and the main thread replays them into the OsmData in input order. this way all the
+// expensive parsing is done in parallel, and the result is the same as parsing the file in one go
+class ParsedRecords
+{
+	public:
+		enum TYPE
+		{
+			REC_NODE,
+			REC_WAY,
+			REC_RELATION,
+			REC_NODEREF,
+			REC_WAYREF,
+			REC_TAG,
+			REC_TAGPAIR,	// a tag as two indices in the string table
+			REC_ATTRIBUTE,
+			REC_ENDNODE,
+			REC_ENDWAY,
+			REC_ENDRELATION
+		};
+
+		ParsedRecords(bool skipAttribs)
+		{
+			m_skipAttribs = skipAttribs;
+			m_size = 0;
+			m_max = 64 * 1024;
+			m_data = static_cast<char *>(malloc(m_max));
+			m_strings = NULL;
+			m_numStrings = 0;
+		}
+
+		~ParsedRecords()
+		{
+			free(m_data);
+		}
+
+		void PutType(TYPE t)
+		{
+			char c = static_cast<char>(t);
+			Put(&c, 1);
+		}
+
+		void PutId(OsmId id)
+		{
+			Put(&id, sizeof(id));
+		}
+
+		void PutDouble(double d)
+		{
+			Put(&d, sizeof(d));
+		}
+
+		void PutIndex(wxUint32 i)
+		{
+			Put(&i, sizeof(i));
+		}
+
+		void PutString(char const *s)
+		{
+			Put(s, strlen(s) + 1);
+		}
+
+		// the strings REC_TAGPAIR records refer to. they are not copied, so they have to stay
+		// valid until the records are replayed
+		void SetStringTable(char const * const *strings, unsigned num)
+		{
+			m_strings = strings;
+			m_numStrings = num;
+		}
+
+		// feeds all records to d
+		void Replay(OsmData *d);
+
+		bool m_skipAttribs;
+
+	private:
+		void Put(void const *data, size_t size)
+		{
+			if (m_size + size > m_max)
+			{
+				while (m_size + size > m_max)
+				{
+					m_max *= 2;
+				}
+				m_data = static_cast<char *>(realloc(m_data, m_max));
+				assert(m_data);
+			}
+
+			memcpy(m_data + m_size, data, size);
+			m_size += size;
+		}
+
+		OsmId GetId(size_t *pos)
+		{
+			OsmId ret;
+			memcpy(&ret, m_data + *pos, sizeof(ret));
+			*pos += sizeof(ret);
+			return ret;
+		}
+
+		double GetDouble(size_t *pos)
+		{
+			double ret;
+			memcpy(&ret, m_data + *pos, sizeof(ret));
+			*pos += sizeof(ret);
+			return ret;
+		}
+
+		wxUint32 GetIndex(size_t *pos)
+		{
+			wxUint32 ret;
+			memcpy(&ret, m_data + *pos, sizeof(ret));
+			*pos += sizeof(ret);
+			return ret;
+		}
+
+		char const *GetString(size_t *pos)
+		{
+			char const *ret = m_data + *pos;
+			*pos += strlen(ret) + 1;
+			return ret;
+		}
+
+		char *m_data;
+		size_t m_size, m_max;
+
+		char const * const *m_strings;
+		unsigned m_numStrings;
+};
+
+// a job that fills a ParsedRecords
+class RecordsJob
+	: public WorkerJob
+{
+	public:
+		RecordsJob(bool skipAttribs)
+			: m_records(skipAttribs)
+		{
+		}
+
+		// called on the main thread, before the records are replayed
+		virtual void ReportErrors()
+		{
+		}
+
+		ParsedRecords m_records;
+};
+
+// jobs waiting to be merged into the data, in input order
+class OrderedMerge
+{
+	public:
+		// max is the number of jobs that can be in flight before Add() blocks
+		OrderedMerge(WorkerPool *pool, OsmData *data, unsigned max);
+		~OrderedMerge();
+
+		// starts the job, and merges the oldest one first if there are too many in flight.
+		// the job is deleted after merging
+		void Add(RecordsJob *job);
+
+		void MergeAll();
+
+	private:
+		void MergeFirst();
+
+		WorkerPool *m_pool;
+		OsmData *m_data;
+		RecordsJob **m_jobs;
+		unsigned m_max, m_first, m_count;
+};
+
+// presize the id stores from the input size, so they don't have to grow (and rehash) while loading.
+// for pipes the size is unknown and the stores just grow as needed
+void ReserveForInput(OsmData *d, FILE *file, unsigned bytesPerNode);
+
+#endif
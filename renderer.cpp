@@ -5,6 +5,28 @@
 
 #include <wx/image.h>
 
+void Renderer::DrawNodes(Renderer::TYPE type, int layer, NodeStore *nodes, unsigned const *indices, unsigned num)
+{
+	Begin(type, layer);
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		unsigned node = indices[i];
+
+		if (node != NODE_INVALID)
+		{
+			AddPoint(nodes->Lon(node), nodes->Lat(node));
+		}
+		else if (type == R_LINE)
+		{
+			End();
+			Begin(type, layer);
+		}
+	}
+
+	End();
+}
+
 void RendererWxBitmap::DrawCenteredText(char const *s, double x, double y, double angle, int r, int g, int b, int a,  int layer)
 {
 	// not implemented yet
@@ -73,7 +95,7 @@ void RendererWxBitmap::BlitWithTransparency(wxBitmap *from, wxImage *to)
 
 }
 
-void RendererWxBitmap::Commit()
+wxRect RendererWxBitmap::Commit()
 {
 	wxMemoryDC to;
 	to.SelectObject(*m_output);
@@ -90,5 +112,6 @@ void RendererWxBitmap::Commit()
 
 	to.DrawBitmap(c,0,0);
 
+	return wxRect(0, 0, m_output->GetWidth(), m_output->GetHeight());
 }
 
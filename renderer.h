@@ -18,6 +18,7 @@ class Renderer
 
 		double GetWidth() { return m_outputWidth; }
 		double GetHeight() { return m_outputHeight; }
+		int GetNumLayers() { return m_numLayers; }
 		
 		enum TYPE
 		{
@@ -27,6 +28,11 @@ class Renderer
 		virtual void Begin(Renderer::TYPE type, int layer) = 0;
 		virtual void AddPoint(double x, double y, double xshift = 0, double yshift = 0) = 0;
 		virtual void End() = 0;
+
+		// draws a whole way: a line or polygon through the nodes with these indices in the store.
+		// NODE_INVALID splits a line, and is skipped in a polygon. the default goes through
+		// Begin(), AddPoint() and End()
+		virtual void DrawNodes(Renderer::TYPE type, int layer, NodeStore *nodes, unsigned const *indices, unsigned num);
 		virtual void DrawCenteredText(char const *text, double x, double y, double angle, int r, int g, int b, int a, int layer) = 0;
 
 		virtual bool SupportsLayers() = 0;
@@ -55,8 +61,60 @@ class Renderer
 
 		virtual void Clear(int layer = -1) = 0;
 
-		// merge all layers and output to screen
-		virtual void Commit() = 0;
+		// merge all layers and output to screen. returns the part of the output that changed
+		virtual wxRect Commit() = 0;
+
+		// draws what the renderer still has batched up, so its pixels are complete. a band is
+		// flushed on the thread that drew it, so pasting it only copies pixels
+		virtual void Flush()
+		{
+		}
+
+		// an off screen renderer of the same kind with numLayers layers, for rendering parts of the
+		// output elsewhere and Paste()ing them in later. the caller sets up the viewport. returns NULL
+		// if not supported
+		virtual Renderer *CreateOffscreen(int w, int h, int numLayers)
+		{
+			return NULL;
+		}
+
+		// copies the layers of an off screen renderer to x, y, replacing what was there. layers that
+		// only one of the two has are left alone
+		virtual void Paste(Renderer *from, int x, int y)
+		{
+		}
+
+		// store and restore the pixels of all layers. return false on failure, or if the
+		// renderer has no pixels
+		virtual bool Write(FILE *f)
+		{
+			return false;
+		}
+
+		virtual bool Read(FILE *f)
+		{
+			return false;
+		}
+
+		// a renderer for the pixels x to x + w, y to y + h of this one, at the same scale. it can be
+		// drawn into on another thread, and copied back with PasteBand(). returns NULL if bands are
+		// not supported
+		virtual Renderer *CreateBand(int x, int y, int w, int h)
+		{
+			return NULL;
+		}
+
+		// if the output scrolled after the band was created, the band moves along with it
+		virtual void PasteBand(Renderer *band, int x, int y)
+		{
+		}
+
+		// moves the pixels of all layers by dx, dy. the parts that scroll into view are cleared.
+		// returns false if the renderer can't scroll, then everything has to be redrawn
+		virtual bool Scroll(int dx, int dy)
+		{
+			return false;
+		}
 
 		virtual void SetupViewport(DRect const &viewport)
 		{
@@ -74,9 +132,24 @@ class Renderer
 		}
 
 	protected:
+		// adds r to the part of the output that changed since the last Commit()
+		void Damage(wxRect const &r)
+		{
+			if (m_damage.IsEmpty())
+			{
+				m_damage = r;
+			}
+			else if (!r.IsEmpty())
+			{
+				m_damage.Union(r);
+			}
+		}
+
 		double m_offX, m_offY, m_scaleX, m_scaleY;
 		double m_outputWidth, m_outputHeight;
 		int m_numLayers;
+		// changes of all layers together, the compositing doesn't need them separately
+		wxRect m_damage;
 };
 
 class RendererSimple
@@ -227,7 +300,7 @@ class RendererWxBitmap
 			}
 		}
 
-		void Commit();
+		wxRect Commit();
 	private:
 		void Setup(wxBitmap *outputBitmap);
 		wxBitmap *m_layer;
@@ -0,0 +1,154 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "resolve.h"
+#include "idindex.h"
+#include "workerpool.h"
+
+#define MINCHUNKSIZE (1024 * 1024)
+
+class ResolveJob
+	: public WorkerJob
+{
+	public:
+		ResolveJob(NodeStore *nodes, OsmId const *refs, size_t count, unsigned *result)
+		{
+			m_nodes = nodes;
+			m_refs = refs;
+			m_count = count;
+			m_result = result;
+			m_missing = 0;
+		}
+
+		void Run()
+		{
+			if (!m_nodes->IsSorted())
+			{
+				// no id column to join against, the node index has to do
+				for (size_t i = 0; i < m_count; i++)
+				{
+					m_result[i] = m_nodes->Find(m_refs[i]);
+
+					if (m_result[i] == NODE_INVALID)
+					{
+						m_missing++;
+					}
+				}
+
+				return;
+			}
+
+			OsmId *ids = new OsmId[m_count];
+			unsigned *positions = new unsigned[m_count];
+
+			for (size_t i = 0; i < m_count; i++)
+			{
+				ids[i] = m_refs[i];
+				positions[i] = i;
+			}
+
+			RadixSortIds(ids, positions, m_count);
+
+			OsmId const *nodeIds = m_nodes->m_ids;
+			unsigned numNodes = m_nodes->GetCount();
+			unsigned n = 0;
+
+			for (size_t i = 0; i < m_count; i++)
+			{
+				OsmId id = ids[i];
+
+				if (n < numNodes && nodeIds[n] < id)
+				{
+					// refs are sparse compared to the nodes, so gallop ahead and binary search the
+					// last step. nodeIds[lo] < id holds throughout
+					unsigned lo = n;
+					unsigned step = 1;
+
+					while (lo + step < numNodes && nodeIds[lo + step] < id)
+					{
+						lo += step;
+						step *= 2;
+					}
+
+					unsigned hi = lo + step < numNodes ? lo + step : numNodes;
+					lo++;
+
+					while (lo < hi)
+					{
+						unsigned mid = lo + (hi - lo) / 2;
+
+						if (nodeIds[mid] < id)
+						{
+							lo = mid + 1;
+						}
+						else
+						{
+							hi = mid;
+						}
+					}
+
+					n = lo;
+				}
+
+				if (n < numNodes && nodeIds[n] == id)
+				{
+					m_result[positions[i]] = n;
+				}
+				else
+				{
+					m_result[positions[i]] = NODE_INVALID;
+					m_missing++;
+				}
+			}
+
+			delete [] ids;
+			delete [] positions;
+		}
+
+		size_t m_missing;
+
+	private:
+		NodeStore *m_nodes;
+		OsmId const *m_refs;
+		size_t m_count;
+		unsigned *m_result;
+};
+
+size_t ResolveNodeRefs(NodeStore *nodes, OsmId const *refs, size_t count, unsigned *result, WorkerPool *pool)
+{
+	if (!count)
+	{
+		return 0;
+	}
+
+	size_t chunkSize = count / pool->GetNumThreads() + 1;
+	if (chunkSize < MINCHUNKSIZE)
+	{
+		chunkSize = MINCHUNKSIZE;
+	}
+
+	unsigned numJobs = (count + chunkSize - 1) / chunkSize;
+	ResolveJob **jobs = new ResolveJob *[numJobs];
+
+	for (unsigned i = 0; i < numJobs; i++)
+	{
+		size_t start = i * chunkSize;
+		size_t num = count - start < chunkSize ? count - start : chunkSize;
+
+		jobs[i] = new ResolveJob(nodes, refs + start, num, result + start);
+		pool->Add(jobs[i]);
+	}
+
+	size_t missing = 0;
+
+	for (unsigned i = 0; i < numJobs; i++)
+	{
+		pool->Wait(jobs[i]);
+		missing += jobs[i]->m_missing;
+		delete jobs[i];
+	}
+
+	delete [] jobs;
+
+	return missing;
+}
@@ -0,0 +1,16 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+
+#include "osm.h"
+
+class WorkerPool;
+
+// looks up all refs in the node store in one go. result[i] becomes the node index of refs[i], or
+// NODE_INVALID. the refs are cut in chunks, and every chunk is sorted and merge-joined against the
+// id column on one of the threads of pool. returns the number of refs that were not found
+size_t ResolveNodeRefs(NodeStore *nodes, OsmId const *refs, size_t count, unsigned *result, WorkerPool *pool);
+
+#endif
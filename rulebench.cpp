@@ -0,0 +1,279 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+
+// checks that the compiled rules give the same results as the expression trees, and measures how
+// fast both are. build with 'make rulebench', run with
+//     ./rulebench <mapfile.osm|mapfile.osm.pbf|mapfile.osm.cache> [rule ...]
+// without rules a few typical ones are timed. the check always runs on random rules as well
+#include "s_expr.h"
+#include "parse.h"
+#include "cache.h"
+#include <wx/init.h>
+#include <wx/stopwatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// this many evaluations per rule and way of evaluating, at least
+#define BENCHEVALUATIONS 20000000
+#define NUMRANDOMRULES 3000
+#define MAXRULELENGTH 4096
+
+static char const *s_typicalRules[] =
+{
+	"(or (tag \"highway\" \"primary\" \"secondary\" \"tertiary\" \"residential\" \"service\" \"footway\" \"unclassified\") (tag \"railway\"))",
+	"(and (tag \"building\") (not (tag \"building\" \"no\")))",
+	"(or (tag \"landuse\" \"grass\" \"meadow\" \"forest\" \"farmland\") (tag \"natural\" \"water\" \"wood\") (tag \"waterway\"))",
+	NULL
+};
+
+static char const *s_keys[] = { "highway", "building", "name", "landuse", "natural", "waterway", "amenity", "surface", "oneway", "nokey", "source" };
+static char const *s_values[] = { "yes", "residential", "primary", "water", "footway", "service", "no", "grass", "asphalt", "nope", "unclassified", "tertiary", "house" };
+
+#define NUMKEYS (sizeof(s_keys) / sizeof(s_keys[0]))
+#define NUMVALUES (sizeof(s_values) / sizeof(s_values[0]))
+
+static void Append(char *rule, char const *s)
+{
+	if (strlen(rule) + strlen(s) < MAXRULELENGTH)
+	{
+		strcat(rule, s);
+	}
+}
+
+// appends a random expression, with some parts switched off with '-'
+static void RandomRule(char *rule, int depth)
+{
+	Append(rule, rand() % 8 ? "(" : "(-");
+
+	int kind = depth > 3 ? 3 : rand() % 4;
+
+	if (kind == 3)
+	{
+		Append(rule, "tag \"");
+		Append(rule, s_keys[rand() % NUMKEYS]);
+		Append(rule, "\"");
+
+		int numValues = rand() % 4;
+		for (int i = 0; i < numValues; i++)
+		{
+			Append(rule, " \"");
+			Append(rule, s_values[rand() % NUMVALUES]);
+			Append(rule, "\"");
+		}
+	}
+	else if (kind == 0)
+	{
+		Append(rule, "not ");
+		RandomRule(rule, depth + 1);
+	}
+	else
+	{
+		Append(rule, kind == 1 ? "and" : "or");
+
+		int numChildren = 1 + rand() % 4;
+		for (int i = 0; i < numChildren; i++)
+		{
+			Append(rule, " ");
+			RandomRule(rule, depth + 1);
+		}
+	}
+
+	Append(rule, ")");
+}
+
+// returns the number of objects on which the tree and the program disagree
+static unsigned Check(Rule *rule, IdObjectWithTags **objects, unsigned num)
+{
+	unsigned bad = 0;
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		if (rule->Evaluate(objects[i]) != rule->EvaluateTree(objects[i]))
+		{
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+// returns false if the results differ
+static bool Bench(char const *text, IdObjectWithTags **objects, unsigned num)
+{
+	Rule rule(wxString::FromUTF8(text));
+
+	if (!rule.IsValid())
+	{
+		printf("invalid rule %s\n%s\n", text, (char const *)(rule.GetErrorLog().mb_str(wxConvUTF8)));
+		return false;
+	}
+
+	if (!rule.IsCompiled())
+	{
+		printf("rule %s is too deep to compile\n", text);
+	}
+
+	unsigned reps = BENCHEVALUATIONS / num + 1;
+	// the tree adds, the program subtracts. that ends at 0 when they agree, and keeps the loops
+	// from being optimised away
+	unsigned sum = 0;
+
+	wxStopWatch treeWatch;
+	for (unsigned r = 0; r < reps; r++)
+	{
+		for (unsigned i = 0; i < num; i++)
+		{
+			sum += rule.EvaluateTree(objects[i]);
+		}
+	}
+	long treeTime = treeWatch.Time();
+
+	wxStopWatch programWatch;
+	for (unsigned r = 0; r < reps; r++)
+	{
+		for (unsigned i = 0; i < num; i++)
+		{
+			sum -= rule.Evaluate(objects[i]);
+		}
+	}
+	long programTime = programWatch.Time();
+
+	double evaluations = static_cast<double>(reps) * num;
+	unsigned bad = Check(&rule, objects, num);
+
+	printf("%s\n", text);
+	printf("    tree    %.1fM evaluations/s\n", treeTime ? evaluations / treeTime / 1000 : 0);
+	printf("    program %.1fM evaluations/s\n", programTime ? evaluations / programTime / 1000 : 0);
+
+	if (bad || sum)
+	{
+		printf("    MISMATCH on %u objects\n", bad);
+		return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		printf("usage: %s <mapfile.osm|mapfile.osm.pbf|mapfile.osm.cache> [rule ...]\n", argv[0]);
+		return 2;
+	}
+
+	wxInitializer initializer;
+
+	MappedCache *cache = NULL;
+	OsmData *data = NULL;
+	char const *fileName = argv[1];
+	size_t len = strlen(fileName);
+
+	if (len > 6 && !strcmp(fileName + len - 6, ".cache"))
+	{
+		cache = MappedCache::Open(fileName);
+
+		if (cache)
+		{
+			data = cache->Load();
+		}
+	}
+	else
+	{
+		FILE *f = fopen(fileName, "r");
+
+		if (f)
+		{
+			data = len > 4 && !strcmp(fileName + len - 4, ".pbf") ? parse_pbf(f, true) : parse_osm(f, true);
+			fclose(f);
+		}
+	}
+
+	if (!data)
+	{
+		printf("could not read %s\n", fileName);
+		return 2;
+	}
+
+	// the ways and the relations, like the rules see them when drawing
+	unsigned num = data->m_ways.GetCount() + data->m_relations.GetCount();
+	IdObjectWithTags **objects = new IdObjectWithTags *[num];
+	unsigned n = 0;
+
+	for (OsmWay *w = static_cast<OsmWay *>(data->m_ways.m_content); w && n < num; w = static_cast<OsmWay *>(w->m_next))
+	{
+		objects[n++] = w;
+	}
+
+	for (OsmRelation *r = static_cast<OsmRelation *>(data->m_relations.m_content); r && n < num; r = static_cast<OsmRelation *>(r->m_next))
+	{
+		objects[n++] = r;
+	}
+
+	num = n;
+
+	if (!num)
+	{
+		printf("no ways in %s\n", fileName);
+		return 2;
+	}
+
+	printf("%u ways and relations\n", num);
+
+	bool ok = true;
+
+	if (argc > 2)
+	{
+		for (int i = 2; i < argc; i++)
+		{
+			ok = Bench(argv[i], objects, num) && ok;
+		}
+	}
+	else
+	{
+		for (int i = 0; s_typicalRules[i]; i++)
+		{
+			ok = Bench(s_typicalRules[i], objects, num) && ok;
+		}
+	}
+
+	// the same random rules every run
+	srand(5);
+
+	unsigned badRules = 0;
+	unsigned compiled = 0;
+	char text[MAXRULELENGTH + 1];
+
+	for (int i = 0; i < NUMRANDOMRULES; i++)
+	{
+		text[0] = 0;
+		RandomRule(text, 0);
+
+		Rule rule(wxString::FromUTF8(text));
+
+		if (rule.IsCompiled())
+		{
+			compiled++;
+		}
+
+		if (Check(&rule, objects, num))
+		{
+			if (!badRules)
+			{
+				printf("MISMATCH on %s\n", text);
+			}
+
+			badRules++;
+		}
+	}
+
+	printf("%d random rules (%u compiled): %u give different results\n", NUMRANDOMRULES, compiled, badRules);
+
+	delete [] objects;
+	delete data;
+	delete cache;
+
+	return ok && !badRules ? 0 : 1;
+}
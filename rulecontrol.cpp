@@ -52,6 +52,7 @@ void RuleControl::OnText(wxCommandEvent &evt)
 	if (newRule.IsValid() || GetValue().Trim().IsEmpty())
 	{
 		m_rule = newRule;
+		RuleSet::RulesChanged();
 		
 		m_canvas->Redraw();
 		SetToolTip(wxT("expression ok"));
@@ -99,6 +100,157 @@ LogicalExpression::STATE RuleControl::Evaluate(IdObjectWithTags *o)
 	return m_rule.Evaluate(o);
 }
 
+// an object's m_ruleCache is the generation of the rules in the high bits, and the match in the low
+// bits. there are at most 1024 colour rules
+#define RULEMATCHBITS 12
+#define RULEMATCHMASK ((1u << RULEMATCHBITS) - 1)
+#define RULEGENERATIONS (1u << (32 - RULEMATCHBITS))
+
+// 0 is never used, so objects that were never evaluated don't match. after wrapping around an
+// object would have to go unrendered for a million edits to be taken for current
+static wxUint32 s_ruleGeneration = 1;
+
+void RuleSet::RulesChanged()
+{
+	if (++s_ruleGeneration >= RULEGENERATIONS)
+	{
+		s_ruleGeneration = 1;
+	}
+}
+
+bool RuleSet::IsCurrent()
+{
+	return m_generation == s_ruleGeneration;
+}
+
+RuleSet::RuleSet(RuleControl *drawRule, ColorRules *colorRules)
+{
+	m_generation = s_ruleGeneration;
+
+	if (drawRule)
+	{
+		m_drawRule = drawRule->GetRule();
+	}
+
+	m_num = colorRules ? colorRules->m_num : 0;
+	m_rules = new Rule[m_num ? m_num : 1];
+	m_colours = new wxColour[m_num ? m_num : 1];
+	m_polygons = new bool[m_num ? m_num : 1];
+	m_layers = new int[m_num ? m_num : 1];
+
+	for (int i = 0; i < m_num; i++)
+	{
+		m_rules[i] = colorRules->m_rules[i]->GetRule();
+		m_colours[i] = colorRules->m_pickers[i]->GetColour();
+		m_polygons[i] = colorRules->m_checkBoxes[i]->IsChecked();
+		m_layers[i] = colorRules->m_layers[i]->GetSelection();
+	}
+}
+
+RuleSet::~RuleSet()
+{
+	delete [] m_rules;
+	delete [] m_colours;
+	delete [] m_polygons;
+	delete [] m_layers;
+}
+
+// fnv-1a
+static wxUint32 HashBytes(wxUint32 hash, void const *data, size_t size)
+{
+	unsigned char const *p = static_cast<unsigned char const *>(data);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ p[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static wxUint32 HashRule(wxUint32 hash, Rule const &rule)
+{
+	wxCharBuffer text = rule.GetText().mb_str(wxConvUTF8);
+
+	// include the terminator, so "a" "bc" and "ab" "c" differ
+	return HashBytes(hash, text.data(), strlen(text.data()) + 1);
+}
+
+wxUint32 RuleSet::GetHash()
+{
+	wxUint32 hash = HashRule(2166136261u, m_drawRule);
+
+	for (int i = 0; i < m_num; i++)
+	{
+		unsigned char style[6] = { m_colours[i].Red(), m_colours[i].Green(), m_colours[i].Blue(), m_colours[i].Alpha(), m_polygons[i], static_cast<unsigned char>(m_layers[i]) };
+
+		hash = HashRule(hash, m_rules[i]);
+		hash = HashBytes(hash, style, sizeof(style));
+	}
+
+	return hash;
+}
+
+unsigned RuleSet::GetMatch(IdObjectWithTags *o)
+{
+	// the render threads and the gui thread use it at the same time, with rule sets of different
+	// generations that store different values. the generation and the match are one word, so a
+	// relaxed atomic load always sees a pair that belongs together
+	wxUint32 cached = __atomic_load_n(&(o->m_ruleCache), __ATOMIC_RELAXED);
+
+	if ((cached >> RULEMATCHBITS) == m_generation)
+	{
+		return cached & RULEMATCHMASK;
+	}
+
+	unsigned match = MATCH_HIDDEN;
+
+	if (m_drawRule.Evaluate(o) != LogicalExpression::S_FALSE)
+	{
+		match = MATCH_DEFAULT;
+
+		for (int i = 0; i < m_num; i++)
+		{
+			if (m_rules[i].Evaluate(o) == LogicalExpression::S_TRUE)
+			{
+				match = MATCH_FIRST + i;
+				break; // stop after first match
+			}
+		}
+	}
+
+	__atomic_store_n(&(o->m_ruleCache), (m_generation << RULEMATCHBITS) | match, __ATOMIC_RELAXED);
+
+	return match;
+}
+
+bool RuleSet::GetStyle(IdObjectWithTags *o, wxColour *colour, bool *polygon, int *layer)
+{
+	unsigned match = GetMatch(o);
+
+	if (match == MATCH_HIDDEN)
+	{
+		return false;
+	}
+
+	if (match == MATCH_DEFAULT)
+	{
+		*colour = wxColour(150,150,150);
+		*polygon = false;
+		*layer = 1;
+	}
+	else
+	{
+		int i = match - MATCH_FIRST;
+
+		*colour = m_colours[i];
+		*polygon = m_polygons[i];
+		*layer = m_layers[i];
+	}
+
+	return true;
+}
+
 
 
 void ColorRules::Add()
@@ -121,6 +273,8 @@ void ColorRules::Add()
 
 	m_parent->FitInside();
 	m_num++;
+
+	RuleSet::RulesChanged();
 }
 
 void ColorRules::Remove(int number)
@@ -156,6 +310,9 @@ void ColorRules::Remove(int number)
 		m_rules[i] = m_rules[i+1];
 		m_layers[i] = m_layers[i+1];
 	}
+
+	// the rules after it moved up
+	RuleSet::RulesChanged();
 }
 
 void ColorRules::Save(wxString const &name)
@@ -29,6 +29,11 @@ class RuleControl
 
 		LogicalExpression::STATE Evaluate(IdObjectWithTags *o);
 
+		Rule const &GetRule()
+		{
+			return m_rule;
+		}
+
 		void Save(wxString const &group);
 		void Load(wxString const &group);
 
@@ -176,6 +181,58 @@ class ColorRules
 };
 
 
+// a copy of the draw rule and the colour rules as they are in the controls. the render threads use
+// this, so they don't touch the gui while the user edits the rules
+class RuleSet
+{
+	public:
+		// call on the gui thread. both can be NULL
+		RuleSet(RuleControl *drawRule, ColorRules *colorRules);
+		~RuleSet();
+
+		// how to draw o. returns false if o is not drawn at all
+		bool GetStyle(IdObjectWithTags *o, wxColour *colour, bool *polygon, int *layer);
+
+		bool IsDrawn(IdObjectWithTags *o)
+		{
+			return GetMatch(o) != MATCH_HIDDEN;
+		}
+
+		// changes whenever the rules would draw something differently
+		wxUint32 GetHash();
+
+		// which rule matches an object is cached in the object, per generation of the rules. call
+		// this when the text of a rule changes, or rules are added or removed. colours, polygons and
+		// layers are looked up per rule, so changing those doesn't need it
+		static void RulesChanged();
+
+		// false if the rules changed since this set was made
+		bool IsCurrent();
+
+		enum
+		{
+			MATCH_HIDDEN,
+			MATCH_DEFAULT,
+			// colour rule i is MATCH_FIRST + i
+			MATCH_FIRST
+		};
+
+		// which rule decides how o is drawn, objects with the same match look the same. evaluates
+		// the rules for o, unless that was done already for this generation
+		unsigned GetMatch(IdObjectWithTags *o);
+
+	private:
+		wxUint32 m_generation;
+
+		Rule m_drawRule;
+
+		int m_num;
+		Rule *m_rules;
+		wxColour *m_colours;
+		bool *m_polygons;
+		int *m_layers;
+};
+
 class AddButton
 	: public wxButton
 {
@@ -200,15 +200,20 @@ LogicalExpression *ExpressionParser::ParseSingle(char const *f, int *pos, char *
 			ret = tag;
 			if (value)	// if we had one value, try to see if there are more values specified and build an "or" expression of multiple tags if we do
 			{
+				// the string buffers get reused, and the tag can't give its key back if the value
+				// isn't in the data
+				char keyCopy[1024];
+				strcpy(keyCopy, key);
+
 				value = ParseString(f, &p,logError, maxLogErrorSize, errorPos);
 				if (value)
 				{
 					LogicalExpression *orExpr = new Or;
-					LogicalExpression *orChildren = static_cast<LogicalExpression *>(ListObject::Concat(tag, new Tag(tag->Key(), value)));
+					LogicalExpression *orChildren = static_cast<LogicalExpression *>(ListObject::Concat(tag, new Tag(keyCopy, value)));
 
 					while ((value = ParseString(f, &p,logError, maxLogErrorSize, errorPos)))
 					{
-						orChildren = static_cast<LogicalExpression *>(ListObject::Concat(orChildren, new Tag(tag->Key(), value)));
+						orChildren = static_cast<LogicalExpression *>(ListObject::Concat(orChildren, new Tag(keyCopy, value)));
 					}
 
 					orExpr->AddChildren(orChildren);
@@ -300,3 +305,360 @@ LogicalExpression *ExpressionParser::ParseSingle(char const *f, int *pos, char *
 
 }
 
+
+void And::Compile(RuleProgram *program)
+{
+	if (m_disabled)
+	{
+		program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+		return;
+	}
+
+	unsigned numSteps = 0;
+	for (LogicalExpression *l = m_children; l; l = static_cast<LogicalExpression *>(l->m_next))
+	{
+		numSteps++;
+	}
+
+	unsigned *steps = new unsigned[numSteps ? numSteps : 1];
+	numSteps = 0;
+
+	for (LogicalExpression *l = m_children; l; l = static_cast<LogicalExpression *>(l->m_next))
+	{
+		if (!l->m_disabled)
+		{
+			unsigned start = program->GetSize();
+			l->Compile(program);
+			steps[numSteps] = program->Combine(start, numSteps ? RuleProgram::C_AND : RuleProgram::C_FIRSTAND);
+			numSteps++;
+		}
+	}
+
+	// no children is the same as all ignored
+	if (!numSteps)
+	{
+		program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+	}
+
+	// a false child jumps past the end
+	for (unsigned i = 0; i < numSteps; i++)
+	{
+		program->SetJump(steps[i], program->GetSize());
+	}
+
+	delete [] steps;
+}
+
+void Or::Compile(RuleProgram *program)
+{
+	if (m_disabled)
+	{
+		program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+		return;
+	}
+
+	unsigned numChildren = 0;
+	for (LogicalExpression *l = m_children; l; l = static_cast<LogicalExpression *>(l->m_next))
+	{
+		numChildren++;
+	}
+
+	unsigned *steps = new unsigned[numChildren ? numChildren : 1];
+	unsigned numSteps = 0;
+
+	// the order of the children doesn't change the result, so the enabled tags with a value are
+	// taken out and grouped by key. (tag "key" "value" "value" ...) is parsed into such an or
+	TagIndex *tags = new TagIndex[numChildren ? numChildren : 1];
+	unsigned numTags = 0;
+
+	for (LogicalExpression *l = m_children; l; l = static_cast<LogicalExpression *>(l->m_next))
+	{
+		Tag *t = dynamic_cast<Tag *>(l);
+
+		if (l->m_disabled)
+		{
+			continue;
+		}
+
+		if (t && t->Index().Valid() && t->Index().m_valueIndex)
+		{
+			// insertion sort on key, rules are short
+			TagIndex index = t->Index();
+			unsigned i = numTags++;
+
+			for (; i > 0 && tags[i - 1].m_keyIndex > index.m_keyIndex; i--)
+			{
+				tags[i] = tags[i - 1];
+			}
+
+			tags[i] = index;
+		}
+		else
+		{
+			unsigned start = program->GetSize();
+			l->Compile(program);
+			steps[numSteps] = program->Combine(start, numSteps ? RuleProgram::C_OR : RuleProgram::C_FIRSTOR);
+			numSteps++;
+		}
+	}
+
+	unsigned *values = new unsigned[numTags ? numTags : 1];
+
+	for (unsigned i = 0; i < numTags; )
+	{
+		unsigned n = 0;
+		unsigned key = tags[i].m_keyIndex;
+
+		for (; i < numTags && tags[i].m_keyIndex == key; i++)
+		{
+			values[n++] = tags[i].m_valueIndex;
+		}
+
+		unsigned start = program->GetSize();
+
+		if (n == 1)
+		{
+			program->Emit(RuleProgram::OP_TAG, TagIndex::Create(key, values[0]));
+		}
+		else
+		{
+			program->EmitTagSet(key, values, n);
+		}
+
+		steps[numSteps] = program->Combine(start, numSteps ? RuleProgram::C_OR : RuleProgram::C_FIRSTOR);
+		numSteps++;
+	}
+
+	if (!numSteps)
+	{
+		program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+	}
+
+	// a true child jumps past the end
+	for (unsigned i = 0; i < numSteps; i++)
+	{
+		program->SetJump(steps[i], program->GetSize());
+	}
+
+	delete [] values;
+	delete [] tags;
+	delete [] steps;
+}
+
+RuleProgram::RuleProgram()
+{
+	m_size = 0;
+	m_maxSize = 16;
+	m_code = new Instruction[m_maxSize];
+	m_setsSize = 0;
+	m_setsMaxSize = 0;
+	m_sets = NULL;
+	m_depth = m_maxDepth = 0;
+}
+
+RuleProgram::~RuleProgram()
+{
+	delete [] m_code;
+	delete [] m_sets;
+}
+
+RuleProgram *RuleProgram::Compile(LogicalExpression *expression)
+{
+	RuleProgram *ret = new RuleProgram;
+
+	expression->Compile(ret);
+
+	if (ret->m_maxDepth > MAXRULESTACK)
+	{
+		delete ret;
+		return NULL;
+	}
+
+	return ret;
+}
+
+unsigned RuleProgram::Emit(OPCODE op, unsigned arg)
+{
+	return Emit(op, TagIndex::CreateInvalid(), arg);
+}
+
+unsigned RuleProgram::Emit(OPCODE op, TagIndex tag, unsigned arg)
+{
+	if (m_size >= m_maxSize)
+	{
+		Instruction *code = new Instruction[m_maxSize * 2];
+
+		memcpy(code, m_code, m_size * sizeof(Instruction));
+		delete [] m_code;
+		m_code = code;
+		m_maxSize *= 2;
+	}
+
+	m_code[m_size].m_op = op;
+	m_code[m_size].m_combine = C_PUSH;
+	m_code[m_size].m_negate = false;
+	m_code[m_size].m_tag = tag;
+	m_code[m_size].m_arg = arg;
+	m_code[m_size].m_jump = 0;
+
+	if (op != OP_POP)
+	{
+		m_depth++;
+	}
+
+	if (m_depth > m_maxDepth)
+	{
+		m_maxDepth = m_depth;
+	}
+
+	return m_size++;
+}
+
+unsigned RuleProgram::Combine(unsigned start, COMBINE how)
+{
+	unsigned ret = IsSingle(start) ? start : Emit(OP_POP);
+
+	m_code[ret].m_combine = how;
+
+	// the pushed state goes into the one below it instead
+	if (how == C_AND || how == C_OR)
+	{
+		m_depth--;
+	}
+
+	return ret;
+}
+
+void RuleProgram::Negate(unsigned start)
+{
+	unsigned i = IsSingle(start) ? start : Emit(OP_POP);
+
+	m_code[i].m_negate = !m_code[i].m_negate;
+}
+
+unsigned RuleProgram::EmitTagSet(unsigned keyIndex, unsigned const *values, unsigned num)
+{
+	unsigned maxValue = 0;
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		if (values[i] > maxValue)
+		{
+			maxValue = values[i];
+		}
+	}
+
+	unsigned numWords = maxValue / 32 + 1;
+
+	if (m_setsSize + numWords + 1 > m_setsMaxSize)
+	{
+		unsigned size = (m_setsSize + numWords + 1) * 2;
+		wxUint32 *sets = new wxUint32[size];
+
+		if (m_sets)
+		{
+			memcpy(sets, m_sets, m_setsSize * sizeof(wxUint32));
+			delete [] m_sets;
+		}
+
+		m_sets = sets;
+		m_setsMaxSize = size;
+	}
+
+	unsigned offset = m_setsSize;
+	wxUint32 *set = m_sets + offset;
+
+	set[0] = numWords;
+	memset(set + 1, 0, numWords * sizeof(wxUint32));
+
+	for (unsigned i = 0; i < num; i++)
+	{
+		set[1 + values[i] / 32] |= 1u << (values[i] % 32);
+	}
+
+	m_setsSize += numWords + 1;
+
+	return Emit(OP_TAGSET, TagIndex::Create(keyIndex), offset);
+}
+
+LogicalExpression::STATE RuleProgram::Run(IdObjectWithTags *o) const
+{
+	static LogicalExpression::STATE const negate[] = { LogicalExpression::S_TRUE, LogicalExpression::S_FALSE, LogicalExpression::S_IGNORE, LogicalExpression::S_INVALID };
+
+	LogicalExpression::STATE stack[MAXRULESTACK];
+	int sp = 0;
+	TagList const &tags = o->m_tags;
+
+	for (unsigned pc = 0; pc < m_size; pc++)
+	{
+		Instruction const &in = m_code[pc];
+		LogicalExpression::STATE s;
+
+		switch(in.m_op)
+		{
+			case OP_PUSH:
+				s = static_cast<LogicalExpression::STATE>(in.m_arg);
+				break;
+			case OP_TAG:
+				s = tags.Has(in.m_tag) ? LogicalExpression::S_TRUE : LogicalExpression::S_FALSE;
+				break;
+			case OP_TAGSET:
+				s = tags.HasValueIn(in.m_tag.m_keyIndex, m_sets + in.m_arg + 1, m_sets[in.m_arg]) ? LogicalExpression::S_TRUE : LogicalExpression::S_FALSE;
+				break;
+			default:
+				s = stack[--sp];
+				break;
+		}
+
+		if (in.m_negate)
+		{
+			s = negate[s];
+		}
+
+		switch(in.m_combine)
+		{
+			case C_PUSH:
+				stack[sp++] = s;
+				break;
+			case C_AND:
+				if (s == LogicalExpression::S_FALSE)
+				{
+					stack[sp - 1] = LogicalExpression::S_FALSE;
+					pc = in.m_jump - 1;
+				}
+				else if (s == LogicalExpression::S_TRUE)
+				{
+					stack[sp - 1] = LogicalExpression::S_TRUE;
+				}
+				break;
+			case C_OR:
+				if (s == LogicalExpression::S_TRUE)
+				{
+					stack[sp - 1] = LogicalExpression::S_TRUE;
+					pc = in.m_jump - 1;
+				}
+				else if (s == LogicalExpression::S_FALSE)
+				{
+					stack[sp - 1] = LogicalExpression::S_FALSE;
+				}
+				break;
+			// the first value of an and or or is what it is so far, children are never invalid
+			case C_FIRSTAND:
+				stack[sp++] = s;
+				if (s == LogicalExpression::S_FALSE)
+				{
+					pc = in.m_jump - 1;
+				}
+				break;
+			case C_FIRSTOR:
+				stack[sp++] = s;
+				if (s == LogicalExpression::S_TRUE)
+				{
+					pc = in.m_jump - 1;
+				}
+				break;
+		}
+	}
+
+	return stack[0];
+}
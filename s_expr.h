@@ -19,6 +19,8 @@
 
 #include "osm.h"
 
+class RuleProgram;
+
 class LogicalExpression
 	: public ListObject
 {
@@ -50,6 +52,95 @@ class LogicalExpression
 		bool m_disabled;
 		LogicalExpression *m_children;
 		virtual STATE GetValue(IdObjectWithTags *o) = 0;
+
+		// appends code to program that leaves the value of this expression on its stack
+		virtual void Compile(RuleProgram *program) = 0;
+};
+
+// a rule compiled to a flat list of instructions over tag indices, which run on a small stack of
+// states. gives the same results as LogicalExpression::GetValue(), without the virtual calls and
+// list walking, and with the values of (tag "key" "value" "value" ...) looked up in a bitset
+#define MAXRULESTACK 64
+
+class RuleProgram
+{
+	public:
+		// every instruction gets a state, optionally negates it, and then combines it with the stack
+		enum OPCODE
+		{
+			OP_PUSH,   // the state m_arg
+			OP_TAG,    // whether the object has m_tag
+			OP_TAGSET, // whether the object has key m_tag with one of the values in the bitset at m_arg
+			OP_POP     // the state on top of the stack, which is removed
+		};
+
+		enum COMBINE
+		{
+			C_PUSH,      // push it
+			C_AND,       // and it into the top. on false jump to m_jump
+			C_OR,        // or it into the top. on true jump to m_jump
+			C_FIRSTAND,  // push it, as the first value of an and. on false jump to m_jump
+			C_FIRSTOR    // push it, as the first value of an or. on true jump to m_jump
+		};
+
+		// returns NULL if the expression nests too deep for the stack
+		static RuleProgram *Compile(LogicalExpression *expression);
+
+		~RuleProgram();
+
+		LogicalExpression::STATE Run(IdObjectWithTags *o) const;
+
+		// for LogicalExpression::Compile(). return the position of the instruction
+		unsigned Emit(OPCODE op, unsigned arg = 0);
+		unsigned Emit(OPCODE op, TagIndex tag, unsigned arg = 0);
+		// values are value indices, as in TagIndex
+		unsigned EmitTagSet(unsigned keyIndex, unsigned const *values, unsigned num);
+
+		// combine the value of the code from start on with the state below it. if that is a
+		// single instruction it does the combining itself, otherwise a pop is added. returns the
+		// position of the instruction that may jump
+		unsigned Combine(unsigned start, COMBINE how);
+		// negate the value of the code from start on
+		void Negate(unsigned start);
+
+		// the position the next instruction will get
+		unsigned GetSize()
+		{
+			return m_size;
+		}
+
+		void SetJump(unsigned instruction, unsigned target)
+		{
+			m_code[instruction].m_jump = target;
+		}
+
+	private:
+		RuleProgram();
+
+		// the code from start on is one instruction that only pushes
+		bool IsSingle(unsigned start)
+		{
+			return start + 1 == m_size && m_code[start].m_combine == C_PUSH;
+		}
+
+		struct Instruction
+		{
+			unsigned char m_op;
+			unsigned char m_combine;
+			bool m_negate;
+			TagIndex m_tag;
+			unsigned m_arg;
+			unsigned m_jump;
+		};
+
+		Instruction *m_code;
+		unsigned m_size, m_maxSize;
+
+		// per set: the number of words, then the bits
+		wxUint32 *m_sets;
+		unsigned m_setsSize, m_setsMaxSize;
+
+		int m_depth, m_maxDepth;
 };
 
 class Not
@@ -67,6 +158,19 @@ class Not
 			return states[s];
 		}
 
+		void Compile(RuleProgram *program)
+		{
+			if (m_disabled)
+			{
+				program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+				return;
+			}
+
+			unsigned start = program->GetSize();
+			m_children->Compile(program);
+			program->Negate(start);
+		}
+
 };
 
 class And
@@ -96,6 +200,8 @@ class And
 			return trueCount ? S_TRUE : S_IGNORE;
 		}
 
+		void Compile(RuleProgram *program);
+
 };
 
 class Or
@@ -131,6 +237,8 @@ class Or
 			return falseCount ? S_FALSE : S_IGNORE;
 		}
 
+		void Compile(RuleProgram *program);
+
 };
 
 
@@ -139,13 +247,8 @@ class Tag
 {
 	public:
 		Tag(char const *key, char const *value)
+			: m_tag(true, key, value)
 		{
-			m_tag = new OsmTag(true, key, value);
-		}
-
-		~Tag()
-		{
-			delete m_tag;
 		}
 
 //		bool Valid()
@@ -155,17 +258,33 @@ class Tag
 
 		char const *Key() const
 		{
-			return m_tag->GetKey();
+			return m_tag.GetKey();
 		}
 
 		STATE GetValue(IdObjectWithTags *o)
 		{
 			if (m_disabled)
 				return S_IGNORE;
-			return o->HasTag(*m_tag) ? S_TRUE : S_FALSE;
+			return o->HasTag(m_tag) ? S_TRUE : S_FALSE;
+		}
+
+		TagIndex Index()
+		{
+			return m_tag.Index();
+		}
+
+		void Compile(RuleProgram *program)
+		{
+			if (m_disabled)
+			{
+				program->Emit(RuleProgram::OP_PUSH, S_IGNORE);
+				return;
+			}
+
+			program->Emit(RuleProgram::OP_TAG, m_tag.Index());
 		}
 	private:
-		OsmTag *m_tag;
+		OsmTag m_tag;
 
 };
 
@@ -257,18 +376,21 @@ class Rule
 		Rule(wxString const &text, RuleDisplay *display = NULL)
 		{
 			m_expr = NULL;
+			m_program = NULL;
 			SetRule(text, display);
 		}
 	
 		Rule()
 		{
 			m_expr = NULL;
+			m_program = NULL;
 			m_errorPos = 0;
 		}
 
 		Rule(Rule const &other)
 		{
 			m_expr = NULL;
+			m_program = NULL;
 			Create(other);
 		}
 
@@ -282,11 +404,14 @@ class Rule
 		~Rule()
 		{
 			delete m_expr;
+			delete m_program;
 		}
 		// set a new ruletext. returns true if the text is a valid expression
 		bool SetRule(wxString const &text, RuleDisplay *display = NULL)
 		{
 			delete m_expr;
+			delete m_program;
+			m_program = NULL;
 			m_text = text;
 
 			char errorLog[1024] = {0};
@@ -294,11 +419,21 @@ class Rule
 
 			m_errorLog = wxString::FromUTF8(errorLog);
 
+			if (m_expr)
+			{
+				m_program = RuleProgram::Compile(m_expr);
+			}
+
 			return m_expr;
 		}
 
 
 		bool IsValid() { return m_expr; }
+
+		wxString const &GetText() const
+		{
+			return m_text;
+		}
 		
 		wxString const &GetErrorLog()
 		{
@@ -317,8 +452,27 @@ class Rule
 				return LogicalExpression::S_INVALID;
 			}
 
+			if (m_program)
+			{
+				return m_program->Run(o);
+			}
+
 			return m_expr->GetValue(o);
 		}
+
+		// like Evaluate(), but always walks the expression tree. for checking the compiled program
+		LogicalExpression::STATE EvaluateTree(IdObjectWithTags *o)
+		{
+			if (!m_expr)
+			{
+				return LogicalExpression::S_INVALID;
+			}
+
+			return m_expr->GetValue(o);
+		}
+
+		// false if the rule nests too deep to compile, Evaluate() then walks the tree too
+		bool IsCompiled() { return m_program; }
 	private:
 		void Create(Rule const &other)
 		{
@@ -326,6 +480,8 @@ class Rule
 		}
 		
 		LogicalExpression *m_expr;
+		// m_expr compiled, if it wasn't too deep
+		RuleProgram *m_program;
 		wxString m_text;
 		wxString m_errorLog;
 		unsigned int m_errorPos;
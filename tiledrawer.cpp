@@ -4,6 +4,106 @@
 #include "tiledrawer.h"
 #include "rulecontrol.h"
 
+// a tile is split when it has more ways than this, unless it is at the maximum depth already
+#define MAXTILEWAYS 256
+#define MAXTILEDEPTH 24
+
+// bands per worker thread, so threads that finish early can take another one
+#define BANDSPERTHREAD 2
+#define MINBANDHEIGHT 32
+
+// only the view has the layer above the map for the selection, the raster tiles leave it out
+static bool HasOverlay(Renderer *r)
+{
+	return r->SupportsLayers() && r->GetNumLayers() > NUMLAYERS;
+}
+
+// how far outside its nodes a line of width 1 can draw, in pixels. miter joins reach furthest
+#define CULLMARGIN 8
+
+class BandJob
+	: public WorkerJob
+{
+	public:
+		BandJob(TileDrawer *drawer, RenderJob *job, Renderer *band, int x, int y)
+		{
+			m_drawer = drawer;
+			m_job = job;
+			m_band = band;
+			m_x = x;
+			m_y = y;
+			m_pasted = false;
+		}
+
+		~BandJob()
+		{
+			delete m_band;
+		}
+
+		void Run()
+		{
+			m_drawer->RenderBand(m_job, m_band);
+		}
+
+		Renderer *m_band;
+		int m_x, m_y;
+		bool m_pasted;
+
+	private:
+		TileDrawer *m_drawer;
+		RenderJob *m_job;
+};
+
+void RenderJob::Init(Renderer *renderer, int x, int y, int w, int h)
+{
+	DRect vp = renderer->GetViewport();
+	double pw = vp.m_w / renderer->GetWidth();
+	double ph = vp.m_h / renderer->GetHeight();
+
+	m_x = x;
+	m_y = y;
+	m_w = w;
+	m_h = h;
+	// pixel rows count from the top, latitudes from the bottom
+	m_bb = DRect(vp.m_x + x * pw, vp.m_y + (renderer->GetHeight() - y - h) * ph, w * pw, h * ph);
+	m_cullBB = m_bb.Grow(CULLMARGIN * pw, CULLMARGIN * ph);
+	m_curLayer = renderer->SupportsLayers() ? -1 : 0;
+	m_visibleTiles = m_curTile = NULL;
+	m_numTilesToRender = m_numTilesRendered = 0;
+	m_finished = false;
+	m_renderer = renderer;
+	// the simplified geometry is good enough when its error stays below a pixel
+	m_lod = OsmWay::GetLodBand(ph);
+	m_ruleSet = NULL;
+	m_bands = NULL;
+	m_numBands = m_numBandsDone = 0;
+	m_pool = NULL;
+	m_cancel = false;
+}
+
+RenderJob::~RenderJob()
+{
+	if (m_bands)
+	{
+		m_cancel = true;
+
+		for (int i = 0; i < m_numBands; i++)
+		{
+			m_pool->Wait(m_bands[i]);
+			delete m_bands[i];
+		}
+
+		delete [] m_bands;
+	}
+
+	delete m_ruleSet;
+
+	if (m_visibleTiles)
+	{
+		m_visibleTiles->UnRef();
+	}
+}
+
 TileWay::TileWay(OsmWay *way, TileWay *next)
 	: ListObject(next)
 {
@@ -15,7 +115,7 @@ TileWay::~TileWay()
 }
 
 
-TileWay *OsmTile::GetWaysContainingNode(OsmNode *node)
+TileWay *OsmTile::GetWaysContainingNode(unsigned node)
 {
 	TileWay *ret = NULL;
 
@@ -31,52 +131,207 @@ TileWay *OsmTile::GetWaysContainingNode(OsmNode *node)
 }
 
 
-TileDrawer::TileDrawer(double minLon,double minLat, double maxLon, double maxLat, double dLon, double dLat)
+OsmTile *OsmTile::FindChild(DRect const &bb)
 {
-	m_tiles = NULL;
+	// the only child that can contain it is the one its center is in
+	int i = 0;
 
-	m_selection = NULL;
+	if (bb.m_x + bb.m_w / 2 >= m_cell.m_x + m_cell.m_w / 2)
+	{
+		i += 1;
+	}
+
+	if (bb.m_y + bb.m_h / 2 >= m_cell.m_y + m_cell.m_h / 2)
+	{
+		i += 2;
+	}
+
+	OsmTile *c = m_children[i];
+
+	if (bb.m_x >= c->m_x && bb.Right() <= c->Right() && bb.m_y >= c->m_y && bb.Top() <= c->Top())
+	{
+		return c;
+	}
+
+	return NULL;
+}
+
+
+TileDrawer::TileDrawer(NodeStore *nodes, double minLon,double minLat, double maxLon, double maxLat)
+{
+	m_nodes = nodes;
+
+	m_selection = NODE_INVALID;
 	m_selectionColor = wxColour(255,0,0);
 	m_selectedWay = NULL;
 
 	m_drawRule = NULL;
 	m_colorRules = NULL;
+	m_pickRules = NULL;
+
+	// tiles need a size to be split
+	if (maxLon - minLon < 1e-6)
+	{
+		maxLon = minLon + 1e-6;
+	}
+
+	if (maxLat - minLat < 1e-6)
+	{
+		maxLat = minLat + 1e-6;
+	}
+
+	m_numTiles = 0;
+	m_root = m_tiles = new OsmTile(m_numTiles++, minLon, minLat, maxLon, maxLat, 0, NULL);
+}
+
+TileDrawer::~TileDrawer()
+{
+	delete m_pickRules;
+	m_tiles->DestroyList();
+}
+
+void TileDrawer::SetDrawRuleControl(RuleControl *r)
+{
+	m_drawRule = r;
+	RuleSet::RulesChanged();
+}
+
+void TileDrawer::SetColorRules(ColorRules *r)
+{
+	m_colorRules = r;
+	RuleSet::RulesChanged();
+}
 
-	m_xNum = static_cast<int>((maxLon - minLon) / dLon) + 1;
-	m_yNum = static_cast<int>((maxLat - minLat) / dLat) + 1;
-	m_minLon = minLon;
-	m_w = m_xNum * dLon;
-	m_minLat = minLat;
-	m_h = m_yNum *dLat;
-	m_dLon = dLon;
-	m_dLat = dLat;
-	unsigned id = 0;
-	// build a list of empty tiles;
-	m_tileArray = new OsmTile **[m_xNum];
-	for (unsigned x = 0; x < m_xNum; x++)
-	{
-		m_tileArray[x] = new OsmTile *[m_yNum];
-		for (unsigned y = 0; y < m_yNum; y++)
+void TileDrawer::AddWay(OsmWay *way, DRect const &bb)
+{
+	DRect b = bb;
+
+	// a way without nodes can't be drawn or selected
+	if (b.IsEmpty())
+	{
+		return;
+	}
+
+	OsmTile *t = m_root;
+
+	if (b.m_x < t->m_x || b.Right() > t->Right() || b.m_y < t->m_y || b.Top() > t->Top())
+	{
+		// outside of the data bounds. keep it in the root, and make sure queries still find it
+		*static_cast<DRect *>(t) = t->Add(b);
+	}
+	else
+	{
+		while (t->IsSplit())
 		{
-			m_tiles = new OsmTile(id++, m_minLon + x * dLon , m_minLat + y * dLat, m_minLon + (x + 1) * dLon, m_minLat + (y+1) * dLat, m_tiles);
-			m_tileArray[x][y] = m_tiles;
+			OsmTile *c = t->FindChild(b);
+
+			if (!c)
+			{
+				break;
+			}
+
+			t = c;
 		}
 	}
- }
 
+	way->SetBB(bb);
+	t->AddWay(&m_arena, way);
+
+	if (!t->IsSplit() && t->m_numWays > MAXTILEWAYS && t->m_depth < MAXTILEDEPTH)
+	{
+		Split(t);
+	}
+}
+
+void TileDrawer::Split(OsmTile *tile)
+{
+	DRect const &c = tile->m_cell;
+	double w = c.m_w / 2;
+	double h = c.m_h / 2;
+
+	for (int i = 0; i < 4; i++)
+	{
+		double x = c.m_x + (i & 1) * w;
+		double y = c.m_y + (i >> 1) * h;
+
+		m_tiles = new OsmTile(m_numTiles++, x, y, x + w, y + h, tile->m_depth + 1, m_tiles);
+		tile->m_children[i] = m_tiles;
+	}
+
+	// relink the ways that fit in a child. the ones that don't stay here
+	TileWay *way = tile->m_ways;
+	tile->m_ways = NULL;
+	tile->m_numWays = 0;
+
+	while (way)
+	{
+		TileWay *next = static_cast<TileWay *>(way->m_next);
+		OsmTile *to = tile->FindChild(way->m_way->GetBB(m_nodes));
+
+		if (!to)
+		{
+			to = tile;
+		}
+
+		way->m_next = to->m_ways;
+		to->m_ways = way;
+		to->m_numWays++;
+
+		way = next;
+	}
+
+	for (int i = 0; i < 4; i++)
+	{
+		OsmTile *child = tile->m_children[i];
+
+		if (child->m_numWays > MAXTILEWAYS && child->m_depth < MAXTILEDEPTH)
+		{
+			Split(child);
+		}
+	}
+}
+
+
+static int CompareStyledWays(void const *a, void const *b)
+{
+	StyledWay const *wa = static_cast<StyledWay const *>(a);
+	StyledWay const *wb = static_cast<StyledWay const *>(b);
+
+	if (wa->m_match != wb->m_match)
+	{
+		return wa->m_match < wb->m_match ? -1 : 1;
+	}
+
+	return wa->m_order < wb->m_order ? -1 : (wa->m_order > wb->m_order ? 1 : 0);
+}
+
+static void SortStyledWays(StyledWay *ways, unsigned num)
+{
+	qsort(ways, num, sizeof(StyledWay), CompareStyledWays);
+}
 
 bool TileDrawer::RenderTiles(RenderJob *job, int maxNumToRender)
 {
 	bool mustCancel = false;
 
+	if (!job->m_ruleSet)
+	{
+		job->m_ruleSet = new RuleSet(m_drawRule, m_colorRules);
+		StartBands(job);
+	}
+
+	if (job->m_bands)
+	{
+		return PollBands(job);
+	}
 
 	if (!job->m_visibleTiles)
 	{
-		job->m_visibleTiles = GetTiles(job->m_bb);
+		job->m_visibleTiles = GetTiles(job->m_bb, job->m_lod >= 0 ? OsmWay::GetLodTolerance(job->m_lod) : 0);
 
 		job->m_curTile = job->m_visibleTiles;
 
-		job->m_numTilesToRender = job->m_visibleTiles->GetSize();
+		job->m_numTilesToRender = job->m_visibleTiles ? job->m_visibleTiles->GetSize() : 0;
 		job->m_numTilesRendered = 0;
 	}
 
@@ -86,23 +341,30 @@ bool TileDrawer::RenderTiles(RenderJob *job, int maxNumToRender)
 		return true;
 	}
 
+	unsigned maxWays = 256;
+	StyledWay *ways = new StyledWay[maxWays];
+
 	int count = 0;
 	while (job->m_curTile && !mustCancel && (count++ < maxNumToRender))
 	{
 		OsmTile *t = job->m_curTile->m_tile;
-		if (job->m_curLayer < 0)
+		if (job->m_curLayer < 0 && HasOverlay(job->m_renderer))
 		{
 			Rect(job->m_renderer, wxEmptyString, *t, -1, 0,255,255, 200, NUMLAYERS);
 		}
 		
 		if (t->OverLaps(job->m_bb))
 		{
-			for (TileWay *w = t->m_ways; w && !mustCancel; w = static_cast<TileWay *>(w->m_next))
+			// every way is in one tile only, and has one layer, so it is drawn once without
+			// having to remember what was drawn
+			unsigned numWays = 0;
+
+			AddStyledWays(job, t, job->m_cullBB, &ways, &numWays, &maxWays);
+			SortStyledWays(ways, numWays);
+
+			for (unsigned i = 0; i < numWays; i++)
 			{
-				if (!(job->m_renderedIds.Has(w->m_way->m_id)))
-				{
-					RenderWay(job, w->m_way);
-				}
+				RenderWay(job, ways[i].m_way);
 			}	// for way
 		}  // if overlaps
 
@@ -120,6 +382,8 @@ bool TileDrawer::RenderTiles(RenderJob *job, int maxNumToRender)
 		mustCancel = job->MustCancel(progress);
 	}	 // while curTile
 
+	delete [] ways;
+
 	if (!job->m_curTile && job->m_curLayer >= 0)
 	{
 		job->m_curLayer++;
@@ -143,89 +407,212 @@ void TileDrawer::Rect(Renderer *renderer, wxString const &text, double lon1, dou
 	renderer->DrawCenteredText(text.mb_str(wxConvUTF8), (lon1 + lon2)/2, (lat1 + lat2)/2, 0, r, g, b, a,  layer);
 }
 
-// render using default colours. should plug in rule engine here
-void TileDrawer::RenderWay(RenderJob *job, OsmWay *w)
+bool TileDrawer::StartBands(RenderJob *job)
 {
-	bool draw = true;
+	if (job->m_curLayer >= 0)
+	{
+		// the bands are pasted layer by layer
+		return false;
+	}
+
+	int h = job->m_h;
+	int num = m_pool.GetNumThreads() * BANDSPERTHREAD;
+
+	if (num > h / MINBANDHEIGHT)
+	{
+		num = h / MINBANDHEIGHT;
+	}
 
-	if (m_drawRule && (m_drawRule->Evaluate(w) == LogicalExpression::S_FALSE))
+	if (num < 1)
 	{
-		draw = false;
+		num = 1;
 	}
 
-	if (draw)
+	BandJob **bands = new BandJob *[num];
+
+	for (int i = 0; i < num; i++)
 	{
-		wxColour c = wxColour(150,150,150);
-		bool poly = false;
-		int layer = 1;
-		if (m_colorRules)
+		int y = job->m_y + i * h / num;
+		int bandH = job->m_y + (i + 1) * h / num - y;
+		Renderer *r = job->m_renderer->CreateBand(job->m_x, y, job->m_w, bandH);
+
+		if (!r)
 		{
-			for (int i = 0; i < m_colorRules->m_num; i++)
+			for (int j = 0; j < i; j++)
 			{
-				if (m_colorRules->m_rules[i]->Evaluate(w) == LogicalExpression::S_TRUE)
-				{
-					c = m_colorRules->m_pickers[i]->GetColour();
-					poly = m_colorRules->m_checkBoxes[i]->IsChecked();
-					layer = m_colorRules->m_layers[i]->GetSelection();
-					break; // stop after first match
-				}
+				delete bands[j];
 			}
+
+			delete [] bands;
+			return false;
 		}
 
-		if (job->m_curLayer < 0 || job->m_curLayer == layer)
+		bands[i] = new BandJob(this, job, r, job->m_x, y);
+	}
+
+	job->m_bands = bands;
+	job->m_numBands = num;
+	job->m_numBandsDone = 0;
+	job->m_pool = &m_pool;
+
+	for (int i = 0; i < num; i++)
+	{
+		m_pool.Add(bands[i]);
+	}
+
+	return true;
+}
+
+bool TileDrawer::PollBands(RenderJob *job)
+{
+	for (int i = 0; i < job->m_numBands; i++)
+	{
+		BandJob *b = job->m_bands[i];
+
+		if (!b->m_pasted && m_pool.IsDone(b))
 		{
-			RenderWay(job->m_renderer, w, c, poly, c, 1, job->m_curLayer <0 ? layer : 0);
-			job->m_renderedIds.Add(w->m_id);
+			job->m_renderer->PasteBand(b->m_band, b->m_x, b->m_y);
+			b->m_pasted = true;
+			job->m_numBandsDone++;
 		}
 	}
-}
 
+	if (job->MustCancel(static_cast<double>(job->m_numBandsDone) / job->m_numBands))
+	{
+		job->m_cancel = true;
+		job->m_finished = true;
+	}
+
+	DrawOverlay(job->m_renderer, true);
+
+	if (job->m_numBandsDone == job->m_numBands)
+	{
+		job->m_finished = true;
+	}
+
+	return job->m_finished;
+}
 
-void TileDrawer::RenderWay(Renderer *r, OsmWay *w, wxColour lineColour, bool poly, wxColour fillColour, int width, int layer)
+void TileDrawer::RenderBand(RenderJob *job, Renderer *band)
 {
+	DRect vp = band->GetViewport();
+	TileList *tiles = GetTiles(vp, job->m_lod >= 0 ? OsmWay::GetLodTolerance(job->m_lod) : 0);
+	DRect view = vp.Grow(CULLMARGIN * vp.m_w / band->GetWidth(), CULLMARGIN * vp.m_h / band->GetHeight());
 
+	unsigned numWays = 0, maxWays = 256;
+	StyledWay *ways = new StyledWay[maxWays];
 
-	r->SetLineWidth(width);
-	r->SetLineColor(lineColour.Red(), lineColour.Green(), lineColour.Blue());
-	r->SetFillColor(fillColour.Red(), fillColour.Green(), fillColour.Blue());
+	// every way is in one tile only, so there is nothing to deduplicate
+	for (TileList *t = tiles; t && !job->m_cancel; t = static_cast<TileList *>(t->m_next))
+	{
+		AddStyledWays(job, t->m_tile, view, &ways, &numWays, &maxWays);
+	}
+
+	SortStyledWays(ways, numWays);
 
-	if (!poly)
+	for (unsigned i = 0; i < numWays && !job->m_cancel; i++)
 	{
-		r->Begin(Renderer::R_LINE, layer);
-		for (unsigned j = 0; j < w->m_numResolvedNodes; j++)
+		wxColour c;
+		bool poly;
+		int layer;
+
+		if (job->m_ruleSet->GetStyle(ways[i].m_way, &c, &poly, &layer))
 		{
-			OsmNode *node = w->m_resolvedNodes[j];
-		
-			if (node)
-			{
-				r->AddPoint(node->Lon(), node->Lat());
-			}
-			else
-			{
-				r->End();
-				r->Begin(Renderer::R_LINE, layer);
-			}
-		
+			RenderWay(band, ways[i].m_way, c, poly, c, 1, layer, job->m_lod);
 		}
-		r->End();
 	}
-	else
+
+	// the last run of ways is stroked here, not on the gui thread when the band is pasted
+	band->Flush();
+
+	delete [] ways;
+
+	if (tiles)
 	{
-		r->Begin(Renderer::R_POLYGON, layer);
-		for (unsigned j = 0; j < w->m_numResolvedNodes; j++)
+		tiles->UnRef();
+	}
+}
+
+void TileDrawer::AddStyledWays(RenderJob *job, OsmTile *tile, DRect const &view, StyledWay **ways, unsigned *num, unsigned *max)
+{
+	for (TileWay *w = tile->m_ways; w; w = static_cast<TileWay *>(w->m_next))
+	{
+		OsmWay *way = w->m_way;
+		// the ways in the tiles have their bounding box already, so this is safe on the workers
+		DRect const &bb = way->GetBB(m_nodes);
+
+		// the tile overlaps the view, the way itself may not
+		if (bb.m_x > view.Right() || bb.Right() < view.m_x || bb.m_y > view.Top() || bb.Top() < view.m_y)
 		{
-			OsmNode *node = w->m_resolvedNodes[j];
-		
-			if (node)
-			{
-				r->AddPoint(node->Lon(), node->Lat());
-			}
-			
+			continue;
+		}
+
+		// too small to show at this level of detail
+		if (job->m_lod >= 0 && !way->m_numLodNodes[job->m_lod])
+		{
+			continue;
+		}
+
+		unsigned match = job->m_ruleSet->GetMatch(way);
+
+		if (match == RuleSet::MATCH_HIDDEN)
+		{
+			continue;
 		}
-		r->End();
+
+		if (*num >= *max)
+		{
+			StyledWay *n = new StyledWay[*max * 2];
+
+			memcpy(n, *ways, *num * sizeof(StyledWay));
+			delete [] *ways;
+			*ways = n;
+			*max *= 2;
+		}
+
+		(*ways)[*num].m_way = way;
+		(*ways)[*num].m_match = match;
+		(*ways)[*num].m_order = *num;
+		(*num)++;
 	}
 }
 
+// render using the colours of the rules
+void TileDrawer::RenderWay(RenderJob *job, OsmWay *w)
+{
+	// too small to show at this level of detail
+	if (job->m_lod >= 0 && !w->m_numLodNodes[job->m_lod])
+	{
+		return;
+	}
+
+	wxColour c;
+	bool poly;
+	int layer;
+
+	if (job->m_ruleSet->GetStyle(w, &c, &poly, &layer))
+	{
+		if (job->m_curLayer < 0 || job->m_curLayer == layer)
+		{
+			RenderWay(job->m_renderer, w, c, poly, c, 1, job->m_curLayer <0 ? layer : 0, job->m_lod);
+		}
+	}
+}
+
+
+void TileDrawer::RenderWay(Renderer *r, OsmWay *w, wxColour lineColour, bool poly, wxColour fillColour, int width, int layer, int lod)
+{
+	unsigned const *nodes;
+	unsigned numNodes = w->GetLodNodes(lod, &nodes);
+
+
+	r->SetLineWidth(width);
+	r->SetLineColor(lineColour.Red(), lineColour.Green(), lineColour.Blue());
+	r->SetFillColor(fillColour.Red(), fillColour.Green(), fillColour.Blue());
+
+	r->DrawNodes(poly ? Renderer::R_POLYGON : Renderer::R_LINE, layer, m_nodes, nodes, numNodes);
+}
+
 TileSpans *TileDrawer::GetTileSpans(TileList *all)
 {
 	TileSpans *ret = new TileSpans;
@@ -240,70 +627,69 @@ TileSpans *TileDrawer::GetTileSpans(TileList *all)
 	
 }
 
-void TileDrawer::LonLatToIndex(double lon, double lat, int *x, int *y)
+void TileDrawer::GetTiles(OsmTile *tile, DRect const &box, double minSize, TileList **list)
 {
-	if (x)
+	if (!tile->OverLaps(box) || (minSize > 0 && OsmWay::IsBelowTolerance(*tile, minSize)))
 	{
-		*x = static_cast<int>(floor((lon - m_minLon) / m_dLon));
-		if (*x < 0) *x = 0;
-		if (*x > static_cast<int>(m_xNum - 1)) *x = static_cast<int>(m_xNum - 1);
+		return;
 	}
 
-	if (y)
+	// empty tiles are left out
+	if (tile->m_ways)
 	{
-		*y = static_cast<int>(floor((lat - m_minLat) / m_dLat));
-	if (*y < 0) *y = 0;
-	if (*y > static_cast<int>(m_yNum - 1)) *y = static_cast<int>(m_yNum - 1);
+		*list = new TileList(tile, *list);
 	}
-}
-
-
-TileList *TileDrawer::GetTiles(double minLon, double minLat, double maxLon, double maxLat)
-{
-//            printf("gettiles (%g %g)-(%g-%g):\n", minLon, minLat, maxLon, maxLat);
-	int xMin = 0, xMax = 0, yMin = 0, yMax = 0;
-
-	LonLatToIndex(minLon, minLat, &xMin, &yMin);
-	LonLatToIndex(maxLon, maxLat, &xMax, &yMax);
-
-
-	TileList *ret = NULL;
 
-
-	for (int x = xMin; x <= xMax; x++)
+	if (tile->IsSplit())
 	{
-		for (int y = yMin; y <= yMax; y++)
+		for (int i = 0; i < 4; i++)
 		{
-			ret = new TileList(m_tileArray[x][y], ret);
+			GetTiles(tile->m_children[i], box, minSize, list);
 		}
 	}
+}
+
+TileList *TileDrawer::GetTiles(double minLon, double minLat, double maxLon, double maxLat, double minSize)
+{
+	TileList *ret = NULL;
+
+	GetTiles(m_root, DRect(minLon, minLat, maxLon - minLon, maxLat - minLat), minSize, &ret);
 
-	
 	if (ret)
 	{
 		ret->Ref();
 	}
 	
 	return ret;
+}
 
-	
+RuleSet *TileDrawer::GetPickRules()
+{
+	if (!m_pickRules || !m_pickRules->IsCurrent())
+	{
+		delete m_pickRules;
+		m_pickRules = new RuleSet(m_drawRule, m_colorRules);
+	}
+
+	return m_pickRules;
 }
 
-OsmNode *TileDrawer::GetClosestNodeInTile(int x, int y, double lon, double lat, double *foundDistSq)
+unsigned TileDrawer::GetClosestNodeInTile(OsmTile *tile, double lon, double lat, double *foundDistSq)
 {
+	RuleSet *rules = GetPickRules();
 	double fDSq = 0;
 	double shortest = -1;
-	OsmNode *found = NULL;
-	OsmNode *n;
+	unsigned found = NODE_INVALID;
+	unsigned n;
 
-	for (TileWay *t = m_tileArray[x][y]->m_ways; t; t = static_cast<TileWay *>(t->m_next))
+	for (TileWay *t = tile->m_ways; t; t = static_cast<TileWay *>(t->m_next))
 	{
 		OsmWay * w = t->m_way;
-		if (!m_drawRule || m_drawRule->Evaluate(w))
+		if (rules->IsDrawn(w))
 		{
-			n = w->GetClosestNode(lon,lat, &fDSq);
+			n = w->GetClosestNode(m_nodes, lon,lat, &fDSq);
 
-			if (shortest < 0.0 || fDSq < shortest)
+			if (n != NODE_INVALID && (shortest < 0.0 || fDSq < shortest))
 			{
 //				printf(" found %p distsq %f\n", n, fDSq);
 				shortest = fDSq;
@@ -321,14 +707,30 @@ OsmNode *TileDrawer::GetClosestNodeInTile(int x, int y, double lon, double lat,
 }
 
 
-OsmNode *TileDrawer::GetClosestNode(double lon, double lat)
+unsigned TileDrawer::GetClosestNode(double lon, double lat)
 {
-	int x =0, y = 0;
-	double distSq = -1;
+	double shortest = -1;
+	unsigned found = NODE_INVALID;
+
+	// every tile whose bounds contain the point
+	TileList *tiles = GetTiles(lon, lat, lon, lat);
+
+	for (TileList *l = tiles; l; l = static_cast<TileList *>(l->m_next))
+	{
+		double distSq = -1;
+		unsigned n = GetClosestNodeInTile(l->m_tile, lon, lat, &distSq);
 
-	LonLatToIndex(lon, lat, &x, &y);
+		if (n != NODE_INVALID && (shortest < 0.0 || distSq < shortest))
+		{
+			shortest = distSq;
+			found = n;
+		}
+	}
 
-	OsmNode *found = GetClosestNodeInTile(x, y, lon, lat, &distSq);
+	if (tiles)
+	{
+		tiles->UnRef();
+	}
 
 	return found;
 }
@@ -336,9 +738,7 @@ OsmNode *TileDrawer::GetClosestNode(double lon, double lat)
 
 bool TileDrawer::SetSelection(double lon, double lat)
 {
-	OsmNode *s = GetClosestNode(lon, lat);
-
-//	printf("setsel %f %f : %p (%f %f)\n", lon, lat, s, s->m_lon, s->m_lat);
+	unsigned s = GetClosestNode(lon, lat);
 
 	if (s != m_selection)
 	{
@@ -363,7 +763,7 @@ bool TileDrawer::SetSelectedWay(OsmWay *way)
 
 void TileDrawer::DrawOverlay(Renderer *r, bool clear)
 {
-	if (!r->SupportsLayers())
+	if (!HasOverlay(r))
 	{
 		return; //! warn maybe?
 	}
@@ -371,10 +771,10 @@ void TileDrawer::DrawOverlay(Renderer *r, bool clear)
 	if (clear)
 		r->Clear(NUMLAYERS);
 		
-	if (m_selection)
+	if (m_selection != NODE_INVALID)
 	{
-		double lon = m_selection->Lon();
-		double lat = m_selection->Lat();
+		double lon = m_nodes->Lon(m_selection);
+		double lat = m_nodes->Lat(m_selection);
 		r->Rect(lon, lat, 0, 0, 4, m_selectionColor.Red(), m_selectionColor.Green(), m_selectionColor.Blue(), 100, true, NUMLAYERS);
 	}
 
@@ -385,14 +785,26 @@ void TileDrawer::DrawOverlay(Renderer *r, bool clear)
 }
 
 //destroy the list when done. the TileSpans member will not be set
-TileWay *TileDrawer::GetWaysContainingNode(OsmNode *node)
+TileWay *TileDrawer::GetWaysContainingNode(unsigned node)
 {
+	double lon = m_nodes->Lon(node);
+	double lat = m_nodes->Lat(node);
+	TileWay *ret = NULL;
 
-	int x = 0, y = 0;
-	LonLatToIndex(node->Lon(), node->Lat(), &x, &y);
-	
+	// a way is in one tile only, so the lists can just be concatenated
+	TileList *tiles = GetTiles(lon, lat, lon, lat);
+
+	for (TileList *l = tiles; l; l = static_cast<TileList *>(l->m_next))
+	{
+		ret = static_cast<TileWay *>(ListObject::Concat(l->m_tile->GetWaysContainingNode(node), ret));
+	}
 
-	return m_tileArray[x][y]->GetWaysContainingNode(node);
+	if (tiles)
+	{
+		tiles->UnRef();
+	}
+
+	return ret;
 }
 
 bool TileDrawer::SetSelectionColor(int r, int g, int b)
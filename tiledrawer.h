@@ -6,12 +6,15 @@
 
 #include "osm.h"
 #include "renderer.h"
+#include "workerpool.h"
 #include <wx/app.h>
 
 class TileList;
 class RuleControl;
 class ColorRules;
+class RuleSet;
 class TileSpans;
+class BandJob;
 
 
 class TileWay
@@ -25,36 +28,60 @@ class TileWay
 		OsmWay *m_way; // the way to render
 };
 
+// a way with the rule that decides how it looks. the ways are drawn sorted on that, so the renderer
+// gets runs of ways in one style
+struct StyledWay
+{
+	OsmWay *m_way;
+	unsigned m_match;
+	// where it was found, so the ways of one style keep their order
+	unsigned m_order;
+};
+
+// the ways are sorted into a loose quadtree, which only gets deep where there is a lot of data.
+// a way is stored once, in the smallest tile it fits in. the bounds of a tile (the DRect) are
+// twice the size of its cell, so ways on a cell border can still go down into small tiles
 class OsmTile
 	: public IdObject, public DRect
 {
 	public:
-		OsmTile(unsigned id, double minLon, double minLat, double maxLon, double maxLat, OsmTile *next)
-			: IdObject(id, next), DRect(minLon, minLat, maxLon - minLon, maxLat - minLat)
+		OsmTile(unsigned id, double minLon, double minLat, double maxLon, double maxLat, unsigned depth, OsmTile *next)
+			: IdObject(id, next),
+			  DRect(minLon - (maxLon - minLon) / 2, minLat - (maxLat - minLat) / 2, 2 * (maxLon - minLon), 2 * (maxLat - minLat)),
+			  m_cell(minLon, minLat, maxLon - minLon, maxLat - minLat)
 		{
 			m_ways = NULL;
-//            printf("created tile %u %g,%g  %g-%g\n", id, minLon, minLat, maxLon, maxLat);
-		}
+			m_numWays = 0;
+			m_depth = depth;
 
-		~OsmTile()
-		{
-			if (m_ways)
+			for (int i = 0; i < 4; i++)
 			{
-				m_ways->DestroyList();
+				m_children[i] = NULL;
 			}
 		}
 
+		TileWay *GetWaysContainingNode(unsigned node);
 
-		TileWay *GetWaysContainingNode(OsmNode *node);
+		// the cells are allocated in the arena of the TileDrawer, and freed with it
+		void AddWay(Arena *arena, OsmWay *way)
+		{
+			m_ways = new (arena) TileWay(way, m_ways);
+			m_numWays++;
+		}
 
-		void AddWay(OsmWay *way)
+		bool IsSplit()
 		{
-//            printf("tile %u add way %u\n", m_id, way->m_id);
-			m_ways = new TileWay(way, m_ways);
+			return m_children[0] != NULL;
 		}
 
-		TileWay *m_ways;
+		// the child whose bounds contain bb, or NULL if bb is too big for the children
+		OsmTile *FindChild(DRect const &bb);
 
+		TileWay *m_ways;
+		unsigned m_numWays;
+		unsigned m_depth;
+		DRect m_cell;
+		OsmTile *m_children[4];
 };
 
 class Span
@@ -243,15 +270,18 @@ class RenderJob
 	public:
 		RenderJob(Renderer *renderer)
 		{
-			m_bb = renderer->GetViewport();
-			m_curLayer = renderer->SupportsLayers() ? -1 : 0;
-			m_visibleTiles = m_curTile = NULL;
-			m_numTilesToRender = m_numTilesRendered = 0;
-			m_finished = false;
-			m_renderer = renderer;
+			Init(renderer, 0, 0, static_cast<int>(renderer->GetWidth()), static_cast<int>(renderer->GetHeight()));
+		}
+
+		// renders only the pixels x to x + w, y to y + h of renderer, e.g. the strip that became
+		// visible after scrolling. ways are cut off at the edges only when the job runs in bands
+		RenderJob(Renderer *renderer, int x, int y, int w, int h)
+		{
+			Init(renderer, x, y, w, h);
 		}
 		
-		virtual ~RenderJob() { }
+		// stops the bands that are still being rendered
+		virtual ~RenderJob();
 
 		// reports progress. returns true when the rendering should be aborted
 		virtual bool MustCancel(double progress) = 0;
@@ -259,32 +289,39 @@ class RenderJob
 		bool Finished() { return m_finished; }
 
 	private:
+		void Init(Renderer *renderer, int x, int y, int w, int h);
+
 		friend class TileDrawer;
 		TileList *m_visibleTiles, *m_curTile;
 		int m_numTilesToRender, m_numTilesRendered;
 		int m_curLayer;
 		DRect m_bb;
+		// m_bb with the pixels around it that a line can reach. ways outside it are skipped
+		DRect m_cullBB;
+		// the part of the output to render, in pixels from the top left
+		int m_x, m_y, m_w, m_h;
+		int m_lod;
 		bool m_finished;
-//		TileSpans m_renderedTiles;
-		IdSet m_renderedIds;
 		Renderer *m_renderer;
 
+		// the rules as they were when the job started
+		RuleSet *m_ruleSet;
+
+		// if the renderer supports it, horizontal bands of the output are rendered on the worker
+		// threads, and pasted into m_renderer as they finish
+		BandJob **m_bands;
+		int m_numBands, m_numBandsDone;
+		WorkerPool *m_pool;
+		// read by the workers
+		volatile bool m_cancel;
 };
 
 class TileDrawer
 {
 	public:
-		TileDrawer(double minLon,double minLat, double maxLon, double maxLat, double dLon, double dLat);
+		TileDrawer(NodeStore *nodes, double minLon,double minLat, double maxLon, double maxLat);
 
-		~TileDrawer()
-		{
-			m_tiles->DestroyList();
-			for (unsigned x = 0; x < m_xNum; x++)
-			{
-				delete [] m_tileArray[x];
-			}
-			delete [] m_tileArray;
-		}
+		~TileDrawer();
 
 		void AddWays(OsmWay *ways)
 		{
@@ -302,58 +339,45 @@ class TileDrawer
 
 		void AddWay(OsmWay *way)
 		{
-			DRect bb = way->GetBB();
-
-			TileList *tiles = GetTiles(bb);
-			assert(tiles);
-			
-			for (TileList *l = tiles; l; l = static_cast<TileList *>(l->m_next))
-			{
-				l->m_tile->AddWay(way);
-			}
-
-
-			tiles->UnRef();
+			AddWay(way, way->GetBB(m_nodes));
 		}
 
+		// for when the bounding box is already known (e.g. from the cache file). it is kept in the way
+		void AddWay(OsmWay *way, DRect const &bb);
+
 		TileSpans *GetTileSpans(TileList *tiles);
 		
-		TileList *GetTiles(DRect box)
+		TileList *GetTiles(DRect box, double minSize = 0)
 		{
-			return GetTiles(box.m_x, box.m_y, box.m_x + box.m_w, box.m_y + box.m_h);
+			return GetTiles(box.m_x, box.m_y, box.m_x + box.m_w, box.m_y + box.m_h, minSize);
 		}
 
-		// you should UnRef the list when done, which will destroy it if not used anymore
-		TileList *GetTiles(double minLon, double minLat, double maxLon, double maxLat);
+		// you should UnRef the list when done, which will destroy it if not used anymore.
+		// tiles that are smaller than minSize (and so only have ways that are smaller) are left out
+		TileList *GetTiles(double minLon, double minLat, double maxLon, double maxLat, double minSize = 0);
 
 		// numToRender  - render this many tiles and then return (so you can do progress displays etc)
 		// returns true when the job is finished
 		bool RenderTiles(RenderJob *job,int numToRender);
 
-		OsmNode *GetClosestNodeInTile(int x, int y, double lon, double lat, double *foundDistSq);
+		// these return NODE_INVALID if no node was found
+		unsigned GetClosestNodeInTile(OsmTile *tile, double lon, double lat, double *foundDistSq);
 
-		OsmNode *GetClosestNode(double lon, double lat);
+		unsigned GetClosestNode(double lon, double lat);
 
 		//destroy the list when done. the TileSpans member will not be set
-		TileWay *GetWaysContainingNode(OsmNode *node);
+		TileWay *GetWaysContainingNode(unsigned node);
 		
 		// returns true if the selection has changed and you should refresh the canvas
 		bool SetSelection(double lon, double lat);
 
 		void DrawOverlay(Renderer *r, bool clear = false);
 
-		void SetDrawRuleControl(RuleControl *r)
-		{
-			m_drawRule = r;
-		}
-		
-		void SetColorRules(ColorRules *r)
-		{
-			m_colorRules = r;
-		}
+		void SetDrawRuleControl(RuleControl *r);
+		void SetColorRules(ColorRules *r);
 
-		// with explicit colours
-		void RenderWay(Renderer *r, OsmWay *w, wxColour lineColour, bool polygon, wxColour fillColour, int width, int layer);
+		// with explicit colours. lod is the level of detail band, -1 for all nodes
+		void RenderWay(Renderer *r, OsmWay *w, wxColour lineColour, bool polygon, wxColour fillColour, int width, int layer, int lod = -1);
 
 		// with default colours
 		void RenderWay(RenderJob *j, OsmWay *w);
@@ -366,7 +390,7 @@ class TileDrawer
 
 		TileWay *GetSelection()
 		{
-			if (!m_selection)
+			if (m_selection == NODE_INVALID)
 			{
 				return NULL;
 			}
@@ -380,17 +404,47 @@ class TileDrawer
 
 	private:
 
-		void LonLatToIndex(double lon, double lat, int *x, int *y);
+		// splits a full tile, and moves the ways that fit into the children
+		void Split(OsmTile *tile);
+
+		// starts rendering the bands of job on the pool. returns false if the renderer can't do bands
+		bool StartBands(RenderJob *job);
+		// pastes the bands that are done
+		bool PollBands(RenderJob *job);
+
+		friend class BandJob;
+		// called on a worker thread
+		void RenderBand(RenderJob *job, Renderer *band);
+
+		void GetTiles(OsmTile *tile, DRect const &box, double minSize, TileList **list);
+
+		// appends the ways of tile that job draws to ways, which grows as needed. ways that are
+		// completely outside of view are left out
+		void AddStyledWays(RenderJob *job, OsmTile *tile, DRect const &view, StyledWay **ways, unsigned *num, unsigned *max);
 
+		// m_pickRules, made again if the rules changed
+		RuleSet *GetPickRules();
+
+		// all tiles, for destroying them
 		OsmTile *m_tiles;
-		OsmTile ***m_tileArray;
-		unsigned m_xNum, m_yNum;
-		double m_minLon, m_minLat, m_w, m_h, m_dLon, m_dLat;
+		OsmTile *m_root;
+		unsigned m_numTiles;
 
 		RuleControl *m_drawRule;
 		ColorRules *m_colorRules;
+		// the rules for picking nodes, on the gui thread
+		RuleSet *m_pickRules;
+
+		NodeStore *m_nodes;
+
+		// the way lists of all tiles
+		Arena m_arena;
+
+		// renders the bands
+		WorkerPool m_pool;
 
-		OsmNode *m_selection;
+		// index of the selected node in the node store
+		unsigned m_selection;
 		OsmWay *m_selectedWay;
 		wxColour m_selectionColor;
 };
@@ -0,0 +1,171 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#include "workerpool.h"
+
+class WorkerThread
+	: public wxThread
+{
+	public:
+		WorkerThread(WorkerPool *pool)
+			: wxThread(wxTHREAD_JOINABLE)
+		{
+			m_pool = pool;
+		}
+
+	protected:
+		ExitCode Entry()
+		{
+			WorkerJob *job;
+
+			while ((job = m_pool->GetJob()))
+			{
+				job->Run();
+				m_pool->JobDone(job);
+			}
+
+			return 0;
+		}
+
+	private:
+		WorkerPool *m_pool;
+};
+
+WorkerPool::WorkerPool(int numThreads)
+	: m_jobAvailable(m_mutex), m_jobDone(m_mutex)
+{
+	m_first = m_last = NULL;
+	m_numQueued = 0;
+	m_stop = false;
+
+	if (numThreads <= 0)
+	{
+		numThreads = wxThread::GetCPUCount();
+	}
+
+	if (numThreads <= 0)
+	{
+		numThreads = 1;
+	}
+
+	m_threads = new WorkerThread *[numThreads];
+	m_numThreads = 0;
+
+	for (int i = 0; i < numThreads; i++)
+	{
+		WorkerThread *t = new WorkerThread(this);
+
+		if (t->Create() != wxTHREAD_NO_ERROR || t->Run() != wxTHREAD_NO_ERROR)
+		{
+			delete t;
+			break;
+		}
+
+		m_threads[m_numThreads++] = t;
+	}
+
+	// we can't work without threads
+	assert(m_numThreads);
+}
+
+WorkerPool::~WorkerPool()
+{
+	WaitAll();
+
+	m_mutex.Lock();
+	m_stop = true;
+	m_jobAvailable.Broadcast();
+	m_mutex.Unlock();
+
+	for (int i = 0; i < m_numThreads; i++)
+	{
+		m_threads[i]->Wait();
+		delete m_threads[i];
+	}
+
+	delete [] m_threads;
+}
+
+void WorkerPool::Add(WorkerJob *job)
+{
+	wxMutexLocker lock(m_mutex);
+
+	job->m_done = false;
+	job->m_nextJob = NULL;
+
+	if (m_last)
+	{
+		m_last->m_nextJob = job;
+	}
+	else
+	{
+		m_first = job;
+	}
+
+	m_last = job;
+	m_numQueued++;
+
+	m_jobAvailable.Signal();
+}
+
+WorkerJob *WorkerPool::GetJob()
+{
+	wxMutexLocker lock(m_mutex);
+
+	while (!m_first && !m_stop)
+	{
+		m_jobAvailable.Wait();
+	}
+
+	if (!m_first)
+	{
+		return NULL;
+	}
+
+	WorkerJob *job = m_first;
+	m_first = job->m_nextJob;
+
+	if (!m_first)
+	{
+		m_last = NULL;
+	}
+
+	return job;
+}
+
+void WorkerPool::JobDone(WorkerJob *job)
+{
+	wxMutexLocker lock(m_mutex);
+
+	job->m_done = true;
+	m_numQueued--;
+
+	m_jobDone.Broadcast();
+}
+
+void WorkerPool::Wait(WorkerJob *job)
+{
+	wxMutexLocker lock(m_mutex);
+
+	while (!job->m_done)
+	{
+		m_jobDone.Wait();
+	}
+}
+
+bool WorkerPool::IsDone(WorkerJob *job)
+{
+	wxMutexLocker lock(m_mutex);
+
+	return job->m_done;
+}
+
+void WorkerPool::WaitAll()
+{
+	wxMutexLocker lock(m_mutex);
+
+	while (m_numQueued)
+	{
+		m_jobDone.Wait();
+	}
+}
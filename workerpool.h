@@ -0,0 +1,158 @@
+// this file is part of osmbrowser
+// copyright Martijn Versteegh
+// osmbrowser is licenced under the gpl v3
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#include <wx/thread.h>
+#include <assert.h>
+
+// something to be done by a worker thread. the pool doesn't own the jobs, whoever adds a job
+// deletes it after waiting for it
+class WorkerJob
+{
+	public:
+		WorkerJob()
+		{
+			m_done = false;
+			m_nextJob = NULL;
+		}
+
+		virtual ~WorkerJob()
+		{
+		}
+
+		// called on one of the worker threads
+		virtual void Run() = 0;
+
+	private:
+		friend class WorkerPool;
+
+		bool m_done;
+		WorkerJob *m_nextJob;
+};
+
+class WorkerThread;
+
+// a fixed number of threads taking jobs from a fifo
+class WorkerPool
+{
+	public:
+		// numThreads <= 0 means one thread per cpu
+		WorkerPool(int numThreads = 0);
+
+		// waits for the queued jobs to finish
+		~WorkerPool();
+
+		void Add(WorkerJob *job);
+
+		// blocks until the job has run
+		void Wait(WorkerJob *job);
+
+		// true once the job has run, doesn't block
+		bool IsDone(WorkerJob *job);
+
+		// blocks until all jobs added so far have run
+		void WaitAll();
+
+		int GetNumThreads()
+		{
+			return m_numThreads;
+		}
+
+	private:
+		friend class WorkerThread;
+
+		// called by the threads. returns NULL when the pool is shutting down
+		WorkerJob *GetJob();
+		void JobDone(WorkerJob *job);
+
+		wxMutex m_mutex;
+		wxCondition m_jobAvailable;
+		wxCondition m_jobDone;
+
+		WorkerJob *m_first, *m_last;
+		unsigned m_numQueued; // queued or running
+		bool m_stop;
+
+		WorkerThread **m_threads;
+		int m_numThreads;
+};
+
+// a fixed size fifo between threads. Push() blocks while it is full, Pop() while it is empty
+template <class T> class BoundedQueue
+{
+	public:
+		BoundedQueue(unsigned capacity)
+			: m_notEmpty(m_mutex), m_notFull(m_mutex)
+		{
+			assert(capacity);
+			m_capacity = capacity;
+			m_items = new T[capacity];
+			m_first = m_count = 0;
+			m_closed = false;
+		}
+
+		~BoundedQueue()
+		{
+			delete [] m_items;
+		}
+
+		void Push(T const &item)
+		{
+			wxMutexLocker lock(m_mutex);
+
+			while (m_count == m_capacity)
+			{
+				m_notFull.Wait();
+			}
+
+			m_items[(m_first + m_count) % m_capacity] = item;
+			m_count++;
+			m_notEmpty.Signal();
+		}
+
+		// returns false when the queue is closed and empty
+		bool Pop(T *item)
+		{
+			wxMutexLocker lock(m_mutex);
+
+			while (!m_count && !m_closed)
+			{
+				m_notEmpty.Wait();
+			}
+
+			if (!m_count)
+			{
+				return false;
+			}
+
+			*item = m_items[m_first];
+			m_first = (m_first + 1) % m_capacity;
+			m_count--;
+			m_notFull.Signal();
+
+			return true;
+		}
+
+		// no more pushes will follow
+		void Close()
+		{
+			wxMutexLocker lock(m_mutex);
+
+			m_closed = true;
+			m_notEmpty.Broadcast();
+		}
+
+	private:
+		wxMutex m_mutex;
+		wxCondition m_notEmpty;
+		wxCondition m_notFull;
+
+		T *m_items;
+		unsigned m_capacity;
+		unsigned m_first, m_count;
+		bool m_closed;
+};
+
+#endif
@@ -7,6 +7,10 @@
 #include <wx/dcmemory.h>
 #include <wx/log.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 bool HaveRawBitmap()
 {
@@ -18,123 +22,242 @@ bool HaveRawBitmap()
 	return data;
 }
 
-void OverlayImageSurface(cairo_surface_t *src, wxBitmap *dest)
+// t / 255 rounded down, exact for t up to 255 * 255
+#define DIV255(t) (((t) + 1 + ((t) >> 8)) >> 8)
+
+// dst = dst - dst * alpha / 255 + src for every channel, src is premultiplied
+static void BlendRow(wxUint32 *dst, wxUint32 const *src, int n)
 {
-	typedef wxPixelData<wxBitmap, wxNativePixelFormat> PixelData;
-	static bool warned = false;
+	int x = 0;
 
-	PixelData data(*dest);
-	if ( !data )
+#ifdef __SSE2__
+	// four pixels at a time, as 16 bit channels. sse2 is always there on x86-64
+	__m128i const zero = _mm_setzero_si128();
+	__m128i const one = _mm_set1_epi16(1);
+
+	for (; x + 4 <= n; x += 4)
 	{
-		if (!warned)
+		__m128i s = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + x));
+
+		// most of a layer is transparent
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xFFFF)
 		{
-			wxLogDebug("warning, using slow fallback via wximage\n");
-			warned = true;
+			continue;
 		}
-		wxImage tmp = dest->ConvertToImage();
-		OverlayImageSurface(src, &tmp);
-		wxBitmap tmpB(tmp);
 
-		wxMemoryDC dc;
-		dc.SelectObject(*dest);
-		dc.DrawBitmap(tmpB, 0, 0);
-		return;
-	}
+		__m128i d = _mm_loadu_si128(reinterpret_cast<__m128i const *>(dst + x));
 
+		__m128i sLo = _mm_unpacklo_epi8(s, zero);
+		__m128i sHi = _mm_unpackhi_epi8(s, zero);
+		__m128i dLo = _mm_unpacklo_epi8(d, zero);
+		__m128i dHi = _mm_unpackhi_epi8(d, zero);
 
-	PixelData::Iterator p(data);
+		// the alpha of each pixel in all its channels
+		__m128i aLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLo, 0xFF), 0xFF);
+		__m128i aHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHi, 0xFF), 0xFF);
 
-	int w = cairo_image_surface_get_width(src);
-	int srcStride = cairo_image_surface_get_stride(src);
-	int h = cairo_image_surface_get_height(src);
+		__m128i tLo = _mm_mullo_epi16(dLo, aLo);
+		__m128i tHi = _mm_mullo_epi16(dHi, aHi);
 
-	if (dest->GetWidth() < w)
-		w = dest->GetWidth();
+		tLo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tLo, one), _mm_srli_epi16(tLo, 8)), 8);
+		tHi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(tHi, one), _mm_srli_epi16(tHi, 8)), 8);
 
-	if (dest->GetHeight() < h)
-		h = dest->GetHeight();
+		dLo = _mm_add_epi16(_mm_sub_epi16(dLo, tLo), sLo);
+		dHi = _mm_add_epi16(_mm_sub_epi16(dHi, tHi), sHi);
 
-	unsigned char const *srcData  = cairo_image_surface_get_data(src);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_packus_epi16(dLo, dHi));
+	}
+#endif
 
-	for (int y = 0; y < h; y++)
+	for (; x < n; x++)
 	{
-		PixelData::Iterator rowStart = p;
-		wxUint32 const *srcScanline = reinterpret_cast<wxUint32 const *>(srcData + y * srcStride);
+		wxUint32 s = src[x];
 
-		for ( int x = 0; x < w; ++x, ++p )
+		if (!s)
 		{
+			continue;
+		}
 
-			int dstR = p.Red();
-			int dstG = p.Green();
-			int dstB = p.Blue();
+		wxUint32 d = dst[x];
+		wxUint32 a = s >> 24;
+		wxUint32 ret = 0;
 
-			int srcA = (srcScanline[x] >> 24) & 0xFF;
-			int srcR = (srcScanline[x] >> 16) & 0xFF;
-			int srcG = (srcScanline[x] >> 8) & 0xFF;
-			int srcB = (srcScanline[x] >> 0) & 0xFF;
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			wxUint32 dc = (d >> shift) & 0xFF;
+			wxUint32 t = dc * a;
+			wxUint32 c = dc - DIV255(t) + ((s >> shift) & 0xFF);
 
-//			printf("src %d %d %d %d\n", srcA, srcR, srcG, srcB);
+			ret |= (c > 0xFF ? 0xFF : c) << shift;
+		}
 
-			dstR = dstR  - ((dstR * srcA)/0xFF) + srcR;
-			dstG = dstG  - ((dstG * srcA)/0xFF) + srcG;
-			dstB = dstB  - ((dstB * srcA)/0xFF) + srcB;
+		dst[x] = ret;
+	}
+}
+
+// composites the layers for the pixels x to x + w of row y into row, as xrgb
+static void CompositeRow(wxUint32 *row, int x, int y, int w, unsigned char const * const *data, int const *strides, wxRect const *used, int numLayers)
+{
+	for (int i = 0; i < w; i++)
+	{
+		row[i] = 0xFFFFFFFF;
+	}
+
+	for (int i = 0; i < numLayers; i++)
+	{
+		if (y < used[i].y || y >= used[i].y + used[i].height)
+		{
+			continue;
+		}
 
-			p.Red() = dstR;
-			p.Green() = dstG;
-			p.Blue() = dstB;
+		int x1 = used[i].x < x ? x : used[i].x;
+		int x2 = used[i].x + used[i].width > x + w ? x + w : used[i].x + used[i].width;
+
+		if (x1 < x2)
+		{
+			BlendRow(row + x1 - x, reinterpret_cast<wxUint32 const *>(data[i] + y * strides[i]) + x1, x2 - x1);
 		}
+	}
+}
+
+// calls out(row, w) for every row of area, top to bottom
+template <class Writer>
+static void CompositeRows(cairo_surface_t * const *layers, wxRect const *used, int numLayers, wxRect const &area, Writer &out)
+{
+	unsigned char const **data = new unsigned char const *[numLayers ? numLayers : 1];
+	int *strides = new int[numLayers ? numLayers : 1];
+	wxRect *clipped = new wxRect[numLayers ? numLayers : 1];
 
-		p = rowStart;
-		p.OffsetY(data, 1);
+	for (int i = 0; i < numLayers; i++)
+	{
+		cairo_surface_flush(layers[i]);
+		data[i] = cairo_image_surface_get_data(layers[i]);
+		strides[i] = cairo_image_surface_get_stride(layers[i]);
 
+		// where the layer is smaller than the output, the output stays white
+		clipped[i] = used[i];
+		clipped[i].Intersect(wxRect(0, 0, cairo_image_surface_get_width(layers[i]), cairo_image_surface_get_height(layers[i])));
 	}
 
-}
+	wxUint32 *row = new wxUint32[area.width > 0 ? area.width : 1];
 
+	for (int y = area.y; y < area.y + area.height; y++)
+	{
+		CompositeRow(row, area.x, y, area.width, data, strides, clipped, numLayers);
+		out(row, area.width);
+	}
 
+	delete [] row;
+	delete [] clipped;
+	delete [] strides;
+	delete [] data;
+}
 
-void OverlayImageSurface(cairo_surface_t *src, wxImage *dest)
+// writes the rows of area into image
+class ImageRowWriter
 {
-	int w = cairo_image_surface_get_width(src);
-	int srcStride = cairo_image_surface_get_stride(src);
-	int h = cairo_image_surface_get_height(src);
-	int dstStride = dest->GetWidth() * 3;
+	public:
+		ImageRowWriter(wxImage *image, wxRect const &area)
+		{
+			m_stride = image->GetWidth() * 3;
+			m_dst = image->GetData() + area.y * m_stride + area.x * 3;
+		}
 
-	if (dest->GetWidth() < w)
-		w = dest->GetWidth();
+		void operator()(wxUint32 const *row, int w)
+		{
+			for (int x = 0; x < w; x++)
+			{
+				m_dst[3*x] = static_cast<unsigned char>(row[x] >> 16);
+				m_dst[3*x+1] = static_cast<unsigned char>(row[x] >> 8);
+				m_dst[3*x+2] = static_cast<unsigned char>(row[x]);
+			}
+
+			m_dst += m_stride;
+		}
 
-	if (dest->GetHeight() < h)
-		h = dest->GetHeight();
+	private:
+		unsigned char *m_dst;
+		int m_stride;
+};
 
-	unsigned char const *srcData  = cairo_image_surface_get_data(src);
+typedef wxPixelData<wxBitmap, wxNativePixelFormat> NativePixelData;
 
-	unsigned char *dstData = dest->GetData();
+// writes the rows of area into the bitmap data
+class BitmapRowWriter
+{
+	public:
+		BitmapRowWriter(NativePixelData &data, wxRect const &area)
+			: m_data(data), m_p(data)
+		{
+			m_p.Offset(m_data, area.x, area.y);
+		}
 
-	for (int y = 0; y < h; y++)
-	{
-		wxUint32 const *srcScanline = reinterpret_cast<wxUint32 const *>(srcData + y * srcStride);
-		unsigned char *dstScanline = dstData + y * dstStride;
-		for (int x = 0; x < w ; x++)
+		void operator()(wxUint32 const *row, int w)
 		{
-			int dstR = dstScanline[3*x];
-			int dstG = dstScanline[3*x+1];
-			int dstB = dstScanline[3*x+2];
+			NativePixelData::Iterator rowStart = m_p;
 
-			int srcA = (srcScanline[x] >> 24) & 0xFF;
-			int srcR = (srcScanline[x] >> 16) & 0xFF;
-			int srcG = (srcScanline[x] >> 8) & 0xFF;
-			int srcB = (srcScanline[x] >> 0) & 0xFF;
+			for (int x = 0; x < w; ++x, ++m_p)
+			{
+				m_p.Red() = static_cast<unsigned char>(row[x] >> 16);
+				m_p.Green() = static_cast<unsigned char>(row[x] >> 8);
+				m_p.Blue() = static_cast<unsigned char>(row[x]);
+			}
 
-//			printf("src %d %d %d %d\n", srcA, srcR, srcG, srcB);
+			m_p = rowStart;
+			m_p.OffsetY(m_data, 1);
+		}
 
-			dstR = dstR  - ((dstR * srcA)/0xFF) + srcR;
-			dstG = dstG  - ((dstG * srcA)/0xFF) + srcG;
-			dstB = dstB  - ((dstB * srcA)/0xFF) + srcB;
+	private:
+		NativePixelData &m_data;
+		NativePixelData::Iterator m_p;
+};
 
-			dstScanline[3*x] = static_cast<unsigned char>(dstR);
-			dstScanline[3*x+1] = static_cast<unsigned char>(dstG);
-			dstScanline[3*x+2] = static_cast<unsigned char>(dstB);
+void CompositeLayers(cairo_surface_t * const *layers, wxRect const *used, int numLayers, wxRect const &area, wxBitmap *dest)
+{
+	static bool warned = false;
+
+	wxRect a = area;
+	a.Intersect(wxRect(0, 0, dest->GetWidth(), dest->GetHeight()));
+
+	if (a.IsEmpty())
+	{
+		return;
+	}
+
+	NativePixelData data(*dest);
+	if ( !data )
+	{
+		if (!warned)
+		{
+			wxLogDebug("warning, using slow fallback via wximage\n");
+			warned = true;
 		}
+		wxImage tmp = dest->ConvertToImage();
+		CompositeLayers(layers, used, numLayers, a, &tmp);
+		wxBitmap tmpB(tmp);
+
+		wxMemoryDC dc;
+		dc.SelectObject(*dest);
+		dc.DrawBitmap(tmpB, 0, 0);
+		return;
 	}
+
+	BitmapRowWriter out(data, a);
+
+	CompositeRows(layers, used, numLayers, a, out);
 }
 
+void CompositeLayers(cairo_surface_t * const *layers, wxRect const *used, int numLayers, wxRect const &area, wxImage *dest)
+{
+	wxRect a = area;
+	a.Intersect(wxRect(0, 0, dest->GetWidth(), dest->GetHeight()));
+
+	if (a.IsEmpty())
+	{
+		return;
+	}
+
+	ImageRowWriter out(dest, a);
+
+	CompositeRows(layers, used, numLayers, a, out);
+}
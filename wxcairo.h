@@ -6,10 +6,13 @@
 
 #include <cairo.h>
 #include <wx/image.h>
+#include <wx/gdicmn.h>
 
 bool HaveRawBitmap();
 
-void OverlayImageSurface(cairo_surface_t *src, wxImage *dest);
-void OverlayImageSurface(cairo_surface_t *src, wxBitmap *dest);
+// puts the premultiplied argb32 layers over white, in one pass, for the pixels in area of dest.
+// used[i] is the part of layer i that can have anything in it, the rest of the layer is skipped
+void CompositeLayers(cairo_surface_t * const *layers, wxRect const *used, int numLayers, wxRect const &area, wxImage *dest);
+void CompositeLayers(cairo_surface_t * const *layers, wxRect const *used, int numLayers, wxRect const &area, wxBitmap *dest);
 
 #endif
@@ -18,11 +18,14 @@ Canvas::~Canvas()
 {
 }
 
-void Canvas::Draw(wxDC *onto)
+void Canvas::Draw(wxDC *onto, wxRect const *rect)
 {
 	if (!(m_backBuffer.IsOk()))
 		return;
 
+	if (rect && rect->IsEmpty())
+		return;
+
 	bool mustDeleteDC = false;
 
 	if (!onto)
@@ -31,7 +34,18 @@ void Canvas::Draw(wxDC *onto)
 		mustDeleteDC =true;
 	}
 
-	onto->DrawBitmap(wxBitmap(m_backBuffer),0,0,false);
+	if (rect)
+	{
+		wxMemoryDC from;
+		from.SelectObject(m_backBuffer);
+		onto->Blit(rect->x, rect->y, rect->width, rect->height, &from, rect->x, rect->y);
+		from.SelectObject(wxNullBitmap);
+	}
+	else
+	{
+		onto->DrawBitmap(wxBitmap(m_backBuffer),0,0,false);
+	}
+
 	if (mustDeleteDC)
 	{
 		delete onto;
@@ -25,8 +25,8 @@ class Canvas
 	protected:
 		void OnPaint(wxPaintEvent &event);
 		void OnSize(wxSizeEvent &event);
-                // blits backbuffer to dc
-		void Draw(wxDC *onto = NULL);
+                // blits backbuffer to dc. only the part in rect, if given
+		void Draw(wxDC *onto = NULL, wxRect const *rect = NULL);
 
 		DECLARE_EVENT_TABLE();
 };